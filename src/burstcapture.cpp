@@ -0,0 +1,373 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "burstcapture.hpp"
+
+#include "mainloop.hpp"
+#include "valueunits.hpp"
+
+#include <algorithm>
+
+using namespace p44;
+
+static const char* captureStateNames[] = { "idle", "armed", "triggered", "frozen" };
+
+BurstCapture::BurstCapture(CoreRegModelPtr aModel) :
+  mModel(aModel),
+  mSampleSize(0),
+  mNumSamples(0),
+  mPostSamples(0),
+  mInterval(0),
+  mHead(0),
+  mCount(0),
+  mState(capture_idle),
+  mStop(false),
+  mManualTrigger(false),
+  mSamples(0),
+  mReadErrors(0),
+  mArmed(Never),
+  mTriggerTime(Never),
+  mTriggerReg(-1),
+  mTriggerSlot(0),
+  mCaptureTime(0)
+{
+}
+
+
+BurstCapture::~BurstCapture()
+{
+  if (mThread) {
+    mStop = true;
+    mThread->cancel();
+    mThread.reset();
+  }
+}
+
+
+ErrorPtr BurstCapture::addRegisters(const string aNames, bool aTrigger)
+{
+  const char* p = aNames.c_str();
+  string rn;
+  while (nextPart(p, rn, ',')) {
+    rn = trimWhiteSpace(rn);
+    if (rn.empty()) continue;
+    std::vector<CoreRegModel::RegIndex> found;
+    if (rn[rn.size()-1]=='*') {
+      string prefix = rn.substr(0, rn.size()-1);
+      for (CoreRegModel::RegIndex i=0; i<=mModel->maxReg(); i++) {
+        if (mModel->registerDef(i).regname.compare(0, prefix.size(), prefix)==0) found.push_back(i);
+      }
+    }
+    else {
+      CoreRegModel::RegIndex ri = mModel->regindexFromRegName(rn);
+      if (ri<=mModel->maxReg()) found.push_back(ri);
+    }
+    if (found.empty()) return TextError::err("unknown register '%s' for capture", rn.c_str());
+    for (size_t i=0; i<found.size(); i++) {
+      size_t ci;
+      for (ci=0; ci<mRegIndices.size(); ci++) if (mRegIndices[ci]==found[i]) break;
+      if (ci<mRegIndices.size()) {
+        if (aTrigger) mIsTrigger[ci] = true;
+        continue;
+      }
+      mRegIndices.push_back(found[i]);
+      mRegs.push_back(mModel->registerDef(found[i]));
+      mIsTrigger.push_back(aTrigger);
+    }
+  }
+  return ErrorPtr();
+}
+
+
+ErrorPtr BurstCapture::configure(const string aRegNames, const string aTriggerNames, int aNumSamples, int aPostSamples, MLMicroSeconds aInterval)
+{
+  if (mThread) return TextError::err("capture in progress, stop it first");
+  if (aNumSamples<1 || aPostSamples<1) return TextError::err("capture samples and post trigger samples must be at least 1");
+  if (aInterval<0) return TextError::err("capture interval must not be negative");
+  mRegs.clear();
+  mRegIndices.clear();
+  mIsTrigger.clear();
+  ErrorPtr err = addRegisters(aRegNames, false);
+  if (Error::isOK(err)) err = addRegisters(aTriggerNames, true);
+  if (Error::isOK(err) && mRegs.empty()) err = TextError::err("no registers to capture");
+  if (Error::notOK(err)) {
+    mRegs.clear();
+    return err;
+  }
+  // plan SPI reads per sample: registers in address order, combined when close enough
+  std::vector<size_t> order;
+  for (size_t i=0; i<mRegs.size(); i++) order.push_back(i);
+  std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return mRegs[a].addr<mRegs[b].addr; });
+  int maxGap = mModel->maxReadGap();
+  mReads.clear();
+  mRegOffsets.assign(mRegs.size(), 0);
+  mSampleSize = 0;
+  for (size_t oi=0; oi<order.size(); oi++) {
+    const CoreModuleRegister& r = mRegs[order[oi]];
+    if (!mReads.empty()) {
+      CaptureRead& cr = mReads.back();
+      int end = cr.addr+cr.len;
+      int newLen = r.addr+r.rawlen-cr.addr;
+      if (r.addr-end<=maxGap && newLen<=255) {
+        // covered by or appended to the last read (which holds the last bytes of the sample)
+        if (newLen>cr.len) {
+          mSampleSize += newLen-cr.len;
+          cr.len = newLen;
+        }
+        mRegOffsets[order[oi]] = cr.offset+(r.addr-cr.addr);
+        continue;
+      }
+    }
+    CaptureRead cr;
+    cr.addr = r.addr;
+    cr.len = r.rawlen;
+    cr.offset = mSampleSize;
+    mReads.push_back(cr);
+    mRegOffsets[order[oi]] = mSampleSize;
+    mSampleSize += r.rawlen;
+  }
+  // allocate the ring once, the capture thread does not allocate
+  if (aNumSamples<2) aNumSamples = 2;
+  if (aNumSamples>maxCaptureSamples) aNumSamples = maxCaptureSamples;
+  if (aPostSamples>=aNumSamples) aPostSamples = aNumSamples-1;
+  mNumSamples = aNumSamples;
+  mPostSamples = aPostSamples;
+  mInterval = aInterval;
+  mRing.assign(mNumSamples*mSampleSize, 0);
+  mTimes.assign(mNumSamples, Never);
+  mPrevious.assign(mSampleSize, 0);
+  mScratch.assign(mSampleSize, 0);
+  mHead = 0;
+  mCount = 0;
+  mState = capture_idle;
+  LOG(LOG_INFO, "Burst capture: %zu registers, %zu SPI reads/%zu bytes per sample, %zu samples", mRegs.size(), mReads.size(), mSampleSize, mNumSamples);
+  return ErrorPtr();
+}
+
+
+ErrorPtr BurstCapture::arm()
+{
+  if (mThread) return TextError::err("capture already in progress");
+  if (mRegs.empty()) return TextError::err("capture not configured");
+  mHead = 0;
+  mCount = 0;
+  mSamples = 0;
+  mReadErrors = 0;
+  mTriggerTime = Never;
+  mTriggerReg = -1;
+  mCaptureTime = 0;
+  mStop = false;
+  mManualTrigger = false;
+  mArmed = MainLoop::now();
+  mState = capture_armed;
+  mThread = MainLoop::currentMainLoop().executeInThread(
+    boost::bind(&BurstCapture::captureThread, this, _1),
+    boost::bind(&BurstCapture::captureSignal, this, _1, _2)
+  );
+  return ErrorPtr();
+}
+
+
+void BurstCapture::trigger()
+{
+  if (mThread) mManualTrigger = true;
+}
+
+
+void BurstCapture::stop()
+{
+  if (mThread) mStop = true;
+}
+
+
+void BurstCapture::captureThread(ChildThreadWrapper &aThread)
+{
+  // Note: no allocations and no mainloop interaction in here, only SPI reads into the ring
+  CoreSPIProto& proto = mModel->coreSPIProto();
+  bool triggered = false;
+  bool havePrevious = false;
+  size_t post = 0;
+  MLMicroSeconds next = MainLoop::now();
+  while (!mStop) {
+    if (mInterval>0) {
+      MLMicroSeconds now = MainLoop::now();
+      if (now<next) MainLoop::sleep(next-now);
+      next += mInterval;
+    }
+    else {
+      // the bus mutex is not fair: pause between back-to-back samples so the
+      // SPI worker and synchronous readers get a chance to take the bus
+      MainLoop::sleep(minCaptureGap);
+    }
+    uint8_t* sample = &mScratch[0];
+    MLMicroSeconds t = MainLoop::now();
+    bool ok = true;
+    for (size_t i=0; i<mReads.size(); i++) {
+      if (Error::notOK(proto.readData(mReads[i].addr, mReads[i].len, sample+mReads[i].offset))) {
+        ok = false;
+        break;
+      }
+    }
+    if (!ok) {
+      mReadErrors++;
+      MainLoop::sleep(MilliSecond); // do not spin on a failing bus
+      continue;
+    }
+    // complete sample, now it may replace the oldest one in the ring
+    size_t slot = mHead;
+    memcpy(&mRing[slot*mSampleSize], sample, mSampleSize);
+    mTimes[slot] = t;
+    mHead = (slot+1)%mNumSamples;
+    if (mCount<mNumSamples) mCount++;
+    mSamples++;
+    if (!triggered) {
+      if (mManualTrigger) {
+        triggered = true;
+      }
+      else if (havePrevious) {
+        for (size_t i=0; i<mRegs.size(); i++) {
+          if (mIsTrigger[i] && memcmp(sample+mRegOffsets[i], &mPrevious[mRegOffsets[i]], mRegs[i].rawlen)!=0) {
+            mTriggerReg = (int)i;
+            triggered = true;
+            break;
+          }
+        }
+      }
+      if (triggered) {
+        mTriggerTime = t;
+        mTriggerSlot = slot;
+        mState = capture_triggered;
+      }
+      else {
+        memcpy(&mPrevious[0], sample, mSampleSize);
+        havePrevious = true;
+      }
+    }
+    else {
+      post++;
+    }
+    if (triggered && post>=mPostSamples) break;
+  }
+  mCaptureTime = MainLoop::now()-mArmed;
+  mState = triggered ? capture_frozen : capture_idle;
+}
+
+
+void BurstCapture::captureSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+{
+  if (aSignalCode==threadSignalCompleted || aSignalCode==threadSignalFailedToStart || aSignalCode==threadSignalCancelled) {
+    mThread.reset();
+    if (mState==capture_frozen) {
+      LOG(LOG_NOTICE, "Burst capture triggered by %s, %zu samples captured", mTriggerReg>=0 ? mRegs[mTriggerReg].regname.c_str() : "manual trigger", mCount);
+    }
+    else {
+      mState = capture_idle;
+      LOG(LOG_INFO, "Burst capture stopped without trigger, %zu samples captured", mCount);
+    }
+  }
+}
+
+
+JsonObjectPtr BurstCapture::status()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  int st = mState;
+  s->add("state", JsonObject::newString(captureStateNames[st]));
+  JsonObjectPtr regs = JsonObject::newArray();
+  JsonObjectPtr trigs = JsonObject::newArray();
+  for (size_t i=0; i<mRegs.size(); i++) {
+    regs->arrayAppend(JsonObject::newString(mRegs[i].regname));
+    if (mIsTrigger[i]) trigs->arrayAppend(JsonObject::newString(mRegs[i].regname));
+  }
+  s->add("registers", regs);
+  s->add("triggers", trigs);
+  s->add("numSamples", JsonObject::newInt64(mNumSamples));
+  s->add("postSamples", JsonObject::newInt64(mPostSamples));
+  s->add("interval", JsonObject::newDouble((double)mInterval/MilliSecond));
+  s->add("spiReads", JsonObject::newInt64(mReads.size()));
+  s->add("sampleBytes", JsonObject::newInt64(mSampleSize));
+  uint32_t samples = mSamples;
+  s->add("samples", JsonObject::newInt64(samples));
+  s->add("readErrors", JsonObject::newInt64(mReadErrors));
+  if (mArmed!=Never) {
+    MLMicroSeconds d = mThread ? MainLoop::now()-mArmed : mCaptureTime;
+    if (d>0) s->add("rate", JsonObject::newDouble((double)samples*Second/d));
+  }
+  if (st==capture_triggered || st==capture_frozen) {
+    s->add("triggerTime", JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(mTriggerTime)/Second));
+    s->add("triggeredBy", mTriggerReg>=0 ? JsonObject::newString(mRegs[mTriggerReg].regname) : JsonObject::newString("manual"));
+  }
+  return s;
+}
+
+
+JsonObjectPtr BurstCapture::download(size_t aMaxCount)
+{
+  if (mThread) return JsonObjectPtr();
+  size_t n = mCount;
+  size_t oldest = (mHead+mNumSamples-n)%mNumSamples;
+  bool haveTrigger = mTriggerTime!=Never;
+  size_t first = 0;
+  if (aMaxCount>0 && n>aMaxCount) {
+    first = n-aMaxCount;
+    if (haveTrigger) {
+      // center on the trigger
+      size_t tpos = (mTriggerSlot+mNumSamples-oldest)%mNumSamples;
+      first = tpos>aMaxCount/2 ? tpos-aMaxCount/2 : 0;
+      if (first>n-aMaxCount) first = n-aMaxCount;
+    }
+    n = first+aMaxCount;
+  }
+  JsonObjectPtr res = status();
+  JsonObjectPtr t = JsonObject::newArray();
+  JsonObjectPtr dt = JsonObject::newArray();
+  JsonObjectPtr values = JsonObject::newObj();
+  JsonObjectPtr units = JsonObject::newObj();
+  std::vector<JsonObjectPtr> cols;
+  for (size_t ri=0; ri<mRegs.size(); ri++) {
+    JsonObjectPtr c = JsonObject::newArray();
+    values->add(mRegs[ri].regname.c_str(), c);
+    units->add(mRegs[ri].regname.c_str(), JsonObject::newString(valueUnitName(mRegs[ri].unit, true)));
+    cols.push_back(c);
+  }
+  for (size_t i=first; i<n; i++) {
+    size_t slot = (oldest+i)%mNumSamples;
+    t->arrayAppend(JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(mTimes[slot])/Second));
+    if (haveTrigger) dt->arrayAppend(JsonObject::newDouble((double)(mTimes[slot]-mTriggerTime)/MilliSecond));
+    const uint8_t* sample = &mRing[slot*mSampleSize];
+    for (size_t ri=0; ri<mRegs.size(); ri++) {
+      cols[ri]->arrayAppend(JsonObject::newDouble(CoreRegModel::extractReg(&mRegs[ri], sample+mRegOffsets[ri])*mRegs[ri].resolution));
+    }
+  }
+  res->add("t", t);
+  if (haveTrigger) res->add("dt", dt);
+  res->add("values", values);
+  res->add("units", units);
+  return res;
+}
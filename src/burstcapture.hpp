@@ -0,0 +1,144 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__burstcapture__
+#define __kksdcmd__burstcapture__
+
+#include "p44utils_common.hpp"
+#include "coreregmodel.hpp"
+
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+namespace p44 {
+
+  typedef enum {
+    capture_idle, ///< not capturing
+    capture_armed, ///< capturing into the pre-trigger ring, waiting for a trigger
+    capture_triggered, ///< triggered, capturing the post-trigger samples
+    capture_frozen, ///< capture complete, ring contains the samples around the trigger
+  } CaptureState;
+
+
+  /// max number of samples in a capture ring
+  const int maxCaptureSamples = 100000;
+
+  /// pause between back-to-back samples (interval 0), releases the bus to other users
+  const MLMicroSeconds minCaptureGap = 50*MicroSecond;
+
+
+  /// reads a small set of registers back-to-back on its own thread into a pre-allocated ring buffer,
+  /// until a trigger register changes, to record what happened before (and shortly after) an event
+  class BurstCapture : public P44Obj
+  {
+    /// one SPI read of a sample
+    typedef struct {
+      uint16_t addr; ///< SPI address of the first byte to read
+      uint8_t len; ///< number of bytes to read
+      uint16_t offset; ///< offset of the bytes within a sample
+    } CaptureRead;
+
+    CoreRegModelPtr mModel; ///< the model whose SPI protocol handler is used for reading
+
+    // configuration (only changed while not capturing)
+    std::vector<CoreModuleRegister> mRegs; ///< the captured registers (copies, as the map might change)
+    std::vector<CoreRegModel::RegIndex> mRegIndices; ///< the register indices at configuration time
+    std::vector<uint16_t> mRegOffsets; ///< per register: offset of the raw bytes within a sample
+    std::vector<bool> mIsTrigger; ///< per register: set if a change of the register triggers
+    std::vector<CaptureRead> mReads; ///< SPI reads per sample
+    size_t mSampleSize; ///< number of raw bytes per sample
+    size_t mNumSamples; ///< number of samples in the ring
+    size_t mPostSamples; ///< number of samples to capture after the trigger
+    MLMicroSeconds mInterval; ///< min time between samples, 0 for back-to-back (with minCaptureGap pauses)
+
+    // ring (pre-allocated, written only by the capture thread while capturing)
+    std::vector<uint8_t> mRing; ///< raw samples
+    std::vector<MLMicroSeconds> mTimes; ///< per sample: when it was read (mainloop time)
+    std::vector<uint8_t> mPrevious; ///< previous sample, for detecting trigger changes
+    std::vector<uint8_t> mScratch; ///< sample being read, copied into the ring only when complete
+    size_t mHead; ///< next slot to write
+    size_t mCount; ///< number of valid samples
+
+    // capture thread
+    ChildThreadWrapperPtr mThread; ///< the capture thread, NULL when not capturing
+    std::atomic<int> mState; ///< current CaptureState
+    std::atomic<bool> mStop; ///< set to make the capture thread exit
+    std::atomic<bool> mManualTrigger; ///< set to trigger at the next sample
+    std::atomic<uint32_t> mSamples; ///< number of samples read in current capture
+    std::atomic<uint32_t> mReadErrors; ///< number of failed sample reads in current capture
+    MLMicroSeconds mArmed; ///< when capture was armed
+    MLMicroSeconds mTriggerTime; ///< when the trigger sample was read, Never if none
+    int mTriggerReg; ///< index into mRegs of the register that triggered, -1 for manual trigger
+    size_t mTriggerSlot; ///< ring slot of the trigger sample
+    MLMicroSeconds mCaptureTime; ///< duration of the complete capture
+
+  public:
+
+    /// @param aModel the core register model to capture from
+    BurstCapture(CoreRegModelPtr aModel);
+    virtual ~BurstCapture();
+
+    /// configure what to capture
+    /// @param aRegNames comma separated names of the registers to capture
+    /// @param aTriggerNames comma separated names of the registers to trigger on any change of their value.
+    ///   A name ending in '*' matches all registers starting with the name. These are captured as well.
+    /// @param aNumSamples number of samples in the ring buffer, 1..maxCaptureSamples (larger values are clamped)
+    /// @param aPostSamples number of samples to capture after the trigger, at least 1 (clamped to less than aNumSamples)
+    /// @param aInterval min time between samples, 0 to read as fast as SPI allows (with minCaptureGap pauses)
+    /// @return OK or error (e.g. unknown register, invalid sizes, capture in progress)
+    ErrorPtr configure(const string aRegNames, const string aTriggerNames, int aNumSamples, int aPostSamples, MLMicroSeconds aInterval);
+
+    /// start capturing and wait for the trigger
+    /// @return OK or error
+    ErrorPtr arm();
+
+    /// trigger manually (when armed)
+    void trigger();
+
+    /// stop capturing without waiting for a trigger, keeps the samples captured so far
+    void stop();
+
+    /// @return the current state
+    CaptureState state() { return (CaptureState)mState.load(); };
+
+    /// @return json object with state, configuration and counters
+    JsonObjectPtr status();
+
+    /// get the captured samples
+    /// @param aMaxCount max number of samples to return (centered on the trigger, or the most recent ones), 0 for all
+    /// @return json object with "t" (unix time in seconds), "dt" (mS relative to trigger) and one
+    ///   column array per register, NULL while capturing
+    JsonObjectPtr download(size_t aMaxCount);
+
+  private:
+
+    void captureThread(ChildThreadWrapper &aThread);
+    void captureSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
+    ErrorPtr addRegisters(const string aNames, bool aTrigger);
+
+  };
+  typedef boost::intrusive_ptr<BurstCapture> BurstCapturePtr;
+
+} // namespace p44
+
+#endif // __kksdcmd__burstcapture__
@@ -0,0 +1,213 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "corehistory.hpp"
+
+#include "mainloop.hpp"
+
+using namespace p44;
+
+
+// MARK: - HistoryAggregates
+
+HistoryAggregates::HistoryAggregates(MLMicroSeconds aInterval, size_t aSize) :
+  mInterval(aInterval),
+  mHead(0),
+  mCount(0),
+  mClosed(0),
+  mAccStart(Never),
+  mAccMin(0),
+  mAccMax(0),
+  mAccSum(0),
+  mAccCount(0)
+{
+  if (aSize<1) aSize = 1;
+  mTimes.resize(aSize);
+  mMin.resize(aSize);
+  mMax.resize(aSize);
+  mAvg.resize(aSize);
+}
+
+
+bool HistoryAggregates::add(MLMicroSeconds aTime, int32_t aMin, int32_t aMax, int64_t aSum, uint32_t aCount)
+{
+  bool closed = false;
+  MLMicroSeconds start = aTime-aTime%mInterval;
+  if (mAccStart!=start) {
+    if (mAccStart!=Never && mAccCount>0) {
+      // store the interval just finished
+      store();
+      closed = true;
+    }
+    mAccStart = start;
+    mAccMin = aMin;
+    mAccMax = aMax;
+    mAccSum = 0;
+    mAccCount = 0;
+  }
+  if (aMin<mAccMin) mAccMin = aMin;
+  if (aMax>mAccMax) mAccMax = aMax;
+  mAccSum += aSum;
+  mAccCount += aCount;
+  return closed;
+}
+
+
+bool HistoryAggregates::close(MLMicroSeconds aNow)
+{
+  if (mAccStart==Never || mAccCount==0 || aNow<mAccStart+mInterval) return false;
+  store();
+  mAccStart = Never;
+  mAccCount = 0;
+  return true;
+}
+
+
+void HistoryAggregates::store()
+{
+  mTimes[mHead] = mAccStart;
+  mMin[mHead] = mAccMin;
+  mMax[mHead] = mAccMax;
+  mAvg[mHead] = (float)mAccSum/mAccCount;
+  mHead = (mHead+1)%mTimes.size();
+  if (mCount<mTimes.size()) mCount++;
+  mClosed++;
+}
+
+
+// MARK: - RegisterHistory
+
+RegisterHistory::RegisterHistory(size_t aRawSize, size_t aSecondsSize, size_t aMinutesSize) :
+  mRawHead(0),
+  mRawCount(0),
+  mSeconds(Second, aSecondsSize),
+  mMinutes(Minute, aMinutesSize)
+{
+  if (aRawSize<1) aRawSize = 1;
+  mRawTimes.resize(aRawSize);
+  mRawValues.resize(aRawSize);
+}
+
+
+bool RegisterHistory::add(MLMicroSeconds aTime, int32_t aValue)
+{
+  mRawTimes[mRawHead] = aTime;
+  mRawValues[mRawHead] = aValue;
+  mRawHead = (mRawHead+1)%mRawTimes.size();
+  if (mRawCount<mRawTimes.size()) mRawCount++;
+  // pass a completed second on to the minutes (exact, as sum and count are passed along)
+  MLMicroSeconds secStart = mSeconds.mAccStart;
+  int32_t secMin = mSeconds.mAccMin;
+  int32_t secMax = mSeconds.mAccMax;
+  int64_t secSum = mSeconds.mAccSum;
+  uint32_t secCount = mSeconds.mAccCount;
+  if (mSeconds.add(aTime, aValue, aValue, aValue, 1)) {
+    mMinutes.add(secStart, secMin, secMax, secSum, secCount);
+    return true;
+  }
+  return false;
+}
+
+
+void RegisterHistory::closeElapsed(MLMicroSeconds aNow)
+{
+  MLMicroSeconds secStart = mSeconds.mAccStart;
+  int32_t secMin = mSeconds.mAccMin;
+  int32_t secMax = mSeconds.mAccMax;
+  int64_t secSum = mSeconds.mAccSum;
+  uint32_t secCount = mSeconds.mAccCount;
+  if (mSeconds.close(aNow)) {
+    mMinutes.add(secStart, secMin, secMax, secSum, secCount);
+  }
+  mMinutes.close(aNow);
+}
+
+
+bool RegisterHistory::closedSecond(uint64_t aNum, MLMicroSeconds &aStart, int32_t &aMin, int32_t &aMax, float &aAvg)
+{
+  if (aNum>=mSeconds.mClosed || aNum+mSeconds.mCount<mSeconds.mClosed) return false;
+  size_t s = mSeconds.slot((size_t)(mSeconds.mCount-(mSeconds.mClosed-aNum)));
+  aStart = mSeconds.mTimes[s];
+  aMin = mSeconds.mMin[s];
+  aMax = mSeconds.mMax[s];
+  aAvg = mSeconds.mAvg[s];
+  return true;
+}
+
+
+JsonObjectPtr RegisterHistory::query(HistoryResolution aResolution, MLMicroSeconds aSince, size_t aMaxCount, double aScale)
+{
+  JsonObjectPtr res = JsonObject::newObj();
+  JsonObjectPtr t = JsonObject::newArray();
+  res->add("t", t);
+  if (aResolution==history_raw) {
+    JsonObjectPtr v = JsonObject::newArray();
+    res->add("v", v);
+    size_t n = mRawCount;
+    size_t first = 0;
+    if (aMaxCount>0 && n>aMaxCount) first = n-aMaxCount;
+    for (size_t i=first; i<n; i++) {
+      size_t s = (mRawHead+mRawTimes.size()-n+i)%mRawTimes.size();
+      if (aSince!=Never && mRawTimes[s]<aSince) continue;
+      t->arrayAppend(JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(mRawTimes[s])/Second));
+      v->arrayAppend(JsonObject::newDouble(mRawValues[s]*aScale));
+    }
+  }
+  else {
+    HistoryAggregates& a = aResolution==history_seconds ? mSeconds : mMinutes;
+    JsonObjectPtr mn = JsonObject::newArray();
+    JsonObjectPtr mx = JsonObject::newArray();
+    JsonObjectPtr av = JsonObject::newArray();
+    res->add("min", mn);
+    res->add("max", mx);
+    res->add("avg", av);
+    res->add("interval", JsonObject::newDouble((double)a.mInterval/Second));
+    size_t first = 0;
+    if (aMaxCount>0 && a.mCount>aMaxCount) first = a.mCount-aMaxCount;
+    for (size_t i=first; i<a.mCount; i++) {
+      size_t s = a.slot(i);
+      if (aSince!=Never && a.mTimes[s]+a.mInterval<=aSince) continue;
+      t->arrayAppend(JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(a.mTimes[s])/Second));
+      mn->arrayAppend(JsonObject::newDouble(a.mMin[s]*aScale));
+      mx->arrayAppend(JsonObject::newDouble(a.mMax[s]*aScale));
+      av->arrayAppend(JsonObject::newDouble(a.mAvg[s]*aScale));
+    }
+  }
+  return res;
+}
+
+
+size_t RegisterHistory::memoryUsed()
+{
+  size_t aggSlot = sizeof(MLMicroSeconds)+2*sizeof(int32_t)+sizeof(float);
+  return
+    mRawTimes.size()*(sizeof(MLMicroSeconds)+sizeof(int32_t)) +
+    mSeconds.mTimes.size()*aggSlot +
+    mMinutes.mTimes.size()*aggSlot;
+}
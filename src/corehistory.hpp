@@ -0,0 +1,142 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__corehistory__
+#define __kksdcmd__corehistory__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include <vector>
+
+using namespace std;
+
+namespace p44 {
+
+  /// history resolutions
+  typedef enum {
+    history_raw, ///< every value read from SPI
+    history_seconds, ///< min/max/avg per second
+    history_minutes, ///< min/max/avg per minute
+    numHistoryResolutions
+  } HistoryResolution;
+
+  /// ring buffer of min/max/avg aggregates over fixed time intervals, kept as separate arrays
+  /// (struct-of-arrays) so scanning one column stays within few cache lines
+  class HistoryAggregates
+  {
+    friend class RegisterHistory;
+
+    MLMicroSeconds mInterval; ///< aggregation interval
+    size_t mHead; ///< next slot to write
+    size_t mCount; ///< number of valid slots
+    uint64_t mClosed; ///< total number of intervals closed so far
+    std::vector<MLMicroSeconds> mTimes; ///< start of interval (mainloop time)
+    std::vector<int32_t> mMin; ///< min engineering value in interval
+    std::vector<int32_t> mMax; ///< max engineering value in interval
+    std::vector<float> mAvg; ///< average engineering value in interval
+
+    // interval being accumulated
+    MLMicroSeconds mAccStart; ///< start of current interval, Never if none
+    int32_t mAccMin;
+    int32_t mAccMax;
+    int64_t mAccSum;
+    uint32_t mAccCount;
+
+    HistoryAggregates(MLMicroSeconds aInterval, size_t aSize);
+
+    /// accumulate
+    /// @return true if this closed the previous interval (and stored it in the ring)
+    bool add(MLMicroSeconds aTime, int32_t aMin, int32_t aMax, int64_t aSum, uint32_t aCount);
+
+    /// close the interval being accumulated if it has ended
+    /// @return true if an interval was closed (and stored in the ring)
+    bool close(MLMicroSeconds aNow);
+
+    /// store the accumulated interval in the ring
+    void store();
+
+    /// index of the i-th oldest slot
+    size_t slot(size_t aIdx) const { return (mHead+mTimes.size()-mCount+aIdx)%mTimes.size(); };
+  };
+
+
+  /// history of one register, raw values plus per second and per minute aggregates
+  class RegisterHistory : public P44Obj
+  {
+    // raw values
+    size_t mRawHead; ///< next slot to write
+    size_t mRawCount; ///< number of valid slots
+    std::vector<MLMicroSeconds> mRawTimes; ///< when value was read (mainloop time)
+    std::vector<int32_t> mRawValues; ///< engineering value
+    // aggregates
+    HistoryAggregates mSeconds;
+    HistoryAggregates mMinutes;
+
+  public:
+
+    /// @param aRawSize number of raw values to keep
+    /// @param aSecondsSize number of per second aggregates to keep
+    /// @param aMinutesSize number of per minute aggregates to keep
+    RegisterHistory(size_t aRawSize, size_t aSecondsSize, size_t aMinutesSize);
+
+    /// add a value
+    /// @param aTime when the value was read (mainloop time, must not decrease)
+    /// @param aValue engineering value
+    /// @return true if this value closed a second (see closedSeconds())
+    bool add(MLMicroSeconds aTime, int32_t aValue);
+
+    /// close the second (and minute) being accumulated if it has ended, even if no new value was read yet
+    /// @param aNow current mainloop time
+    /// @note calling this for all registers on a common tick makes their seconds close in time order,
+    ///   regardless of how often each register is read
+    void closeElapsed(MLMicroSeconds aNow);
+
+    /// @return total number of per second aggregates closed so far
+    uint64_t closedSeconds() { return mSeconds.mClosed; };
+
+    /// get a closed per second aggregate
+    /// @param aNum number of the aggregate, counting all ever closed (0..closedSeconds()-1)
+    /// @param aStart receives the start of the second (mainloop time)
+    /// @param aMin receives the min engineering value
+    /// @param aMax receives the max engineering value
+    /// @param aAvg receives the average engineering value
+    /// @return false if the aggregate is no longer (or not yet) in the ring
+    bool closedSecond(uint64_t aNum, MLMicroSeconds &aStart, int32_t &aMin, int32_t &aMax, float &aAvg);
+
+    /// query the history
+    /// @param aResolution which resolution to return
+    /// @param aSince only return entries at or after this mainloop time, Never for all
+    /// @param aMaxCount max number of (most recent) entries to return, 0 for all
+    /// @param aScale factor to convert engineering values into user values
+    /// @return json object with column arrays: "t" (unix time in seconds) and "v" for raw values,
+    ///   "t", "min", "max", "avg" for aggregates
+    JsonObjectPtr query(HistoryResolution aResolution, MLMicroSeconds aSince, size_t aMaxCount, double aScale);
+
+    /// @return memory used for the history data in bytes
+    size_t memoryUsed();
+
+  };
+  typedef boost::intrusive_ptr<RegisterHistory> RegisterHistoryPtr;
+
+} // namespace p44
+
+#endif // __kksdcmd__corehistory__
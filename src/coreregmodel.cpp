@@ -29,6 +29,7 @@
 #include "coreregmodel.hpp"
 
 #include "valueunits.hpp"
+#include "fnv.hpp"
 
 #include <math.h>
 
@@ -36,215 +37,223 @@ using namespace p44;
 
 // MARK: - Core Module Register definitions
 
-enum {
-  reg_byte = 0x1,
-  reg_word = 0x2,
-  reg_triplet = 0x3,
-  reg_long = 0x4,
-  reg_bytecount_mask = 0xF,
-  reg_signed = 0x100,
-  // combinations
-  reg_uint8 = reg_byte,
-  reg_sint8 = reg_byte|reg_signed,
-  reg_uint16 = reg_word,
-  reg_sint16 = reg_word|reg_signed,
-  reg_uint24 = reg_triplet,
-};
-typedef uint16_t RegisterLayout;
-
-
-typedef struct {
-  const char *regname; ///< register name
-  const char *description; ///< description
-  long min; ///< signed minimum engineering value
-  long max; ///< signed maximum engineering value
-  double resolution; ///< resolution of one engineering value count (when expressed in ValueUnit as specified with "unit")
-  ValueUnit unit; ///< value unit
-  // SPI side
-  uint16_t addr; ///< address of the first byte
-  uint8_t rawlen; ///< number of raw bytes occupied
-  RegisterLayout layout; ///< register layout
-  // Modbus side
-  uint16_t mbreg; ///< modbus register number
-  bool mbinput; ///< modbus input register
-} CoreModuleRegister;
+// Max number of registers a modbus master can read in one request
+const int mb_maxreadregs = 125;
+
+// Max number of recent changes kept for getChangesSince()
+const size_t maxRecentChanges = 256;
 
 // Modbus register layout constants
 // - R/W registers
 const int mbreg_first = 1;
-const int mb_numregs = 233-mbreg_first+1;
+const int mb_numregs = 233-mbreg_first+1; // minimum, register map might need more
 // - Read-only (input) registers
 const int mbinp_first = 1;
-const int mb_numinps = 250-mbreg_first+1;
+const int mb_numinps = 250-mbreg_first+1; // minimum, register map might need more
 
-// Core module register definitions
+// Built-in core module register definitions
 const CoreModuleRegister coreModuleRegisterDefs[] = {
-  // regname                      description                                 min,     max,       resolution, unit,                                addr,         rawlen,  layout,       mbreg, mbinput  },
+  // regname                      description                                 min,     max,       resolution, unit,                                addr,         rawlen,  layout,       mbreg, mbinput, poll          },
   // - General status (readonly)
-  { "ConfigVers",                "Config-Version (major.minor)",              0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         0,            2,       reg_uint16,   1,     true   },
-  { "ConfigVersPatch",           "Config-Version (patch)",                    0,       255,       1,          VALUE_UNIT1(valueUnit_none),         2,            1,       reg_uint8,    2,     true   },
-  { "hwVers",                    "Hardware-Version (major.minor)",            0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         3,            2,       reg_uint16,   3,     true   },
-  { "hwVersPatch",               "Hardware-Version (patch)",                  0,       255,       1,          VALUE_UNIT1(valueUnit_none),         5,            1,       reg_uint8,    4,     true   },
-  { "swVersMcu",                 "Software-Version MCU (major.minor)",        0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         6,            2,       reg_uint16,   5,     true   },
-  { "swVersPatchMcu",            "Software-Version MCU (patch)",              0,       255,       1,          VALUE_UNIT1(valueUnit_none),         8,            1,       reg_uint8,    6,     true   },
-  { "swVersFpga",                "Software-Version FPGA (major.minor)",       0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         9,            2,       reg_uint16,   7,     true   },
-  { "swVersPatchFpga",           "Software-Version FPGA (patch)",             0,       255,       1,          VALUE_UNIT1(valueUnit_none),         11,           1,       reg_uint8,    8,     true   },
-  { "blVersMcu",                 "Bootloader-Version MCU (major.minor)",      0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         12,           2,       reg_uint16,   9,     true   },
-  { "blVersPatchMcu",            "Bootloader-Version MCU (patch)",            0,       255,       1,          VALUE_UNIT1(valueUnit_none),         14,           1,       reg_uint8,    10,    true   },
-  { "blVersFpga",                "Bootloader-Version FPGA (major.minor)",     0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         15,           2,       reg_uint16,   11,    true   },
-  { "blVersPatchFpga",           "Bootloader-Version FPGA (patch)",           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         17,           1,       reg_uint8,    12,    true   },
-  { "modulAddr",                 "Moduladresse (Drehschalter)",               0,       255,       1,          VALUE_UNIT1(valueUnit_none),         18,           1,       reg_uint8,    13,    true   },
-  { "status0",                   "Zustand Ultraschallgenerierung",            0,       255,       1,          VALUE_UNIT1(valueUnit_none),         19,           1,       reg_uint8,    14,    true   },
-  { "status1",                   "Betriebszustand",                           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         20,           1,       reg_uint8,    15,    true   },
-  { "error",                     "Anzeige Fehlerabschaltung",                 0,       255,       1,          VALUE_UNIT1(valueUnit_none),         21,           1,       reg_uint8,    16,    true   },
-  { "warning",                   "Anzeige Warnung",                           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         22,           1,       reg_uint8,    17,    true   },
-  { "actualPower",               "Aktuelle Ist-Leistung",                     0,       100,       1,          VALUE_UNIT1(valueUnit_percent),      23,           1,       reg_uint8,    18,    true   },
-  { "actualFrequency",           "Aktuelle Ist-Frequenz",                     0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        24,           2,       reg_uint16,   19,    true   },
-  { "actualPhase",               "Ist-Phasenlage",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       26,           1,       reg_sint8,    20,    true   },
-  { "temperaturQ1",              "Temperatur Schaltelement 1",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      27,           1,       reg_uint8,    21,    true   },
-  { "temperaturQ2",              "Temperatur Schaltelement 2",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      28,           1,       reg_uint8,    22,    true   },
-  { "temperaturQ3",              "Temperatur Schaltelement 3",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      29,           1,       reg_uint8,    23,    true   },
-  { "temperaturQ4",              "Temperatur Schaltelement 4",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      30,           1,       reg_uint8,    24,    true   },
-  { "temperaturPcb",             "Gehäuse Innentemperatur",                   0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      31,           1,       reg_uint8,    25,    true   },
-  { "powerP",                    "Ist-Wirkleistung in Watt",                  1,       3000,      1,          VALUE_UNIT1(valueUnit_watt),         32,           2,       reg_uint16,   26,    true   },
-  { "powerS",                    "Ist-Scheinleistung in Watt",                1,       3000,      1,          VALUE_UNIT1(valueUnit_voltampere),   34,           2,       reg_uint16,   27,    true   },
-  { "current",                   "HF-Strom",                                  0,       255,       0.1,        VALUE_UNIT1(valueUnit_ampere),       36,           1,       reg_uint8,    28,    true   },
-  { "voltagePowerStage",         "Spannung an Endstufe (Mittelwert)",         0,       255,       2,          VALUE_UNIT1(valueUnit_volt),         37,           1,       reg_uint8,    29,    true   },
-  { "peakVoltagePowerStage",     "Spannung an Endstufe (Peak)",               0,       255,       2,          VALUE_UNIT1(valueUnit_volt),         38,           1,       reg_uint8,    30,    true   },
-  { "pulsWidthPowerState",       "Stellwert Endstufe",                        0,       255,       1,          VALUE_UNIT1(valueUnit_percent),      39,           1,       reg_uint8,    31,    true   },
-  { "serNr",                     "Serienummer Gerät",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         40,           2,       reg_uint16,   32,    true   },
+  { "ConfigVers",                "Config-Version (major.minor)",              0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         0,            2,       reg_uint16,   1,     true,  poll_static   },
+  { "ConfigVersPatch",           "Config-Version (patch)",                    0,       255,       1,          VALUE_UNIT1(valueUnit_none),         2,            1,       reg_uint8,    2,     true,  poll_static   },
+  { "hwVers",                    "Hardware-Version (major.minor)",            0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         3,            2,       reg_uint16,   3,     true,  poll_static   },
+  { "hwVersPatch",               "Hardware-Version (patch)",                  0,       255,       1,          VALUE_UNIT1(valueUnit_none),         5,            1,       reg_uint8,    4,     true,  poll_static   },
+  { "swVersMcu",                 "Software-Version MCU (major.minor)",        0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         6,            2,       reg_uint16,   5,     true,  poll_static   },
+  { "swVersPatchMcu",            "Software-Version MCU (patch)",              0,       255,       1,          VALUE_UNIT1(valueUnit_none),         8,            1,       reg_uint8,    6,     true,  poll_static   },
+  { "swVersFpga",                "Software-Version FPGA (major.minor)",       0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         9,            2,       reg_uint16,   7,     true,  poll_static   },
+  { "swVersPatchFpga",           "Software-Version FPGA (patch)",             0,       255,       1,          VALUE_UNIT1(valueUnit_none),         11,           1,       reg_uint8,    8,     true,  poll_static   },
+  { "blVersMcu",                 "Bootloader-Version MCU (major.minor)",      0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         12,           2,       reg_uint16,   9,     true,  poll_static   },
+  { "blVersPatchMcu",            "Bootloader-Version MCU (patch)",            0,       255,       1,          VALUE_UNIT1(valueUnit_none),         14,           1,       reg_uint8,    10,    true,  poll_static   },
+  { "blVersFpga",                "Bootloader-Version FPGA (major.minor)",     0,     65535,       1,          VALUE_UNIT1(valueUnit_none),         15,           2,       reg_uint16,   11,    true,  poll_static   },
+  { "blVersPatchFpga",           "Bootloader-Version FPGA (patch)",           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         17,           1,       reg_uint8,    12,    true,  poll_static   },
+  { "modulAddr",                 "Moduladresse (Drehschalter)",               0,       255,       1,          VALUE_UNIT1(valueUnit_none),         18,           1,       reg_uint8,    13,    true,  poll_static   },
+  { "status0",                   "Zustand Ultraschallgenerierung",            0,       255,       1,          VALUE_UNIT1(valueUnit_none),         19,           1,       reg_uint8,    14,    true,  poll_fast     },
+  { "status1",                   "Betriebszustand",                           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         20,           1,       reg_uint8,    15,    true,  poll_fast     },
+  { "error",                     "Anzeige Fehlerabschaltung",                 0,       255,       1,          VALUE_UNIT1(valueUnit_none),         21,           1,       reg_uint8,    16,    true,  poll_fast     },
+  { "warning",                   "Anzeige Warnung",                           0,       255,       1,          VALUE_UNIT1(valueUnit_none),         22,           1,       reg_uint8,    17,    true,  poll_fast     },
+  { "actualPower",               "Aktuelle Ist-Leistung",                     0,       100,       1,          VALUE_UNIT1(valueUnit_percent),      23,           1,       reg_uint8,    18,    true,  poll_fast     },
+  { "actualFrequency",           "Aktuelle Ist-Frequenz",                     0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        24,           2,       reg_uint16,   19,    true,  poll_fast     },
+  { "actualPhase",               "Ist-Phasenlage",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       26,           1,       reg_sint8,    20,    true,  poll_fast     },
+  { "temperaturQ1",              "Temperatur Schaltelement 1",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      27,           1,       reg_uint8,    21,    true,  poll_slow     },
+  { "temperaturQ2",              "Temperatur Schaltelement 2",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      28,           1,       reg_uint8,    22,    true,  poll_slow     },
+  { "temperaturQ3",              "Temperatur Schaltelement 3",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      29,           1,       reg_uint8,    23,    true,  poll_slow     },
+  { "temperaturQ4",              "Temperatur Schaltelement 4",                0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      30,           1,       reg_uint8,    24,    true,  poll_slow     },
+  { "temperaturPcb",             "Gehäuse Innentemperatur",                   0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      31,           1,       reg_uint8,    25,    true,  poll_slow     },
+  { "powerP",                    "Ist-Wirkleistung in Watt",                  1,       3000,      1,          VALUE_UNIT1(valueUnit_watt),         32,           2,       reg_uint16,   26,    true,  poll_fast     },
+  { "powerS",                    "Ist-Scheinleistung in Watt",                1,       3000,      1,          VALUE_UNIT1(valueUnit_voltampere),   34,           2,       reg_uint16,   27,    true,  poll_fast     },
+  { "current",                   "HF-Strom",                                  0,       255,       0.1,        VALUE_UNIT1(valueUnit_ampere),       36,           1,       reg_uint8,    28,    true,  poll_fast     },
+  { "voltagePowerStage",         "Spannung an Endstufe (Mittelwert)",         0,       255,       2,          VALUE_UNIT1(valueUnit_volt),         37,           1,       reg_uint8,    29,    true,  poll_fast     },
+  { "peakVoltagePowerStage",     "Spannung an Endstufe (Peak)",               0,       255,       2,          VALUE_UNIT1(valueUnit_volt),         38,           1,       reg_uint8,    30,    true,  poll_fast     },
+  { "pulsWidthPowerState",       "Stellwert Endstufe",                        0,       255,       1,          VALUE_UNIT1(valueUnit_percent),      39,           1,       reg_uint8,    31,    true,  poll_fast     },
+  { "serNr",                     "Serienummer Gerät",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         40,           2,       reg_uint16,   32,    true,  poll_static   },
   
   // - General control (readwrite)
-  { "control0",                  "Kontrollregister",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         50,           1,       reg_uint8,    1,     false  },
-  { "control1",                  "Kontrollregister",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         51,           1,       reg_uint8,    2,     false  },
-  { "targetPower",               "Sollleistung in %",                         10,      100,       1,          VALUE_UNIT1(valueUnit_percent),      52,           1,       reg_uint8,    3,     false  },
-  { "targetPhase",               "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       53,           1,       reg_sint8,    4,     false  },
-  { "frqMin",                    "Untere Grenze Frequenzband",                0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        54,           2,       reg_uint16,   5,     false  },
-  { "frqMax",                    "Obere Grenze Frequenzband",                 0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        56,           2,       reg_uint16,   6,     false  },
-  { "powerRange",                "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt) ,        58,           2,       reg_uint16,   7,     false  },
-  { "degasCycleTime",            "Degas Zykluszeit",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         60,           1,       reg_uint8,    8,     false  },
-  { "degasTime",                 "Degas Zeit",                                0,       255,       1,          VALUE_UNIT1(valueUnit_none),         61,           1,       reg_uint8,    9,     false  },
-  { "degasCycleCount",           "Degas Zykluszähler",                        0,       255,       1,          VALUE_UNIT1(valueUnit_none),         62,           1,       reg_uint8,    10,    false  },
-  { "fwOptions",                 "Firmware-Optionen",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         63,           2,       reg_uint16,   11,    false  },
-  { "customNr",                  "Kundenserienummer",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         65,           2,       reg_uint16,   12,    false  },
-  { "operatingTime",             "Betriebsdauer in Minuten",                  0,       16777215,  1,          VALUE_UNIT1(valueUnit_minute),       67,           3,       reg_uint24,   13,    false  },
-  { "cntPowerUp",                "Powerup-Zähler",                            0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         70,           2,       reg_uint16,   16,    false  },
-  { "cntCrash",                  "Absturzzähler",                             0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         72,           2,       reg_uint16,   17,    false  },
+  { "control0",                  "Kontrollregister",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         50,           1,       reg_uint8,    1,     false,  poll_slow     },
+  { "control1",                  "Kontrollregister",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         51,           1,       reg_uint8,    2,     false,  poll_slow     },
+  { "targetPower",               "Sollleistung in %",                         10,      100,       1,          VALUE_UNIT1(valueUnit_percent),      52,           1,       reg_uint8,    3,     false,  poll_onchange },
+  { "targetPhase",               "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       53,           1,       reg_sint8,    4,     false,  poll_onchange },
+  { "frqMin",                    "Untere Grenze Frequenzband",                0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        54,           2,       reg_uint16,   5,     false,  poll_onchange },
+  { "frqMax",                    "Obere Grenze Frequenzband",                 0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        56,           2,       reg_uint16,   6,     false,  poll_onchange },
+  { "powerRange",                "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt) ,        58,           2,       reg_uint16,   7,     false,  poll_onchange },
+  { "degasCycleTime",            "Degas Zykluszeit",                          0,       255,       1,          VALUE_UNIT1(valueUnit_none),         60,           1,       reg_uint8,    8,     false,  poll_onchange },
+  { "degasTime",                 "Degas Zeit",                                0,       255,       1,          VALUE_UNIT1(valueUnit_none),         61,           1,       reg_uint8,    9,     false,  poll_onchange },
+  { "degasCycleCount",           "Degas Zykluszähler",                        0,       255,       1,          VALUE_UNIT1(valueUnit_none),         62,           1,       reg_uint8,    10,    false,  poll_onchange },
+  { "fwOptions",                 "Firmware-Optionen",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         63,           2,       reg_uint16,   11,    false,  poll_onchange },
+  { "customNr",                  "Kundenserienummer",                         0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         65,           2,       reg_uint16,   12,    false,  poll_onchange },
+  { "operatingTime",             "Betriebsdauer in Minuten",                  0,       16777215,  1,          VALUE_UNIT1(valueUnit_minute),       67,           3,       reg_uint24,   13,    false,  poll_slow     },
+  { "cntPowerUp",                "Powerup-Zähler",                            0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         70,           2,       reg_uint16,   16,    false,  poll_slow     },
+  { "cntCrash",                  "Absturzzähler",                             0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         72,           2,       reg_uint16,   17,    false,  poll_slow     },
 
 
   // Frequenzband 1
-  { "configSet1",                "Konfiguration zu Frequenzband 1",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         115,          2,       reg_uint16,   100,   false  },
-  { "frqMinSet1",                "Untere Grenze Frequenzband 1",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        117,          2,       reg_uint16,   101,   false  },
-  { "frqMaxSet1",                "Obere Grenze Frequenzband 1",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        119,          2,       reg_uint16,   102,   false  },
-  { "phaseSet1",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       121,          1,       reg_sint8,    103,   false  },
-  { "powerSet1",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      122,          1,       reg_uint8,    104,   false  },
-  { "powerRangeSet1",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         123,          2,       reg_uint16,   105,   false  },
-  { "frqSweepShapeSet1",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         125,          1,       reg_uint8,    106,   false  },
-  { "frqSweepModFrqSet1",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        126,          1,       reg_uint8,    107,   false  },
-  { "frqSweepRangeSet1",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        127,          1,       reg_uint8,    108,   false  },
-  { "ampSweepShapeSet1",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         128,          1,       reg_uint8,    109,   false  },
-  { "ampSweepFrqSet1",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        129,          1,       reg_uint8,    110,   false  },
-  { "tempMaxQ1Set1",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      130,          1,       reg_uint8,    111,   false  },
-  { "tempMaxQ2Set1",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      131,          1,       reg_uint8,    112,   false  },
-  { "tempMaxQ3Set1",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      132,          1,       reg_uint8,    113,   false  },
-  { "tempMaxQ4Set1",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      133,          1,       reg_uint8,    114,   false  },
-  { "tempMaxPcbSet1",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      134,          1,       reg_uint8,    115,   false  },
-  { "CntShortSet1",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         135,          2,       reg_uint16,   116,   false  },
-  { "CntOverLoadSet1",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         137,          2,       reg_uint16,   117,   false  },
-  { "CntOpenLoadSet1",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         139,          2,       reg_uint16,   118,   false  },
-  { "CntOverVoltageSet1",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         141,          2,       reg_uint16,   119,   false  },
-  { "CntOverTempSet1",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         143,          2,       reg_uint16,   120,   false  },
-  { "CntNoFrqSet1",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         145,          2,       reg_uint16,   121,   false  },
+  { "configSet1",                "Konfiguration zu Frequenzband 1",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         115,          2,       reg_uint16,   100,   false,  poll_onchange },
+  { "frqMinSet1",                "Untere Grenze Frequenzband 1",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        117,          2,       reg_uint16,   101,   false,  poll_onchange },
+  { "frqMaxSet1",                "Obere Grenze Frequenzband 1",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        119,          2,       reg_uint16,   102,   false,  poll_onchange },
+  { "phaseSet1",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       121,          1,       reg_sint8,    103,   false,  poll_onchange },
+  { "powerSet1",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      122,          1,       reg_uint8,    104,   false,  poll_onchange },
+  { "powerRangeSet1",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         123,          2,       reg_uint16,   105,   false,  poll_onchange },
+  { "frqSweepShapeSet1",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         125,          1,       reg_uint8,    106,   false,  poll_onchange },
+  { "frqSweepModFrqSet1",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        126,          1,       reg_uint8,    107,   false,  poll_onchange },
+  { "frqSweepRangeSet1",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        127,          1,       reg_uint8,    108,   false,  poll_onchange },
+  { "ampSweepShapeSet1",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         128,          1,       reg_uint8,    109,   false,  poll_onchange },
+  { "ampSweepFrqSet1",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        129,          1,       reg_uint8,    110,   false,  poll_onchange },
+  { "tempMaxQ1Set1",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      130,          1,       reg_uint8,    111,   false,  poll_onchange },
+  { "tempMaxQ2Set1",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      131,          1,       reg_uint8,    112,   false,  poll_onchange },
+  { "tempMaxQ3Set1",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      132,          1,       reg_uint8,    113,   false,  poll_onchange },
+  { "tempMaxQ4Set1",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      133,          1,       reg_uint8,    114,   false,  poll_onchange },
+  { "tempMaxPcbSet1",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      134,          1,       reg_uint8,    115,   false,  poll_onchange },
+  { "CntShortSet1",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         135,          2,       reg_uint16,   116,   false,  poll_slow     },
+  { "CntOverLoadSet1",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         137,          2,       reg_uint16,   117,   false,  poll_slow     },
+  { "CntOpenLoadSet1",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         139,          2,       reg_uint16,   118,   false,  poll_slow     },
+  { "CntOverVoltageSet1",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         141,          2,       reg_uint16,   119,   false,  poll_slow     },
+  { "CntOverTempSet1",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         143,          2,       reg_uint16,   120,   false,  poll_slow     },
+  { "CntNoFrqSet1",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         145,          2,       reg_uint16,   121,   false,  poll_slow     },
 
   // Frequenzband 2
-  { "configSet2",                "Konfiguration zu Frequenzband 2",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         150,          2,       reg_uint16,   130,   false  },
-  { "frqMinSet2",                "Untere Grenze Frequenzband 2",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        152,          2,       reg_uint16,   131,   false  },
-  { "frqMaxSet2",                "Obere Grenze Frequenzband 2",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        154,          2,       reg_uint16,   132,   false  },
-  { "phaseSet2",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       156,          1,       reg_sint8,    133,   false  },
-  { "powerSet2",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      157,          1,       reg_uint8,    134,   false  },
-  { "powerRangeSet2",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         158,          2,       reg_uint16,   135,   false  },
-  { "frqSweepShapeSet2",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         160,          1,       reg_uint8,    136,   false  },
-  { "frqSweepModFrqSet2",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        161,          1,       reg_uint8,    137,   false  },
-  { "frqSweepRangeSet2",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        162,          1,       reg_uint8,    138,   false  },
-  { "ampSweepShapeSet2",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         163,          1,       reg_uint8,    139,   false  },
-  { "ampSweepFrqSet2",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        164,          1,       reg_uint8,    140,   false  },
-  { "tempMaxQ1Set2",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      165,          1,       reg_uint8,    141,   false  },
-  { "tempMaxQ2Set2",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      166,          1,       reg_uint8,    142,   false  },
-  { "tempMaxQ3Set2",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      167,          1,       reg_uint8,    143,   false  },
-  { "tempMaxQ4Set2",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      168,          1,       reg_uint8,    144,   false  },
-  { "tempMaxPcbSet2",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      169,          1,       reg_uint8,    145,   false  },
-  { "CntShortSet2",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         170,          2,       reg_uint16,   146,   false  },
-  { "CntOverLoadSet2",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         172,          2,       reg_uint16,   147,   false  },
-  { "CntOpenLoadSet2",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         174,          2,       reg_uint16,   148,   false  },
-  { "CntOverVoltageSet2",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         176,          2,       reg_uint16,   149,   false  },
-  { "CntOverTempSet2",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         178,          2,       reg_uint16,   150,   false  },
-  { "CntNoFrqSet2",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         180,          2,       reg_uint16,   151,   false  },
+  { "configSet2",                "Konfiguration zu Frequenzband 2",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         150,          2,       reg_uint16,   130,   false,  poll_onchange },
+  { "frqMinSet2",                "Untere Grenze Frequenzband 2",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        152,          2,       reg_uint16,   131,   false,  poll_onchange },
+  { "frqMaxSet2",                "Obere Grenze Frequenzband 2",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        154,          2,       reg_uint16,   132,   false,  poll_onchange },
+  { "phaseSet2",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       156,          1,       reg_sint8,    133,   false,  poll_onchange },
+  { "powerSet2",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      157,          1,       reg_uint8,    134,   false,  poll_onchange },
+  { "powerRangeSet2",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         158,          2,       reg_uint16,   135,   false,  poll_onchange },
+  { "frqSweepShapeSet2",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         160,          1,       reg_uint8,    136,   false,  poll_onchange },
+  { "frqSweepModFrqSet2",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        161,          1,       reg_uint8,    137,   false,  poll_onchange },
+  { "frqSweepRangeSet2",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        162,          1,       reg_uint8,    138,   false,  poll_onchange },
+  { "ampSweepShapeSet2",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         163,          1,       reg_uint8,    139,   false,  poll_onchange },
+  { "ampSweepFrqSet2",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        164,          1,       reg_uint8,    140,   false,  poll_onchange },
+  { "tempMaxQ1Set2",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      165,          1,       reg_uint8,    141,   false,  poll_onchange },
+  { "tempMaxQ2Set2",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      166,          1,       reg_uint8,    142,   false,  poll_onchange },
+  { "tempMaxQ3Set2",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      167,          1,       reg_uint8,    143,   false,  poll_onchange },
+  { "tempMaxQ4Set2",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      168,          1,       reg_uint8,    144,   false,  poll_onchange },
+  { "tempMaxPcbSet2",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      169,          1,       reg_uint8,    145,   false,  poll_onchange },
+  { "CntShortSet2",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         170,          2,       reg_uint16,   146,   false,  poll_slow     },
+  { "CntOverLoadSet2",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         172,          2,       reg_uint16,   147,   false,  poll_slow     },
+  { "CntOpenLoadSet2",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         174,          2,       reg_uint16,   148,   false,  poll_slow     },
+  { "CntOverVoltageSet2",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         176,          2,       reg_uint16,   149,   false,  poll_slow     },
+  { "CntOverTempSet2",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         178,          2,       reg_uint16,   150,   false,  poll_slow     },
+  { "CntNoFrqSet2",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         180,          2,       reg_uint16,   151,   false,  poll_slow     },
 
   // Frequenzband 3
-  { "configSet3",                "Konfiguration zu Frequenzband 3",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         185,          2,       reg_uint16,   160,   false  },
-  { "frqMinSet3",                "Untere Grenze Frequenzband 3",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        187,          2,       reg_uint16,   161,   false  },
-  { "frqMaxSet3",                "Obere Grenze Frequenzband 3",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        189,          2,       reg_uint16,   162,   false  },
-  { "phaseSet3",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       191,          1,       reg_sint8,    163,   false  },
-  { "powerSet3",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      192,          1,       reg_uint8,    164,   false  },
-  { "powerRangeSet3",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         193,          2,       reg_uint16,   165,   false  },
-  { "frqSweepShapeSet3",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         195,          1,       reg_uint8,    166,   false  },
-  { "frqSweepModFrqSet3",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        196,          1,       reg_uint8,    167,   false  },
-  { "frqSweepRangeSet3",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        197,          1,       reg_uint8,    168,   false  },
-  { "ampSweepShapeSet3",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         198,          1,       reg_uint8,    169,   false  },
-  { "ampSweepFrqSet3",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        199,          1,       reg_uint8,    170,   false  },
-  { "tempMaxQ1Set3",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      200,          1,       reg_uint8,    171,   false  },
-  { "tempMaxQ2Set3",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      201,          1,       reg_uint8,    172,   false  },
-  { "tempMaxQ3Set3",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      202,          1,       reg_uint8,    173,   false  },
-  { "tempMaxQ4Set3",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      203,          1,       reg_uint8,    174,   false  },
-  { "tempMaxPcbSet3",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      204,          1,       reg_uint8,    175,   false  },
-  { "CntShortSet3",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         205,          2,       reg_uint16,   176,   false  },
-  { "CntOverLoadSet3",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         207,          2,       reg_uint16,   177,   false  },
-  { "CntOpenLoadSet3",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         209,          2,       reg_uint16,   178,   false  },
-  { "CntOverVoltageSet3",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         211,          2,       reg_uint16,   179,   false  },
-  { "CntOverTempSet3",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         213,          2,       reg_uint16,   180,   false  },
-  { "CntNoFrqSet3",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         215,          2,       reg_uint16,   181,   false  },
+  { "configSet3",                "Konfiguration zu Frequenzband 3",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         185,          2,       reg_uint16,   160,   false,  poll_onchange },
+  { "frqMinSet3",                "Untere Grenze Frequenzband 3",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        187,          2,       reg_uint16,   161,   false,  poll_onchange },
+  { "frqMaxSet3",                "Obere Grenze Frequenzband 3",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        189,          2,       reg_uint16,   162,   false,  poll_onchange },
+  { "phaseSet3",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       191,          1,       reg_sint8,    163,   false,  poll_onchange },
+  { "powerSet3",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      192,          1,       reg_uint8,    164,   false,  poll_onchange },
+  { "powerRangeSet3",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         193,          2,       reg_uint16,   165,   false,  poll_onchange },
+  { "frqSweepShapeSet3",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         195,          1,       reg_uint8,    166,   false,  poll_onchange },
+  { "frqSweepModFrqSet3",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        196,          1,       reg_uint8,    167,   false,  poll_onchange },
+  { "frqSweepRangeSet3",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        197,          1,       reg_uint8,    168,   false,  poll_onchange },
+  { "ampSweepShapeSet3",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         198,          1,       reg_uint8,    169,   false,  poll_onchange },
+  { "ampSweepFrqSet3",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        199,          1,       reg_uint8,    170,   false,  poll_onchange },
+  { "tempMaxQ1Set3",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      200,          1,       reg_uint8,    171,   false,  poll_onchange },
+  { "tempMaxQ2Set3",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      201,          1,       reg_uint8,    172,   false,  poll_onchange },
+  { "tempMaxQ3Set3",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      202,          1,       reg_uint8,    173,   false,  poll_onchange },
+  { "tempMaxQ4Set3",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      203,          1,       reg_uint8,    174,   false,  poll_onchange },
+  { "tempMaxPcbSet3",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      204,          1,       reg_uint8,    175,   false,  poll_onchange },
+  { "CntShortSet3",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         205,          2,       reg_uint16,   176,   false,  poll_slow     },
+  { "CntOverLoadSet3",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         207,          2,       reg_uint16,   177,   false,  poll_slow     },
+  { "CntOpenLoadSet3",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         209,          2,       reg_uint16,   178,   false,  poll_slow     },
+  { "CntOverVoltageSet3",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         211,          2,       reg_uint16,   179,   false,  poll_slow     },
+  { "CntOverTempSet3",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         213,          2,       reg_uint16,   180,   false,  poll_slow     },
+  { "CntNoFrqSet3",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         215,          2,       reg_uint16,   181,   false,  poll_slow     },
 
   // Frequenzband 4
-  { "configSet4",                "Konfiguration zu Frequenzband 4",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         220,          2,       reg_uint16,   190,   false  },
-  { "frqMinSet4",                "Untere Grenze Frequenzband 4",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        222,          2,       reg_uint16,   191,   false  },
-  { "frqMaxSet4",                "Obere Grenze Frequenzband 4",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        224,          2,       reg_uint16,   192,   false  },
-  { "phaseSet4",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       226,          1,       reg_sint8,    193,   false  },
-  { "powerSet4",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      227,          1,       reg_uint8,    194,   false  },
-  { "powerRangeSet4",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         228,          2,       reg_uint16,   195,   false  },
-  { "frqSweepShapeSet4",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         230,          1,       reg_uint8,    196,   false  },
-  { "frqSweepModFrqSet4",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        231,          1,       reg_uint8,    197,   false  },
-  { "frqSweepRangeSet4",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        232,          1,       reg_uint8,    198,   false  },
-  { "ampSweepShapeSet4",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         233,          1,       reg_uint8,    199,   false  },
-  { "ampSweepFrqSet4",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        234,          1,       reg_uint8,    200,   false  },
-  { "tempMaxQ1Set4",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      235,          1,       reg_uint8,    201,   false  },
-  { "tempMaxQ2Set4",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      236,          1,       reg_uint8,    202,   false  },
-  { "tempMaxQ3Set4",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      237,          1,       reg_uint8,    203,   false  },
-  { "tempMaxQ4Set4",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      238,          1,       reg_uint8,    204,   false  },
-  { "tempMaxPcbSet4",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      239,          1,       reg_uint8,    205,   false  },
-  { "CntShortSet4",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         240,          2,       reg_uint16,   206,   false  },
-  { "CntOverLoadSet4",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         242,          2,       reg_uint16,   207,   false  },
-  { "CntOpenLoadSet4",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         244,          2,       reg_uint16,   208,   false  },
-  { "CntOverVoltageSet4",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         246,          2,       reg_uint16,   209,   false  },
-  { "CntOverTempSet4",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         248,          2,       reg_uint16,   210,   false  },
-  { "CntNoFrqSet4",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         250,          2,       reg_uint16,   211,   false  },  
+  { "configSet4",                "Konfiguration zu Frequenzband 4",           0,       65535,     1,          VALUE_UNIT1(valueUnit_none),         220,          2,       reg_uint16,   190,   false,  poll_onchange },
+  { "frqMinSet4",                "Untere Grenze Frequenzband 4",              0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        222,          2,       reg_uint16,   191,   false,  poll_onchange },
+  { "frqMaxSet4",                "Obere Grenze Frequenzband 4",               0,       4000,      100,        VALUE_UNIT1(valueUnit_hertz),        224,          2,       reg_uint16,   192,   false,  poll_onchange },
+  { "phaseSet4",                 "Sollphase in °",                            -90,     90,        1,          VALUE_UNIT1(valueUnit_degree),       226,          1,       reg_sint8,    193,   false,  poll_onchange },
+  { "powerSet4",                 "Startwert Sollleistung in %",               1,       100,       1,          VALUE_UNIT1(valueUnit_percent),      227,          1,       reg_uint8,    194,   false,  poll_onchange },
+  { "powerRangeSet4",            "Einstellung maximale Leistung",             0,       4000,      1,          VALUE_UNIT1(valueUnit_watt),         228,          2,       reg_uint16,   195,   false,  poll_onchange },
+  { "frqSweepShapeSet4",         "Kurvenform Wobbelung (frqSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         230,          1,       reg_uint8,    196,   false,  poll_onchange },
+  { "frqSweepModFrqSet4",        "Wobbelfrequenz (frqSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        231,          1,       reg_uint8,    197,   false,  poll_onchange },
+  { "frqSweepRangeSet4",         "Wobbelamplitude (frqSweep)",                0,       255,       100,        VALUE_UNIT1(valueUnit_hertz),        232,          1,       reg_uint8,    198,   false,  poll_onchange },
+  { "ampSweepShapeSet4",         "Kurvenform Wobbelung (ampSweep)",           0,       3,         1,          VALUE_UNIT1(valueUnit_none),         233,          1,       reg_uint8,    199,   false,  poll_onchange },
+  { "ampSweepFrqSet4",           "Wobbelfrequenz (ampSweep)",                 0,       255,       1,          VALUE_UNIT1(valueUnit_hertz),        234,          1,       reg_uint8,    200,   false,  poll_onchange },
+  { "tempMaxQ1Set4",             "max. Temperatur Schaltelement 1",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      235,          1,       reg_uint8,    201,   false,  poll_onchange },
+  { "tempMaxQ2Set4",             "max. Temperatur Schaltelement 2",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      236,          1,       reg_uint8,    202,   false,  poll_onchange },
+  { "tempMaxQ3Set4",             "max. Temperatur Schaltelement 3",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      237,          1,       reg_uint8,    203,   false,  poll_onchange },
+  { "tempMaxQ4Set4",             "max. Temperatur Schaltelement 4",           0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      238,          1,       reg_uint8,    204,   false,  poll_onchange },
+  { "tempMaxPcbSet4",            "max. Temperatur PCB",                       0,       255,       0.5,        VALUE_UNIT1(valueUnit_celsius),      239,          1,       reg_uint8,    205,   false,  poll_onchange },
+  { "CntShortSet4",              "Zähler Kurzschlussabschaltungen",           0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         240,          2,       reg_uint16,   206,   false,  poll_slow     },
+  { "CntOverLoadSet4",           "Zähler Überlastabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         242,          2,       reg_uint16,   207,   false,  poll_slow     },
+  { "CntOpenLoadSet4",           "Zähler Leerlaufabschaltungen",              0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         244,          2,       reg_uint16,   208,   false,  poll_slow     },
+  { "CntOverVoltageSet4",        "Zähler Überspannung",                       0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         246,          2,       reg_uint16,   209,   false,  poll_slow     },
+  { "CntOverTempSet4",           "Zähler Übertemperatur",                     0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         248,          2,       reg_uint16,   210,   false,  poll_slow     },
+  { "CntNoFrqSet4",              "Zähler kein Frequenzpunkt",                 0,       65335,     1,          VALUE_UNIT1(valueUnit_none),         250,          2,       reg_uint16,   211,   false,  poll_slow     },  
 };
-static const int numModuleRegisters = sizeof(coreModuleRegisterDefs)/sizeof(CoreModuleRegister);
-
-
-CoreRegModel::CoreRegModel()
+static const int numBuiltinRegisters = sizeof(coreModuleRegisterDefs)/sizeof(CoreModuleRegister);
+
+
+CoreRegModel::CoreRegModel(ModbusSlavePtr aModbusSlave, int aModbusOffset) :
+  mModbusSlave(aModbusSlave),
+  mOwnModbusSlave(!aModbusSlave),
+  mModbusOffset(aModbusOffset),
+  mMbNumRegs(mb_numregs),
+  mMbNumInputs(mb_numinps),
+  mMaxReadGap(0),
+  mPollBusy(false),
+  mPlanGeneration(0),
+  mPollOverruns(0),
+  mChangeSeq(0),
+  mChangeEpoch((uint32_t)(MainLoop::unixtime()/Second)),
+  mMapVersion(0),
+  mLastImageUpdate(Never),
+  mReadFrames(0),
+  mReadBytes(0),
+  mReadGapBytes(0),
+  mWriteFrames(0),
+  mRefreshInterval(Never),
+  mRefreshing(false),
+  mRefreshNext(0),
+  mRefreshWriteGeneration(0),
+  mReadAhead(mb_maxreadregs),
+  mAccessBurstActive(false),
+  mAccessBurstFirst(0),
+  mAccessBurstLast(0),
+  mWriteBatchActive(false),
+  mWriteGeneration(0),
+  mRefreshStarted(Never),
+  mPollStarted(Never)
 {
-  // set up register model
-  modbusSlave().setRegisterModel(
-    0, 0,
-    0, 0,
-    mbreg_first, mb_numregs,
-    mbinp_first, mb_numinps
-  );
+  mHistorySizes[history_raw] = 0;
+  mHistorySizes[history_seconds] = 0;
+  mHistorySizes[history_minutes] = 0;
+  for (int pc=0; pc<numPollClasses; pc++) {
+    mPollInterval[pc] = Never;
+    mPollDue[pc] = Never;
+    mPollNext[pc] = 0;
+  }
+  // start with built-in register map
+  mRegDefs.assign(coreModuleRegisterDefs, coreModuleRegisterDefs+numBuiltinRegisters);
+  prepareRegisterMap();
 }
 
 
 CoreRegModel::~CoreRegModel()
 {
+  mRefreshTicket.cancel();
+  mHistoryTicket.cancel();
 }
 
 
@@ -257,6 +266,22 @@ ModbusSlave& CoreRegModel::modbusSlave()
 }
 
 
+void CoreRegModel::addModbusMirror(ModbusSlavePtr aMirror)
+{
+  mModbusMirrors.push_back(aMirror);
+}
+
+
+void CoreRegModel::mirrorModbusReg(ModbusSlave& aFrom, int aAddress, bool aInput)
+{
+  uint16_t v = aFrom.getReg(aAddress, aInput);
+  if (&aFrom!=&modbusSlave()) modbusSlave().setReg(aAddress, aInput, v);
+  for (size_t i=0; i<mModbusMirrors.size(); i++) {
+    if (mModbusMirrors[i].get()!=&aFrom) mModbusMirrors[i]->setReg(aAddress, aInput, v);
+  }
+}
+
+
 CoreSPIProto& CoreRegModel::coreSPIProto()
 {
   if (!mCoreSPIProto) {
@@ -266,68 +291,554 @@ CoreSPIProto& CoreRegModel::coreSPIProto()
 }
 
 
+int CoreRegModel::modbusRegisterSpan(bool aInput)
+{
+  return mModbusOffset + (aInput ? mbinp_first+mMbNumInputs : mbreg_first+mMbNumRegs) - 1;
+}
+
+
 CoreRegModel::RegIndex CoreRegModel::maxReg()
 {
-  return numModuleRegisters-1;
+  return numRegs()-1;
+}
+
+
+// MARK: - register map
+
+void CoreRegModel::prepareRegisterMap()
+{
+  // per-register state
+  mLastUpdates.assign(numRegs(), Never);
+  mDirty.assign(numRegs(), false);
+  mWrittenGenerations.assign(numRegs(), mWriteGeneration);
+  mReportedValues.assign(numRegs(), 0);
+  mReportedValid.assign(numRegs(), false);
+  mChanges.clear();
+  mValueSeqs.assign(numRegs(), 0);
+  // formatting
+  mFracDigits.resize(numRegs());
+  mUnitSymbols.resize(numRegs());
+  for (RegIndex i=0; i<numRegs(); i++) {
+    int fracDigits = (int)(-::log(mRegDefs[i].resolution)/::log(10)+0.99);
+    mFracDigits[i] = fracDigits<0 ? 0 : fracDigits;
+    mUnitSymbols[i] = valueUnitName(mRegDefs[i].unit, true);
+  }
+  mMetadata.reset();
+  mMapVersion++;
+  mAccessBurstActive = false;
+  // SPI address space
+  size_t rawsz = 0;
+  mMbNumRegs = mb_numregs;
+  mMbNumInputs = mb_numinps;
+  for (RegIndex i=0; i<numRegs(); i++) {
+    const CoreModuleRegister* regP = &mRegDefs[i];
+    size_t e = regP->addr+regP->rawlen;
+    if (e>rawsz) rawsz = e;
+    int mbe = regP->mbreg + ((regP->layout&reg_bytecount_mask)>2 ? 2 : 1);
+    if (regP->mbinput) {
+      if (mbe-mbinp_first>mMbNumInputs) mMbNumInputs = mbe-mbinp_first;
+    }
+    else {
+      if (mbe-mbreg_first>mMbNumRegs) mMbNumRegs = mbe-mbreg_first;
+    }
+  }
+  mRefreshRaw.assign(rawsz, 0);
+  if (mRefreshing) {
+    // abandon refresh in progress, results would not match new map
+    mRefreshing = false;
+    setBackgroundRefresh(mRefreshInterval);
+  }
+  // set up modbus register model
+  if (mOwnModbusSlave) {
+    modbusSlave().setRegisterModel(
+      0, 0,
+      0, 0,
+      mbreg_first, mMbNumRegs,
+      mbinp_first, mMbNumInputs
+    );
+  }
+  buildLookupIndices();
+  buildReadPlans();
+  // restart history for the new map
+  if (!mHistoryRegNames.empty()) {
+    setHistory(mHistoryRegNames, mHistorySizes[history_raw], mHistorySizes[history_seconds], mHistorySizes[history_minutes]);
+  }
+  if (mHistoryStore) {
+    ErrorPtr err = mHistoryStore->open(registerMapHash());
+    if (Error::notOK(err)) LOG(LOG_ERR, "Cannot reopen history store for new register map: %s", err->text());
+  }
 }
 
 
+static const char* layoutNames[] = { "uint8", "sint8", "uint16", "sint16", "uint24", NULL };
+static const RegisterLayout layouts[] = { reg_uint8, reg_sint8, reg_uint16, reg_sint16, reg_uint24 };
 
+static const char* pollClassNames[numPollClasses] = { "fast", "slow", "static", "onchange" };
 
-CoreRegModel::RegIndex CoreRegModel::regindexFromModbusReg(int aModbusReg, bool aInput)
+static const char* layoutName(RegisterLayout aLayout)
 {
-  for (RegIndex i=0; i<numModuleRegisters; i++) {
-    if (coreModuleRegisterDefs[i].mbreg==aModbusReg && coreModuleRegisterDefs[i].mbinput==aInput) {
-      return i;
+  for (int i=0; layoutNames[i]; i++) {
+    if (layouts[i]==aLayout) return layoutNames[i];
+  }
+  return "unknown";
+}
+
+
+ErrorPtr CoreRegModel::loadRegisterMap(const string aFilePath)
+{
+  string text;
+  ErrorPtr err = string_fromfile(aFilePath, text);
+  if (Error::notOK(err)) return err;
+  JsonObjectPtr map = JsonObject::objFromText(text.c_str(), -1, &err, true);
+  if (Error::notOK(err)) return err;
+  JsonObjectPtr regs;
+  if (!map || !map->get("registers", regs) || !regs->isType(json_type_array)) {
+    return Error::err<CoreRegError>(CoreRegError::invalidMap, "register map must have a 'registers' array");
+  }
+  std::vector<CoreModuleRegister> defs;
+  std::unordered_map<string, uint16_t> names;
+  std::unordered_map<uint32_t, uint16_t> mbwords; // modbus registers in use, (mbinput<<16)+mbreg -> register index
+  for (int i=0; i<regs->arrayLength(); i++) {
+    JsonObjectPtr r = regs->arrayGet(i);
+    JsonObjectPtr o;
+    CoreModuleRegister def;
+    if (!r->get("name", o)) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register #%d has no name", i);
+    def.regname = o->stringValue();
+    if (!names.insert(std::make_pair(lowerCase(def.regname), i)).second) {
+      return Error::err<CoreRegError>(CoreRegError::invalidMap, "duplicate register name '%s'", def.regname.c_str());
+    }
+    if (r->get("description", o)) def.description = o->stringValue();
+    def.min = r->get("min", o) ? o->int32Value() : 0;
+    def.max = r->get("max", o) ? o->int32Value() : 0;
+    def.resolution = r->get("resolution", o) ? o->doubleValue() : 1;
+    if (def.resolution==0) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has zero resolution", def.regname.c_str());
+    def.unit = r->get("unit", o) ? stringToValueUnit(o->stringValue()) : VALUE_UNIT1(valueUnit_none);
+    if (!r->get("addr", o)) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has no SPI addr", def.regname.c_str());
+    int32_t addr = o->int32Value();
+    if (addr<0 || addr>0xFFFF) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has invalid SPI addr %d", def.regname.c_str(), addr);
+    def.addr = addr;
+    if (!r->get("layout", o)) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has no layout", def.regname.c_str());
+    string ln = o->stringValue();
+    int li;
+    for (li=0; layoutNames[li]; li++) {
+      if (ln==layoutNames[li]) break;
+    }
+    if (!layoutNames[li]) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has unknown layout '%s'", def.regname.c_str(), ln.c_str());
+    def.layout = layouts[li];
+    def.rawlen = def.layout&reg_bytecount_mask;
+    if (addr+def.rawlen>0x10000) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' exceeds SPI address space", def.regname.c_str());
+    // read plans, buffer offsets and write batches rely on ascending, non-overlapping SPI addresses
+    if (!defs.empty() && def.addr<defs.back().addr+defs.back().rawlen) {
+      return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' SPI addr 0x%04X overlaps or is below previous register '%s'", def.regname.c_str(), def.addr, defs.back().regname.c_str());
+    }
+    int nwords = (def.layout&reg_bytecount_mask)>2 ? 2 : 1;
+    if (!r->get("mbreg", o) || o->int32Value()<1 || o->int32Value()+nwords>0x10000) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has no valid mbreg", def.regname.c_str());
+    def.mbreg = o->int32Value();
+    def.mbinput = r->get("mbinput", o) ? o->boolValue() : false;
+    for (int w=0; w<nwords; w++) {
+      uint32_t key = ((uint32_t)def.mbinput<<16) + def.mbreg+w;
+      std::pair<std::unordered_map<uint32_t, uint16_t>::iterator, bool> ins = mbwords.insert(std::make_pair(key, i));
+      if (!ins.second) {
+        return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' %s register %d overlaps register '%s'", def.regname.c_str(), def.mbinput ? "input" : "holding", def.mbreg+w, defs[ins.first->second].regname.c_str());
+      }
     }
+    def.deadband = r->get("deadband", o) ? (int32_t)(o->doubleValue()/def.resolution+0.5) : 0;
+    def.pollclass = poll_slow;
+    if (r->get("poll", o)) {
+      string pn = o->stringValue();
+      int pc;
+      for (pc=0; pc<numPollClasses; pc++) {
+        if (pn==pollClassNames[pc]) break;
+      }
+      if (pc>=numPollClasses) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register '%s' has unknown poll class '%s'", def.regname.c_str(), pn.c_str());
+      def.pollclass = (PollClass)pc;
+    }
+    defs.push_back(def);
   }
-  return numModuleRegisters; // invalid index
+  if (defs.empty()) return Error::err<CoreRegError>(CoreRegError::invalidMap, "register map is empty");
+  // valid, use it
+  mRegDefs.swap(defs);
+  prepareRegisterMap();
+  LOG(LOG_NOTICE, "Loaded register map with %d registers from '%s'", numRegs(), aFilePath.c_str());
+  return ErrorPtr();
 }
 
 
-CoreRegModel::RegIndex CoreRegModel::regindexFromRegName(const string aRegName)
+JsonObjectPtr CoreRegModel::getRegisterMap()
+{
+  JsonObjectPtr regs = JsonObject::newArray();
+  for (RegIndex i=0; i<numRegs(); i++) {
+    const CoreModuleRegister* regP = &mRegDefs[i];
+    JsonObjectPtr r = JsonObject::newObj();
+    r->add("name", JsonObject::newString(regP->regname));
+    r->add("description", JsonObject::newString(regP->description));
+    r->add("min", JsonObject::newInt64(regP->min));
+    r->add("max", JsonObject::newInt64(regP->max));
+    r->add("resolution", JsonObject::newDouble(regP->resolution));
+    r->add("unit", JsonObject::newString(valueUnitName(regP->unit, false)));
+    r->add("addr", JsonObject::newInt32(regP->addr));
+    r->add("layout", JsonObject::newString(layoutName(regP->layout)));
+    r->add("mbreg", JsonObject::newInt32(regP->mbreg));
+    r->add("mbinput", JsonObject::newBool(regP->mbinput));
+    r->add("poll", JsonObject::newString(pollClassNames[regP->pollclass]));
+    if (regP->deadband) r->add("deadband", JsonObject::newDouble(regP->deadband*regP->resolution));
+    regs->arrayAppend(r);
+  }
+  JsonObjectPtr map = JsonObject::newObj();
+  map->add("registers", regs);
+  return map;
+}
+
+
+void CoreRegModel::buildLookupIndices()
 {
-  for (RegIndex i=0; i<numModuleRegisters; i++) {
-    if (strucmp(coreModuleRegisterDefs[i].regname, aRegName.c_str())==0) {
-      return i;
+  mRegIndexByModbusReg.assign(mMbNumRegs, numRegs()); // invalid index for unused modbus registers
+  mRegIndexByModbusInput.assign(mMbNumInputs, numRegs());
+  mRegIndexByName.clear();
+  for (RegIndex i=0; i<numRegs(); i++) {
+    const CoreModuleRegister* regP = &mRegDefs[i];
+    std::vector<uint16_t> &mbIndex = regP->mbinput ? mRegIndexByModbusInput : mRegIndexByModbusReg;
+    int mbi = regP->mbreg - (regP->mbinput ? mbinp_first : mbreg_first);
+    int nmb = (regP->layout&reg_bytecount_mask)>2 ? 2 : 1; // registers with more than 2 bytes also occupy the MSWord modbus register
+    for (int j=0; j<nmb; j++) {
+      if (mbi+j>=0 && mbi+j<(int)mbIndex.size()) mbIndex[mbi+j] = i;
     }
+    mRegIndexByName[lowerCase(regP->regname)] = i;
   }
-  return numModuleRegisters; // invalid index
 }
 
 
+void CoreRegModel::buildReadPlan(std::vector<SPIReadBurst>& aPlan, int aPollClass)
+{
+  // Note: registers are only combined in index order, and only when their SPI addresses ascend.
+  //   When planning for a poll class, registers of other classes are treated like unused gap bytes.
+  aPlan.clear();
+  RegIndex i = 0;
+  while (i<numRegs()) {
+    if (aPollClass>=0 && mRegDefs[i].pollclass!=aPollClass) {
+      i++;
+      continue;
+    }
+    SPIReadBurst b;
+    b.first = i;
+    b.last = i;
+    b.addr = mRegDefs[i].addr;
+    size_t end = b.addr+mRegDefs[i].rawlen;
+    while (++i<numRegs()) {
+      const CoreModuleRegister* regP = &mRegDefs[i];
+      if (regP->addr<end || regP->addr+regP->rawlen-b.addr>255) break; // not ascending or burst would get too long
+      if (aPollClass>=0 && regP->pollclass!=aPollClass) continue; // skip, but check if we can bridge it
+      if (regP->addr-end>(size_t)mMaxReadGap) break; // gap too large
+      end = regP->addr+regP->rawlen;
+      b.last = i;
+    }
+    b.len = end-b.addr;
+    aPlan.push_back(b);
+    i = b.last+1;
+  }
+}
 
-ErrorPtr CoreRegModel::readSPIRegRange(RegIndex aFromIdx, RegIndex &aToIdx, uint8_t* aBuffer, size_t aBufSize)
+
+void CoreRegModel::buildReadPlans()
 {
-  if (aFromIdx>=numModuleRegisters) {
-    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  buildReadPlan(mReadPlan, -1);
+  mPlanGeneration++; // results of poll bursts in progress will be discarded
+  for (int pc=0; pc<numPollClasses; pc++) {
+    buildReadPlan(mPollPlans[pc], pc);
+    mPollNext[pc] = mPollPlans[pc].size(); // no cycle running
   }
-  const CoreModuleRegister* firstRegP = &coreModuleRegisterDefs[aFromIdx];
-  const CoreModuleRegister* regP = firstRegP;
-  size_t blksz = 0;
+  mPollTicket.cancel();
+  pollStep();
+  FOCUSLOG("Read plan: %zu SPI bursts for %d registers (max gap = %d)", mReadPlan.size(), numRegs(), mMaxReadGap);
+}
+
+
+void CoreRegModel::setMaxReadGap(int aMaxGap)
+{
+  if (mRefreshing) {
+    // abandon refresh in progress, it is based on the current plan
+    mRefreshing = false;
+    setBackgroundRefresh(mRefreshInterval);
+  }
+  mMaxReadGap = aMaxGap>0 ? aMaxGap : 0;
+  buildReadPlans();
+}
+
+
+void CoreRegModel::setReadCostModel(MLMicroSeconds aFrameOverhead, uint32_t aBusClockHz)
+{
+  if (aBusClockHz==0) return;
+  // a gap byte costs one byte time, an extra frame costs its fixed overhead plus the framing bytes
+  double byteTime = 8.0*Second/aBusClockHz;
+  setMaxReadGap(CoreSPIProto::frameOverheadBytes + (int)(aFrameOverhead/byteTime));
+  LOG(LOG_INFO, "SPI read cost model: %.1f µS/byte, %lld µS/frame -> reading through gaps up to %d bytes", byteTime, (long long)aFrameOverhead, mMaxReadGap);
+}
+
+
+void CoreRegModel::countRead(RegIndex aFromIdx, RegIndex aToIdx, size_t aLen)
+{
+  mReadFrames++;
+  mReadBytes += aLen;
+  for (RegIndex i=aFromIdx; i<=aToIdx; i++) aLen -= mRegDefs[i].rawlen;
+  mReadGapBytes += aLen;
+}
+
+
+JsonObjectPtr CoreRegModel::getReadStatistics()
+{
+  JsonObjectPtr stats = JsonObject::newObj();
+  stats->add("frames", JsonObject::newInt64(mReadFrames));
+  stats->add("bytes", JsonObject::newInt64(mReadBytes));
+  stats->add("gapBytes", JsonObject::newInt64(mReadGapBytes));
+  stats->add("overheadBytes", JsonObject::newInt64(mReadFrames*CoreSPIProto::frameOverheadBytes));
+  stats->add("writeFrames", JsonObject::newInt64(mWriteFrames));
+  // what a full refresh costs with the current plan
+  size_t planBytes = 0;
+  for (size_t i=0; i<mReadPlan.size(); i++) planBytes += mReadPlan[i].len;
+  stats->add("maxGap", JsonObject::newInt32(mMaxReadGap));
+  stats->add("planFrames", JsonObject::newInt64(mReadPlan.size()));
+  stats->add("planBytes", JsonObject::newInt64(planBytes));
+  for (int pc=0; pc<numPollClasses; pc++) {
+    if (mPollInterval[pc]>0) {
+      stats->add(string_format("%sPollFrames", pollClassNames[pc]).c_str(), JsonObject::newInt64(mPollPlans[pc].size()));
+    }
+  }
+  stats->add("fastPollOverruns", JsonObject::newInt64(mPollOverruns));
+  return stats;
+}
+
+
+JsonObjectPtr CoreRegModel::getStatistics()
+{
+  JsonObjectPtr stats = JsonObject::newObj();
+  stats->add("spi", coreSPIProto().getStatistics());
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("hits", JsonObject::newInt64(mAccessHits.value()));
+  s->add("misses", JsonObject::newInt64(mAccessMisses.value()));
+  s->add("spiTime", mAccessTime.json());
+  s->add("writeBatchTime", mWriteBatchTime.json());
+  stats->add("access", s);
+  s = JsonObject::newObj();
+  s->add("cycles", JsonObject::newInt64(mRefreshCycles.value()));
+  s->add("errors", JsonObject::newInt64(mRefreshErrors.value()));
+  s->add("cycleTime", mRefreshTime.json());
+  stats->add("refresh", s);
+  s = JsonObject::newObj();
+  s->add("errors", JsonObject::newInt64(mPollErrors.value()));
+  s->add("overruns", JsonObject::newInt64(mPollOverruns));
+  s->add("burstTime", mPollTime.json());
+  stats->add("poll", s);
+  return stats;
+}
+
+
+void CoreRegModel::resetStatistics()
+{
+  coreSPIProto().resetStatistics();
+  mAccessHits.reset();
+  mAccessMisses.reset();
+  mAccessTime.reset();
+  mWriteBatchTime.reset();
+  mRefreshCycles.reset();
+  mRefreshErrors.reset();
+  mRefreshTime.reset();
+  mPollErrors.reset();
+  mPollTime.reset();
+}
+
+
+// MARK: - history
+
+static const char* historyResolutionNames[numHistoryResolutions] = { "raw", "seconds", "minutes" };
+
+ErrorPtr CoreRegModel::setHistory(const string aRegNames, size_t aRawSize, size_t aSecondsSize, size_t aMinutesSize)
+{
+  ErrorPtr err;
+  mHistoryRegNames = aRegNames;
+  mHistorySizes[history_raw] = aRawSize;
+  mHistorySizes[history_seconds] = aSecondsSize;
+  mHistorySizes[history_minutes] = aMinutesSize;
+  mHistories.clear();
+  mStoredSeconds.clear();
+  mHistoryTicket.cancel();
+  const char* p = aRegNames.c_str();
+  string rn;
+  while (nextPart(p, rn, ',')) {
+    RegIndex ri = regindexFromRegName(trimWhiteSpace(rn));
+    if (ri>=numRegs()) {
+      err = TextError::err("unknown register '%s' for history", rn.c_str());
+      continue;
+    }
+    if (mHistories.empty()) mHistories.resize(numRegs());
+    if (!mHistories[ri]) mHistories[ri] = RegisterHistoryPtr(new RegisterHistory(aRawSize, aSecondsSize, aMinutesSize));
+  }
+  if (!mHistories.empty()) {
+    mStoredSeconds.assign(numRegs(), 0);
+    historyTick();
+  }
+  return err;
+}
+
+
+void CoreRegModel::historyTick()
+{
+  // close the elapsed seconds of all history registers at once, so these are passed to the store in time order
+  // (registers are read at different rates, so closing a second only when the next value arrives would not)
+  MLMicroSeconds now = MainLoop::now();
+  for (RegIndex i=0; i<mHistories.size(); i++) {
+    if (!mHistories[i]) continue;
+    mHistories[i]->closeElapsed(now);
+    if (mHistoryStore) {
+      uint64_t closed = mHistories[i]->closedSeconds();
+      for (uint64_t n=mStoredSeconds[i]; n<closed; n++) {
+        MLMicroSeconds t;
+        int32_t mn, mx;
+        float avg;
+        if (mHistories[i]->closedSecond(n, t, mn, mx, avg)) {
+          mHistoryStore->add(i, MainLoop::mainLoopTimeToUnixTime(t), mn, mx, avg);
+        }
+      }
+      mStoredSeconds[i] = closed;
+    }
+    else {
+      mStoredSeconds[i] = mHistories[i]->closedSeconds();
+    }
+  }
+  // next tick shortly after the next second has started
+  mHistoryTicket.executeOnce(boost::bind(&CoreRegModel::historyTick, this), Second-now%Second+10*MilliSecond);
+}
+
+
+JsonObjectPtr CoreRegModel::getHistory(RegIndex aRegIdx, HistoryResolution aResolution, MLMicroSeconds aSince, size_t aMaxCount)
+{
+  if (aRegIdx>=mHistories.size() || !mHistories[aRegIdx]) return JsonObjectPtr();
+  MLMicroSeconds since = Never;
+  if (aSince!=Never) since = aSince-MainLoop::unixtime()+MainLoop::now(); // unix to mainloop time
+  JsonObjectPtr h = mHistories[aRegIdx]->query(aResolution, since, aMaxCount, mRegDefs[aRegIdx].resolution);
+  h->add("regidx", JsonObject::newInt32(aRegIdx));
+  h->add("name", JsonObject::newString(mRegDefs[aRegIdx].regname));
+  h->add("resolution", JsonObject::newString(historyResolutionNames[aResolution]));
+  h->add("unit", JsonObject::newString(mUnitSymbols[aRegIdx]));
+  return h;
+}
+
+
+JsonObjectPtr CoreRegModel::getHistoryInfo()
+{
+  JsonObjectPtr info = JsonObject::newObj();
+  JsonObjectPtr sizes = JsonObject::newObj();
+  for (int r=0; r<numHistoryResolutions; r++) {
+    sizes->add(historyResolutionNames[r], JsonObject::newInt64(mHistorySizes[r]));
+  }
+  info->add("sizes", sizes);
+  JsonObjectPtr regs = JsonObject::newArray();
+  size_t mem = 0;
+  for (RegIndex i=0; i<mHistories.size(); i++) {
+    if (!mHistories[i]) continue;
+    regs->arrayAppend(JsonObject::newString(mRegDefs[i].regname));
+    mem += mHistories[i]->memoryUsed();
+  }
+  info->add("registers", regs);
+  info->add("memory", JsonObject::newInt64(mem));
+  if (mHistoryStore) info->add("store", mHistoryStore->info());
+  return info;
+}
+
+
+uint32_t CoreRegModel::registerMapHash()
+{
+  Fnv32 h;
+  for (RegIndex i=0; i<numRegs(); i++) {
+    const CoreModuleRegister* regP = &mRegDefs[i];
+    h.addString(regP->regname);
+    h.addBytes(sizeof(regP->addr), (const uint8_t*)&regP->addr);
+    h.addBytes(sizeof(regP->rawlen), (const uint8_t*)&regP->rawlen);
+    h.addBytes(sizeof(regP->layout), (const uint8_t*)&regP->layout);
+  }
+  return h.getHash();
+}
+
+
+ErrorPtr CoreRegModel::setHistoryStore(HistoryStorePtr aHistoryStore)
+{
+  mHistoryStore = aHistoryStore;
+  if (!mHistoryStore) return ErrorPtr();
+  return mHistoryStore->open(registerMapHash());
+}
+
+
+JsonObjectPtr CoreRegModel::getStoredHistory(RegIndex aRegIdx, MLMicroSeconds aFrom, MLMicroSeconds aTo, size_t aMaxCount)
+{
+  if (!mHistoryStore || aRegIdx>=numRegs()) return JsonObjectPtr();
+  JsonObjectPtr h = mHistoryStore->query(aRegIdx, aFrom, aTo, aMaxCount, mRegDefs[aRegIdx].resolution);
+  h->add("regidx", JsonObject::newInt32(aRegIdx));
+  h->add("name", JsonObject::newString(mRegDefs[aRegIdx].regname));
+  h->add("resolution", JsonObject::newString("seconds"));
+  h->add("unit", JsonObject::newString(mUnitSymbols[aRegIdx]));
+  return h;
+}
+
+
+CoreRegModel::RegIndex CoreRegModel::regindexFromModbusReg(int aModbusReg, bool aInput)
+{
+  const std::vector<uint16_t> &mbIndex = aInput ? mRegIndexByModbusInput : mRegIndexByModbusReg;
+  int mbi = aModbusReg - mModbusOffset - (aInput ? mbinp_first : mbreg_first);
+  if (mbi<0 || mbi>=(int)mbIndex.size()) return numRegs(); // invalid index
+  return mbIndex[mbi];
+}
+
+
+CoreRegModel::RegIndex CoreRegModel::regindexFromRegName(const string aRegName)
+{
+  std::unordered_map<string, uint16_t>::iterator pos = mRegIndexByName.find(lowerCase(aRegName));
+  if (pos==mRegIndexByName.end()) return numRegs(); // invalid index
+  return pos->second;
+}
+
+
+
+size_t CoreRegModel::contiguousSPIRegRange(RegIndex aFromIdx, RegIndex &aToIdx, size_t aMaxBytes)
+{
+  const CoreModuleRegister* regP = &mRegDefs[aFromIdx];
+  size_t start = regP->addr;
+  size_t end = start;
   RegIndex ridx = aFromIdx;
-  // find contiguous block to read
-  while (ridx<=aToIdx && regP->rawlen+blksz<=aBufSize) {
-    blksz+=regP->rawlen;
+  // find block to read, with no more than mMaxReadGap unused bytes between registers
+  while (ridx<=aToIdx && regP->addr+regP->rawlen-start<=aMaxBytes) {
+    end = regP->addr+regP->rawlen;
     ridx++;
-    if (ridx<=aToIdx && regP->addr+regP->rawlen!=(regP+1)->addr) {
-      // next register not contiguous in SPI address space
-      regP = NULL;
+    if (ridx>aToIdx) break;
+    regP++;
+    if (regP->addr<end || regP->addr-end>(size_t)mMaxReadGap) {
+      // next register not contiguous enough in SPI address space
       break;
     }
-    regP++;
   }
   // ridx now is the index+1 of the last register covered
+  aToIdx = ridx-1;
+  return end-start;
+}
+
+
+ErrorPtr CoreRegModel::readSPIRegRange(RegIndex aFromIdx, RegIndex &aToIdx, uint8_t* aBuffer, size_t aBufSize)
+{
+  if (aFromIdx>=numRegs()) {
+    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  }
+  const CoreModuleRegister* firstRegP = &mRegDefs[aFromIdx];
+  RegIndex t = aToIdx;
+  size_t blksz = contiguousSPIRegRange(aFromIdx, t, aBufSize);
   ErrorPtr err = coreSPIProto().readData(firstRegP->addr, blksz, aBuffer);
+  countRead(aFromIdx, t, blksz);
   if (Error::notOK(err)) {
-    err->prefixMessage("Reading from register %s (index %d): ", firstRegP->regname, aFromIdx);
+    err->prefixMessage("Reading from register %s (index %d): ", firstRegP->regname.c_str(), aFromIdx);
     return err;
   }
-  aToIdx = ridx-1;
+  aToIdx = t;
   return ErrorPtr();
 }
 
-static int32_t extractReg(const CoreModuleRegister* aRegP, const uint8_t* aDataP)
+int32_t CoreRegModel::extractReg(const CoreModuleRegister* aRegP, const uint8_t* aDataP)
 {
   int nb = aRegP->layout & reg_bytecount_mask;
   uint32_t data = 0;
@@ -346,13 +857,13 @@ static int32_t extractReg(const CoreModuleRegister* aRegP, const uint8_t* aDataP
 
 
 
-ErrorPtr CoreRegModel::readRegFromBuffer(RegIndex aRegIdx, int32_t &aData, uint8_t* aBuffer, RegIndex aFirstRegIdx, RegIndex aLastRegIdx)
+ErrorPtr CoreRegModel::readRegFromBuffer(RegIndex aRegIdx, int32_t &aData, const uint8_t* aBuffer, RegIndex aFirstRegIdx, RegIndex aLastRegIdx)
 {
-  if (aLastRegIdx>=numModuleRegisters || aRegIdx>aLastRegIdx || aRegIdx<aFirstRegIdx) {
+  if (aLastRegIdx>=numRegs() || aRegIdx>aLastRegIdx || aRegIdx<aFirstRegIdx) {
     return Error::err<CoreRegError>(CoreRegError::invalidIndex);
   }
-  const CoreModuleRegister* regP = &coreModuleRegisterDefs[aRegIdx];
-  const uint8_t* dataP = aBuffer + (regP->addr-coreModuleRegisterDefs[aFirstRegIdx].addr);
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
+  const uint8_t* dataP = aBuffer + (regP->addr-mRegDefs[aFirstRegIdx].addr);
   aData = extractReg(regP, dataP);
   return ErrorPtr();
 }
@@ -384,62 +895,618 @@ static void layoutReg(const CoreModuleRegister* aRegP, const int32_t aData, uint
 
 ErrorPtr CoreRegModel::writeSPIReg(RegIndex aRegIdx, int32_t aData)
 {
-  if (aRegIdx>=numModuleRegisters) {
+  if (aRegIdx>=numRegs()) {
     return Error::err<CoreRegError>(CoreRegError::invalidIndex);
   }
-  const CoreModuleRegister* regP = &coreModuleRegisterDefs[aRegIdx];
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
   uint8_t buf[4];
   layoutReg(regP, aData, buf);
+  mWriteFrames++;
   ErrorPtr err = coreSPIProto().writeData(regP->addr, regP->rawlen, buf);
   if (Error::notOK(err)) {
-    err->prefixMessage("Writing register %s (index %d): ", regP->regname, aRegIdx);
+    err->prefixMessage("Writing register %s (index %d): ", regP->regname.c_str(), aRegIdx);
   }
   return err;
 }
 
 
 
-ErrorPtr CoreRegModel::updateModbusRegistersFromSPI(RegIndex aFromIdx, RegIndex aToIdx)
+ErrorPtr CoreRegModel::updateModbusRegistersFromBuffer(RegIndex aFromIdx, RegIndex aToIdx, const uint8_t* aBuffer, uint32_t aWriteGeneration)
 {
   ErrorPtr err;
-  const size_t bufsz = numModuleRegisters*3; // enough for any range
-  uint8_t buf[bufsz];
-  while (aFromIdx<=aToIdx) {
-    RegIndex t = aToIdx;
-    err = readSPIRegRange(aFromIdx, t, buf, bufsz);
+  MLMicroSeconds now = MainLoop::now();
+  size_t numChanges = 0;
+  for (RegIndex i=aFromIdx; i<=aToIdx; i++) {
+    // registers written after the read was queued already have a more recent value in the image than aBuffer
+    if ((int32_t)(mWrittenGenerations[i]-aWriteGeneration)>0) continue;
+    int32_t data;
+    err = readRegFromBuffer(i, data, aBuffer, aFromIdx, aToIdx);
     if (Error::notOK(err)) return err;
-    for (RegIndex i=aFromIdx; i<=t; i++) {
-      int32_t data;
-      err = readRegFromBuffer(i, data, buf, aFromIdx, t);
-      if (Error::notOK(err)) return err;
-      err = setEngineeringValue(i, data, false); // not user input, allow setting input registers and out-of-bounds values
+    err = setEngineeringValue(i, data, false); // not user input, allow setting input registers and out-of-bounds values
+    mLastUpdates[i] = now;
+    mLastImageUpdate = now;
+    if (!mHistories.empty() && mHistories[i]) {
+      mHistories[i]->add(now, data); // closed seconds are passed to the store by historyTick()
+    }
+    // change detection
+    if (!mReportedValid[i]) {
+      // first value is not a change
+      mReportedValues[i] = data;
+      mReportedValid[i] = true;
+    }
+    else if (data!=mReportedValues[i] && ::abs(data-mReportedValues[i])>=mRegDefs[i].deadband) {
+      recordChange(i, data, now);
+      numChanges++;
+    }
+  }
+  // report changes only now that the modbus image is updated for the entire range
+  if (mChangeCB && numChanges>0) {
+    if (numChanges>mChanges.size()) numChanges = mChanges.size();
+    for (size_t ci=mChanges.size()-numChanges; ci<mChanges.size(); ci++) {
+      RegisterChange chg = mChanges[ci]; // copy, handler might cause more changes
+      mChangeCB(chg);
     }
-    aFromIdx = t+1;
   }
   return err;
 }
 
 
+void CoreRegModel::recordChange(RegIndex aRegIdx, int32_t aNewValue, MLMicroSeconds aWhen)
+{
+  RegisterChange chg;
+  chg.seq = ++mChangeSeq;
+  chg.regIdx = aRegIdx;
+  chg.oldValue = mReportedValid[aRegIdx] ? mReportedValues[aRegIdx] : aNewValue;
+  chg.newValue = aNewValue;
+  chg.when = aWhen;
+  mReportedValues[aRegIdx] = aNewValue;
+  mReportedValid[aRegIdx] = true;
+  mValueSeqs[aRegIdx] = chg.seq;
+  mChanges.push_back(chg);
+  if (mChanges.size()>maxRecentChanges) mChanges.pop_front();
+}
+
+
+ErrorPtr CoreRegModel::readBurst(const SPIReadBurst& aBurst, uint8_t* aBuffer)
+{
+  ErrorPtr err = coreSPIProto().readData(aBurst.addr, aBurst.len, aBuffer);
+  countRead(aBurst.first, aBurst.last, aBurst.len);
+  if (Error::notOK(err)) {
+    err->prefixMessage("Reading from register %s (index %d): ", mRegDefs[aBurst.first].regname.c_str(), aBurst.first);
+  }
+  return err;
+}
+
+
+ErrorPtr CoreRegModel::updateModbusRegistersFromSPI(RegIndex aFromIdx, RegIndex aToIdx)
+{
+  if (aToIdx>=numRegs() || aFromIdx>aToIdx) {
+    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  }
+  ErrorPtr err;
+  uint8_t buf[255]; // max SPI burst size
+  for (size_t bi=0; bi<mReadPlan.size(); bi++) {
+    SPIReadBurst b = mReadPlan[bi];
+    if (b.last<aFromIdx) continue;
+    if (b.first>aToIdx) break;
+    // clip burst to requested range
+    if (b.first<aFromIdx || b.last>aToIdx) {
+      if (b.first<aFromIdx) b.first = aFromIdx;
+      if (b.last>aToIdx) b.last = aToIdx;
+      b.addr = mRegDefs[b.first].addr;
+      b.len = mRegDefs[b.last].addr+mRegDefs[b.last].rawlen-b.addr;
+    }
+    err = readBurst(b, buf);
+    if (Error::notOK(err)) return err;
+    err = updateModbusRegistersFromBuffer(b.first, b.last, buf, mWriteGeneration);
+    if (Error::notOK(err)) return err;
+  }
+  return err;
+}
+
+
+ErrorPtr CoreRegModel::updateModbusRegisterForAccess(RegIndex aRegIdx, MLMicroSeconds aMaxAge)
+{
+  if (aRegIdx>=numRegs()) {
+    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  }
+  if (
+    isFresh(aRegIdx, aMaxAge) || // modbus register image is recent enough
+    (mAccessBurstActive && aRegIdx>=mAccessBurstFirst && aRegIdx<=mAccessBurstLast) // already read ahead for the modbus request being processed
+  ) {
+    mAccessHits.inc();
+    return ErrorPtr();
+  }
+  mAccessMisses.inc();
+  // read ahead registers of the same kind which might be part of the same modbus request
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
+  RegIndex last = aRegIdx;
+  while (
+    last<maxReg() &&
+    mRegDefs[last+1].mbinput==regP->mbinput &&
+    mRegDefs[last+1].mbreg<regP->mbreg+mReadAhead
+  ) {
+    last++;
+  }
+  // read as much of it as we can get in one contiguous SPI burst
+  uint8_t buf[255]; // max SPI burst size
+  MLMicroSeconds started = MainLoop::now();
+  ErrorPtr err = readSPIRegRange(aRegIdx, last, buf, sizeof(buf));
+  mAccessTime.record(MainLoop::now()-started);
+  if (Error::notOK(err)) return err;
+  err = updateModbusRegistersFromBuffer(aRegIdx, last, buf, mWriteGeneration);
+  if (Error::notOK(err)) return err;
+  if (!mAccessBurstActive) {
+    // read ahead data is valid until the current modbus request is processed
+    mAccessBurstActive = true;
+    MainLoop::currentMainLoop().executeNow(boost::bind(&CoreRegModel::endAccessBurst, this));
+  }
+  mAccessBurstFirst = aRegIdx;
+  mAccessBurstLast = last;
+  return ErrorPtr();
+}
+
+
+void CoreRegModel::endAccessBurst()
+{
+  mAccessBurstActive = false;
+}
+
+
+void CoreRegModel::updateModbusRegistersForAccessAsync(int aModbusReg, int aNumRegs, bool aInput, MLMicroSeconds aMaxAge, StatusCB aDoneCB)
+{
+  // find the stale registers of this model
+  RegIndex first = numRegs();
+  RegIndex last = 0;
+  for (int mbreg=aModbusReg; mbreg<aModbusReg+aNumRegs; mbreg++) {
+    RegIndex ri = regindexFromModbusReg(mbreg, aInput);
+    if (ri>=numRegs()) continue; // not in this model
+    if (isFresh(ri, aMaxAge)) {
+      mAccessHits.inc();
+      continue;
+    }
+    mAccessMisses.inc();
+    if (ri<first) first = ri;
+    if (ri>last) last = ri;
+  }
+  if (first>last) {
+    if (aDoneCB) aDoneCB(ErrorPtr());
+    return;
+  }
+  accessReadNext(mPlanGeneration, mWriteGeneration, first, last, boost::bind(&CoreRegModel::accessReadComplete, this, MainLoop::now(), aDoneCB, _1));
+}
+
+
+void CoreRegModel::accessReadNext(uint16_t aGeneration, uint32_t aWriteGeneration, RegIndex aFromIdx, RegIndex aToIdx, StatusCB aDoneCB)
+{
+  // as many registers as fit into one SPI burst
+  uint16_t addr = mRegDefs[aFromIdx].addr;
+  RegIndex last = aFromIdx;
+  while (last<aToIdx && mRegDefs[last+1].addr+mRegDefs[last+1].rawlen-addr<=255) last++;
+  uint8_t len = mRegDefs[last].addr+mRegDefs[last].rawlen-addr;
+  countRead(aFromIdx, last, len);
+  coreSPIProto().readDataAsync(
+    addr, len,
+    [this, aGeneration, aWriteGeneration, aFromIdx, last, aToIdx, aDoneCB](ErrorPtr aError, const uint8_t* aData, uint8_t aLen) {
+      accessReadDone(aGeneration, aWriteGeneration, aFromIdx, last, aToIdx, aDoneCB, aError, aData, aLen);
+    }
+  );
+}
+
+
+void CoreRegModel::accessReadDone(uint16_t aGeneration, uint32_t aWriteGeneration, RegIndex aFromIdx, RegIndex aLastIdx, RegIndex aToIdx, StatusCB aDoneCB, ErrorPtr aError, const uint8_t* aData, uint8_t aLen)
+{
+  if (aGeneration!=mPlanGeneration) {
+    aError = TextError::err("register map changed during read");
+  }
+  if (Error::isOK(aError)) {
+    aError = updateModbusRegistersFromBuffer(aFromIdx, aLastIdx, aData, aWriteGeneration);
+    if (Error::isOK(aError) && aLastIdx<aToIdx) {
+      accessReadNext(aGeneration, mWriteGeneration, aLastIdx+1, aToIdx, aDoneCB);
+      return;
+    }
+  }
+  if (aDoneCB) aDoneCB(aError);
+}
+
+
+void CoreRegModel::accessReadComplete(MLMicroSeconds aStarted, StatusCB aDoneCB, ErrorPtr aError)
+{
+  mAccessTime.record(MainLoop::now()-aStarted);
+  if (aDoneCB) aDoneCB(aError);
+}
+
+
 ErrorPtr CoreRegModel::updateSPIRegisterFromModbus(RegIndex aRegIdx)
 {
+  if (aRegIdx>=numRegs()) {
+    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  }
   int32_t data;
   ErrorPtr err = getEngineeringValue(aRegIdx, data);
+  if (Error::notOK(err)) return err;
+  // modbus masters and the API write the image directly, so this is where changed values get logged
+  // (not reported to the change callback, which is for changes detected on the core)
+  if (!mReportedValid[aRegIdx] || data!=mReportedValues[aRegIdx]) {
+    recordChange(aRegIdx, data, MainLoop::now());
+  }
+  if (mWriteBatchActive) {
+    mDirty[aRegIdx] = true;
+    registerWritten(aRegIdx);
+    return ErrorPtr();
+  }
+  err = writeSPIReg(aRegIdx, data);
+  registerWritten(aRegIdx);
   if (Error::isOK(err)) {
-    err = writeSPIReg(aRegIdx, data);
+    // modbus register now reflects what the core has
+    mLastUpdates[aRegIdx] = MainLoop::now();
   }
   return err;
 }
 
 
+void CoreRegModel::registerWritten(RegIndex aRegIdx)
+{
+  // SPI reads queued before now must not overwrite the written value in the modbus image
+  mWrittenGenerations[aRegIdx] = ++mWriteGeneration;
+}
+
+
+void CoreRegModel::beginWriteBatch()
+{
+  mWriteBatchActive = true;
+}
+
+
+void CoreRegModel::collectWriteBatch(WriteRanges& aRanges)
+{
+  mWriteBatchActive = false;
+  RegIndex i = 0;
+  while (i<numRegs()) {
+    if (!mDirty[i]) {
+      i++;
+      continue;
+    }
+    // collect dirty registers contiguous in SPI address space into one frame
+    RegIndex first = i;
+    size_t blksz = 0;
+    while (i<numRegs() && mDirty[i]) {
+      const CoreModuleRegister* regP = &mRegDefs[i];
+      if (i>first && (regP-1)->addr+(regP-1)->rawlen!=regP->addr) break; // not contiguous
+      if (blksz+regP->rawlen>255) break; // does not fit into max SPI burst size
+      blksz += regP->rawlen;
+      mDirty[i] = false;
+      i++;
+    }
+    aRanges.push_back(WriteRange(first, i-1));
+  }
+}
+
+
+size_t CoreRegModel::layoutWriteRange(const WriteRange& aRange, uint8_t* aBuffer)
+{
+  size_t blksz = 0;
+  for (RegIndex i=aRange.first; i<=aRange.second; i++) {
+    int32_t data;
+    getEngineeringValue(i, data);
+    layoutReg(&mRegDefs[i], data, aBuffer+blksz);
+    blksz += mRegDefs[i].rawlen;
+  }
+  return blksz;
+}
+
+
+void CoreRegModel::writeRangeDone(const WriteRange& aRange, ErrorPtr aError)
+{
+  // reads queued while the batch was collected must not overwrite the written values either
+  for (RegIndex j=aRange.first; j<=aRange.second; j++) registerWritten(j);
+  // if written, the modbus registers now reflect what the core has, otherwise they must be re-read from the core
+  MLMicroSeconds now = Error::isOK(aError) ? MainLoop::now() : Never;
+  for (RegIndex j=aRange.first; j<=aRange.second; j++) mLastUpdates[j] = now;
+}
+
+
+ErrorPtr CoreRegModel::commitWriteBatch()
+{
+  WriteRanges ranges;
+  collectWriteBatch(ranges);
+  ErrorPtr err;
+  for (size_t i=0; i<ranges.size(); i++) {
+    if (Error::notOK(err)) {
+      // not written because of an earlier failure
+      writeRangeDone(ranges[i], err);
+      continue;
+    }
+    uint8_t buf[255];
+    size_t blksz = layoutWriteRange(ranges[i], buf);
+    mWriteFrames++;
+    err = coreSPIProto().writeData(mRegDefs[ranges[i].first].addr, blksz, buf);
+    writeRangeDone(ranges[i], err);
+    if (Error::notOK(err)) {
+      err->prefixMessage("Writing registers %s..%s (index %d..%d): ", mRegDefs[ranges[i].first].regname.c_str(), mRegDefs[ranges[i].second].regname.c_str(), ranges[i].first, ranges[i].second);
+    }
+  }
+  return err;
+}
+
+
+void CoreRegModel::commitWriteBatchAsync(StatusCB aDoneCB)
+{
+  WriteRanges ranges;
+  collectWriteBatch(ranges);
+  writeBatchNext(ranges, 0, MainLoop::now(), aDoneCB);
+}
+
+
+void CoreRegModel::writeBatchNext(WriteRanges aRanges, size_t aNext, MLMicroSeconds aStarted, StatusCB aDoneCB)
+{
+  if (aNext>=aRanges.size()) {
+    mWriteBatchTime.record(MainLoop::now()-aStarted);
+    if (aDoneCB) aDoneCB(ErrorPtr());
+    return;
+  }
+  // Note: the values are taken from the image now, so a later write of the same register is never undone
+  uint8_t buf[255];
+  size_t blksz = layoutWriteRange(aRanges[aNext], buf);
+  mWriteFrames++;
+  coreSPIProto().writeDataAsync(
+    mRegDefs[aRanges[aNext].first].addr, blksz, buf,
+    [this, aRanges, aNext, aStarted, aDoneCB](ErrorPtr aError, const uint8_t* aData, uint8_t aLen) {
+      writeBatchDone(aRanges, aNext, aStarted, aDoneCB, aError);
+    }
+  );
+}
+
+
+void CoreRegModel::writeBatchDone(WriteRanges aRanges, size_t aNext, MLMicroSeconds aStarted, StatusCB aDoneCB, ErrorPtr aError)
+{
+  writeRangeDone(aRanges[aNext], aError);
+  if (Error::isOK(aError)) {
+    writeBatchNext(aRanges, aNext+1, aStarted, aDoneCB);
+    return;
+  }
+  aError->prefixMessage("Writing registers %s..%s (index %d..%d): ", mRegDefs[aRanges[aNext].first].regname.c_str(), mRegDefs[aRanges[aNext].second].regname.c_str(), aRanges[aNext].first, aRanges[aNext].second);
+  // do not write the rest of the batch, but make sure these get re-read from the core
+  for (size_t i=aNext+1; i<aRanges.size(); i++) writeRangeDone(aRanges[i], aError);
+  mWriteBatchTime.record(MainLoop::now()-aStarted);
+  if (aDoneCB) aDoneCB(aError);
+}
+
+
+bool CoreRegModel::isFresh(RegIndex aRegIdx, MLMicroSeconds aMaxAge)
+{
+  if (aRegIdx>=numRegs()) return false;
+  PollClass pc = mRegDefs[aRegIdx].pollclass;
+  if (aMaxAge==maxAgeFromPolling) aMaxAge = polledMaxAge(pc);
+  if (aMaxAge<=0) return false;
+  MLMicroSeconds lastUpdate = mLastUpdates[aRegIdx];
+  if (lastUpdate==Never) return false;
+  if (pc==poll_static || pc==poll_onchange) return true; // once read, the modbus image stays valid
+  return MainLoop::now()-lastUpdate<=aMaxAge;
+}
+
+
+MLMicroSeconds CoreRegModel::polledMaxAge(PollClass aPollClass)
+{
+  // the shortest interval the register is re-read at, twice to allow for a late cycle
+  MLMicroSeconds interval = mRefreshInterval;
+  if (aPollClass<numPollClasses && mPollInterval[aPollClass]>0 && (interval<=0 || mPollInterval[aPollClass]<interval)) {
+    interval = mPollInterval[aPollClass];
+  }
+  return interval>0 ? 2*interval : 0;
+}
+
+
+ErrorPtr CoreRegModel::updateModbusRegisterIfStale(RegIndex aRegIdx, MLMicroSeconds aMaxAge)
+{
+  if (isFresh(aRegIdx, aMaxAge)) return ErrorPtr(); // modbus register image is recent enough
+  return updateModbusRegistersFromSPI(aRegIdx, aRegIdx);
+}
+
+
+// MARK: - change detection
+
+ErrorPtr CoreRegModel::setDeadband(RegIndex aRegIdx, double aDeadband)
+{
+  if (aRegIdx>=numRegs()) {
+    return Error::err<CoreRegError>(CoreRegError::invalidIndex);
+  }
+  CoreModuleRegister* regP = &mRegDefs[aRegIdx];
+  regP->deadband = aDeadband>0 ? (int32_t)(aDeadband/regP->resolution+0.5) : 0;
+  return ErrorPtr();
+}
+
+
+JsonObjectPtr CoreRegModel::getChangeInfo(const RegisterChange& aChange)
+{
+  JsonObjectPtr info = JsonObject::newObj();
+  if (aChange.regIdx<numRegs()) {
+    const CoreModuleRegister* regP = &mRegDefs[aChange.regIdx];
+    info->add("seq", JsonObject::newInt64(aChange.seq));
+    info->add("regidx", JsonObject::newInt32(aChange.regIdx));
+    info->add("regname", JsonObject::newString(regP->regname));
+    info->add("oldengval", JsonObject::newInt32(aChange.oldValue));
+    info->add("engval", JsonObject::newInt32(aChange.newValue));
+    info->add("oldvalue", JsonObject::newDouble(regP->resolution*aChange.oldValue));
+    info->add("value", JsonObject::newDouble(regP->resolution*aChange.newValue));
+    info->add("age", JsonObject::newDouble((double)(MainLoop::now()-aChange.when)/Second));
+  }
+  return info;
+}
+
+
+JsonObjectPtr CoreRegModel::getChangesSince(uint32_t aSinceSeq, uint32_t aEpoch)
+{
+  JsonObjectPtr res = JsonObject::newObj();
+  JsonObjectPtr changes = JsonObject::newArray();
+  // Note: every sequence number is a logged change, so the oldest available one tells if we might have missed some
+  bool complete = mChanges.empty() ? true : mChanges.front().seq<=aSinceSeq+1;
+  if ((aEpoch!=0 && aEpoch!=mChangeEpoch) || aSinceSeq>mChangeSeq) {
+    // caller's sequence number is from before a restart, we cannot know what it has missed
+    complete = false;
+    aSinceSeq = 0;
+  }
+  for (size_t ci=0; ci<mChanges.size(); ci++) {
+    if ((int32_t)(mChanges[ci].seq-aSinceSeq)>0) {
+      changes->arrayAppend(getChangeInfo(mChanges[ci]));
+    }
+  }
+  res->add("epoch", JsonObject::newInt64(mChangeEpoch));
+  res->add("seq", JsonObject::newInt64(mChangeSeq));
+  res->add("changes", changes);
+  res->add("complete", JsonObject::newBool(complete));
+  return res;
+}
+
+
+// MARK: - poll scheduler
+
+void CoreRegModel::setPollIntervals(MLMicroSeconds aFastInterval, MLMicroSeconds aSlowInterval)
+{
+  mPollInterval[poll_fast] = aFastInterval;
+  mPollInterval[poll_slow] = aSlowInterval;
+  MLMicroSeconds now = MainLoop::now();
+  for (int pc=0; pc<numPollClasses; pc++) mPollDue[pc] = now;
+  mPollTicket.cancel();
+  pollStep();
+}
+
+
+void CoreRegModel::pollStep()
+{
+  if (mPollBusy) return; // will be called again when current burst is done
+  MLMicroSeconds now = MainLoop::now();
+  MLMicroSeconds next = Never;
+  // poll classes are enumerated in order of priority
+  for (int pc=0; pc<numPollClasses; pc++) {
+    if (mPollInterval[pc]<=0 || mPollPlans[pc].empty()) continue;
+    if (mPollNext[pc]>=mPollPlans[pc].size()) {
+      // no cycle running for this class
+      if (now<mPollDue[pc]) {
+        if (next==Never || mPollDue[pc]<next) next = mPollDue[pc];
+        continue;
+      }
+      // start a new cycle
+      if (now>=mPollDue[pc]+mPollInterval[pc]) {
+        // missed at least one entire cycle
+        if (pc==poll_fast) mPollOverruns++;
+        mPollDue[pc] = now;
+      }
+      mPollDue[pc] += mPollInterval[pc];
+      mPollNext[pc] = 0;
+    }
+    // read next burst of this class
+    const SPIReadBurst& b = mPollPlans[pc][mPollNext[pc]];
+    mPollBusy = true;
+    mPollStarted = now;
+    countRead(b.first, b.last, b.len);
+    coreSPIProto().readDataAsync(
+      b.addr, b.len,
+      boost::bind(&CoreRegModel::pollBurstDone, this, mPlanGeneration, mWriteGeneration, pc, mPollNext[pc], _1, _2, _3)
+    );
+    return;
+  }
+  if (next!=Never) {
+    mPollTicket.executeOnce(boost::bind(&CoreRegModel::pollStep, this), next-now);
+  }
+}
+
+
+void CoreRegModel::pollBurstDone(uint16_t aGeneration, uint32_t aWriteGeneration, int aPollClass, size_t aBurstIdx, ErrorPtr aError, const uint8_t* aData, uint8_t aLen)
+{
+  mPollBusy = false;
+  mPollTime.record(MainLoop::now()-mPollStarted);
+  if (aGeneration==mPlanGeneration) {
+    const SPIReadBurst& b = mPollPlans[aPollClass][aBurstIdx];
+    if (Error::isOK(aError)) {
+      updateModbusRegistersFromBuffer(b.first, b.last, aData, aWriteGeneration);
+    }
+    else {
+      mPollErrors.inc();
+      LOG(LOG_WARNING, "Polling register %s (index %d) failed: %s", mRegDefs[b.first].regname.c_str(), b.first, aError->text());
+    }
+    mPollNext[aPollClass] = aBurstIdx+1;
+  }
+  pollStep();
+}
+
+
+// MARK: - background refresh
+
+void CoreRegModel::setBackgroundRefresh(MLMicroSeconds aInterval)
+{
+  mRefreshTicket.cancel();
+  mRefreshInterval = aInterval;
+  if (mRefreshInterval>0 && !mRefreshing) {
+    mRefreshTicket.executeOnce(boost::bind(&CoreRegModel::backgroundRefresh, this), mRefreshInterval);
+  }
+}
+
+
+void CoreRegModel::backgroundRefresh()
+{
+  // execute the read plan burst by burst via the SPI worker thread, so the mainloop is not blocked meanwhile
+  mRefreshing = true;
+  mRefreshStarted = MainLoop::now();
+  mRefreshNext = 0;
+  mRefreshedBursts.clear();
+  mRefreshWriteGeneration = mWriteGeneration; // registers written during the cycle will not be updated from it
+  refreshNextBurst();
+}
+
+
+void CoreRegModel::refreshNextBurst()
+{
+  if (mRefreshNext>=mReadPlan.size()) {
+    // all read: update the modbus register image in one go, so modbus clients always see a coherent snapshot
+    for (size_t i=0; i<mRefreshedBursts.size(); i++) {
+      const SPIReadBurst& b = mReadPlan[mRefreshedBursts[i]];
+      updateModbusRegistersFromBuffer(b.first, b.last, &mRefreshRaw[b.addr], mRefreshWriteGeneration);
+    }
+    mRefreshing = false;
+    mRefreshCycles.inc();
+    mRefreshTime.record(MainLoop::now()-mRefreshStarted);
+    if (mRefreshInterval>0) {
+      mRefreshTicket.executeOnce(boost::bind(&CoreRegModel::backgroundRefresh, this), mRefreshInterval);
+    }
+    return;
+  }
+  const SPIReadBurst& b = mReadPlan[mRefreshNext];
+  countRead(b.first, b.last, b.len);
+  coreSPIProto().readDataAsync(
+    b.addr, b.len,
+    boost::bind(&CoreRegModel::refreshBurstDone, this, mRefreshNext, _1, _2, _3)
+  );
+}
+
+
+void CoreRegModel::refreshBurstDone(uint16_t aBurstIdx, ErrorPtr aError, const uint8_t* aData, uint8_t aLen)
+{
+  if (!mRefreshing || aBurstIdx!=mRefreshNext) return; // refresh was restarted meanwhile
+  const SPIReadBurst& b = mReadPlan[aBurstIdx];
+  if (Error::isOK(aError)) {
+    memcpy(&mRefreshRaw[b.addr], aData, aLen);
+    mRefreshedBursts.push_back(aBurstIdx);
+  }
+  else {
+    mRefreshErrors.inc();
+    LOG(LOG_WARNING, "Background refresh of register %s (index %d) failed: %s", mRegDefs[b.first].regname.c_str(), b.first, aError->text());
+  }
+  mRefreshNext = aBurstIdx+1;
+  refreshNextBurst();
+}
+
+
 ErrorPtr CoreRegModel::getEngineeringValue(RegIndex aRegIdx, int32_t& aValue)
 {
-  if (aRegIdx>=numModuleRegisters) {
+  if (aRegIdx>=numRegs()) {
     return Error::err<CoreRegError>(CoreRegError::invalidIndex);
   }
-  const CoreModuleRegister* regP = &coreModuleRegisterDefs[aRegIdx];
-  uint32_t data = modbusSlave().getReg(regP->mbreg, regP->mbinput); // LSWord
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
+  int mbreg = regP->mbreg+mModbusOffset;
+  uint32_t data = modbusSlave().getReg(mbreg, regP->mbinput); // LSWord
   if ((regP->layout&reg_bytecount_mask)>2) {
-    data |= (uint32_t)(modbusSlave().getReg(regP->mbreg+1, regP->mbinput))<<16; // MSWord
+    data |= (uint32_t)(modbusSlave().getReg(mbreg+1, regP->mbinput))<<16; // MSWord
   }
   aValue = data;
   return ErrorPtr();
@@ -448,24 +1515,31 @@ ErrorPtr CoreRegModel::getEngineeringValue(RegIndex aRegIdx, int32_t& aValue)
 
 ErrorPtr CoreRegModel::setEngineeringValue(RegIndex aRegIdx, int32_t aValue, bool aUserInput)
 {
-  if (aRegIdx>=numModuleRegisters) {
+  if (aRegIdx>=numRegs()) {
     return Error::err<CoreRegError>(CoreRegError::invalidIndex);
   }
-  const CoreModuleRegister* regP = &coreModuleRegisterDefs[aRegIdx];
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
   if (aUserInput) {
     if (regP->mbinput) {
-      return Error::err<CoreRegError>(CoreRegError::readOnly, "Register %s (index %d) is read-only", regP->regname, aRegIdx);
+      return Error::err<CoreRegError>(CoreRegError::readOnly, "Register %s (index %d) is read-only", regP->regname.c_str(), aRegIdx);
     }
     if (
       !(regP->max==0 && regP->min==0) && // min and max zero means no range limit
       (aValue>regP->max || aValue<regP->min)
     ) {
-      return Error::err<CoreRegError>(CoreRegError::outOfRange, "Value is out of range for register %s (index %d)", regP->regname, aRegIdx);
+      return Error::err<CoreRegError>(CoreRegError::outOfRange, "Value is out of range for register %s (index %d)", regP->regname.c_str(), aRegIdx);
     }
   }
-  modbusSlave().setReg(regP->mbreg, regP->mbinput, (uint16_t)aValue); // LSWord
+  int mbreg = regP->mbreg+mModbusOffset;
+  modbusSlave().setReg(mbreg, regP->mbinput, (uint16_t)aValue); // LSWord
   if ((regP->layout&reg_bytecount_mask)>2) {
-    modbusSlave().setReg(regP->mbreg+1, regP->mbinput, (uint16_t)(aValue>>16)); // MSWord
+    modbusSlave().setReg(mbreg+1, regP->mbinput, (uint16_t)(aValue>>16)); // MSWord
+  }
+  for (size_t i=0; i<mModbusMirrors.size(); i++) {
+    mModbusMirrors[i]->setReg(mbreg, regP->mbinput, (uint16_t)aValue);
+    if ((regP->layout&reg_bytecount_mask)>2) {
+      mModbusMirrors[i]->setReg(mbreg+1, regP->mbinput, (uint16_t)(aValue>>16));
+    }
   }
   return ErrorPtr();
 }
@@ -476,7 +1550,7 @@ ErrorPtr CoreRegModel::getUserValue(RegIndex aRegIdx, double& aValue)
   int32_t engval;
   ErrorPtr err = getEngineeringValue(aRegIdx, engval);
   if (Error::isOK(err)) {
-    aValue = coreModuleRegisterDefs[aRegIdx].resolution*engval;
+    aValue = mRegDefs[aRegIdx].resolution*engval;
   }
   return err;
 }
@@ -484,50 +1558,134 @@ ErrorPtr CoreRegModel::getUserValue(RegIndex aRegIdx, double& aValue)
 
 ErrorPtr CoreRegModel::setUserValue(RegIndex aRegIdx, double aValue)
 {
-  if (aRegIdx>=numModuleRegisters) {
+  if (aRegIdx>=numRegs()) {
     return Error::err<CoreRegError>(CoreRegError::invalidIndex);
   }
-  return setEngineeringValue(aRegIdx, (int32_t)(aValue/coreModuleRegisterDefs[aRegIdx].resolution), true);
+  return setEngineeringValue(aRegIdx, (int32_t)(aValue/mRegDefs[aRegIdx].resolution), true);
+}
+
+
+void CoreRegModel::addRegisterMetadata(JsonObjectPtr aInfo, RegIndex aRegIdx)
+{
+  const CoreModuleRegister* regP = &mRegDefs[aRegIdx];
+  aInfo->add("regname", JsonObject::newString(regP->regname));
+  aInfo->add("description", JsonObject::newString(regP->description));
+  aInfo->add("min", JsonObject::newDouble(regP->resolution*regP->min));
+  aInfo->add("max", JsonObject::newDouble(regP->resolution*regP->max));
+  aInfo->add("resolution", JsonObject::newDouble(regP->resolution));
+  aInfo->add("unit", JsonObject::newString(valueUnitName(regP->unit, false)));
+  aInfo->add("symbol", JsonObject::newString(mUnitSymbols[aRegIdx]));
+  aInfo->add("spiaddr", JsonObject::newInt32(regP->addr));
+  aInfo->add("rawlen", JsonObject::newInt32(regP->rawlen));
+  aInfo->add("modbusreg", JsonObject::newInt32(regP->mbreg));
+  aInfo->add("readonly", JsonObject::newBool(regP->mbinput));
+  aInfo->add("poll", JsonObject::newString(pollClassNames[regP->pollclass]));
+}
+
+
+void CoreRegModel::addRegisterValue(JsonObjectPtr aInfo, RegIndex aRegIdx)
+{
+  int32_t engval = 0;
+  ErrorPtr err = getEngineeringValue(aRegIdx, engval);
+  if (Error::isOK(err)) {
+    double val = mRegDefs[aRegIdx].resolution*engval;
+    aInfo->add("engval", JsonObject::newInt32(engval));
+    aInfo->add("value", JsonObject::newDouble(val));
+    aInfo->add("formatted", JsonObject::newString(string_format("%0.*f %s", mFracDigits[aRegIdx], val, mUnitSymbols[aRegIdx].c_str())));
+  }
+  else {
+    aInfo->add("error", JsonObject::newString(err->text()));
+    aInfo->add("formatted", JsonObject::newString("<error>"));
+  }
 }
 
 
 JsonObjectPtr CoreRegModel::getRegisterInfo(RegIndex aRegIdx)
 {
   JsonObjectPtr info;
-  if (aRegIdx<numModuleRegisters) {
-    int32_t engval = 0;
-    const CoreModuleRegister* regP = &coreModuleRegisterDefs[aRegIdx];
+  if (aRegIdx<numRegs()) {
     info = JsonObject::newObj();
     info->add("regidx", JsonObject::newInt32(aRegIdx));
-    info->add("regname", JsonObject::newString(regP->regname));
-    info->add("description", JsonObject::newString(regP->description));
-    info->add("min", JsonObject::newDouble(regP->resolution*regP->min));
-    info->add("max", JsonObject::newDouble(regP->resolution*regP->max));
-    info->add("resolution", JsonObject::newDouble(regP->resolution));
-    info->add("unit", JsonObject::newString(valueUnitName(regP->unit, false)));
-    info->add("symbol", JsonObject::newString(valueUnitName(regP->unit, true)));
-    info->add("spiaddr", JsonObject::newInt32(regP->addr));
-    info->add("rawlen", JsonObject::newInt32(regP->rawlen));
-    info->add("modbusreg", JsonObject::newInt32(regP->mbreg));
-    info->add("readonly", JsonObject::newBool(regP->mbinput));
-    ErrorPtr err = getEngineeringValue(aRegIdx, engval);
-    if (Error::isOK(err)) {
-      double val = regP->resolution*engval;
-      info->add("engval", JsonObject::newInt32(engval));
-      info->add("value", JsonObject::newDouble(val));
-      int fracDigits = (int)(-::log(regP->resolution)/::log(10)+0.99);
-      if (fracDigits<0) fracDigits=0;
-      info->add("formatted", JsonObject::newString(string_format("%0.*f %s", fracDigits, val, valueUnitName(regP->unit, true).c_str())));
-    }
-    else {
-      info->add("error", JsonObject::newString(err->text()));
-      info->add("formatted", JsonObject::newString("<error>"));
-    }
+    addRegisterMetadata(info, aRegIdx);
+    addRegisterValue(info, aRegIdx);
   }
   return info;
 }
 
 
+JsonObjectPtr CoreRegModel::getRegisterMetadata()
+{
+  if (!mMetadata) {
+    JsonObjectPtr regs = JsonObject::newArray();
+    for (RegIndex i=0; i<numRegs(); i++) {
+      JsonObjectPtr info = JsonObject::newObj();
+      info->add("regidx", JsonObject::newInt32(i));
+      addRegisterMetadata(info, i);
+      info->add("fracdigits", JsonObject::newInt32(mFracDigits[i]));
+      regs->arrayAppend(info);
+    }
+    mMetadata = JsonObject::newObj();
+    mMetadata->add("version", JsonObject::newInt64(mMapVersion));
+    mMetadata->add("registers", regs);
+  }
+  return mMetadata;
+}
+
+
+JsonObjectPtr CoreRegModel::getRegisterValues(uint32_t aSinceSeq, uint32_t aEpoch)
+{
+  JsonObjectPtr res = JsonObject::newObj();
+  JsonObjectPtr values = JsonObject::newArray();
+  if ((aEpoch!=0 && aEpoch!=mChangeEpoch) || aSinceSeq>mChangeSeq) {
+    // caller's sequence number is from before a restart: all values are needed
+    aSinceSeq = 0;
+  }
+  for (RegIndex i=0; i<numRegs(); i++) {
+    if (aSinceSeq!=0 && (int32_t)(mValueSeqs[i]-aSinceSeq)<=0) continue; // not changed since
+    JsonObjectPtr val = JsonObject::newObj();
+    val->add("regidx", JsonObject::newInt32(i));
+    addRegisterValue(val, i);
+    values->arrayAppend(val);
+  }
+  res->add("version", JsonObject::newInt64(mMapVersion));
+  res->add("epoch", JsonObject::newInt64(mChangeEpoch));
+  res->add("seq", JsonObject::newInt64(mChangeSeq));
+  res->add("values", values);
+  return res;
+}
+
+
+MLMicroSeconds CoreRegModel::getValueVector(std::vector<int32_t>& aValues)
+{
+  aValues.resize(numRegs());
+  for (RegIndex i=0; i<numRegs(); i++) {
+    getEngineeringValue(i, aValues[i]);
+  }
+  return mLastImageUpdate;
+}
+
+
+JsonObjectPtr CoreRegModel::getPackedValues()
+{
+  static const char hexDigits[] = "0123456789ABCDEF";
+  MLMicroSeconds t = getValueVector(mValueVector);
+  string packed(mValueVector.size()*8, '0');
+  char* p = &packed[0];
+  for (size_t i=0; i<mValueVector.size(); i++) {
+    uint32_t v = (uint32_t)mValueVector[i];
+    for (int sh=28; sh>=0; sh-=4) *p++ = hexDigits[(v>>sh)&0xF];
+  }
+  JsonObjectPtr res = JsonObject::newObj();
+  res->add("version", JsonObject::newInt64(mMapVersion));
+  res->add("epoch", JsonObject::newInt64(mChangeEpoch));
+  res->add("seq", JsonObject::newInt64(mChangeSeq));
+  if (t!=Never) res->add("time", JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(t)/Second));
+  res->add("count", JsonObject::newInt32((int32_t)mValueVector.size()));
+  res->add("values", JsonObject::newString(packed));
+  return res;
+}
+
+
 ErrorPtr CoreRegModel::setRegisterValue(RegIndex aRegIdx, JsonObjectPtr aNewValue)
 {
   // for now, just convert to double and then set as user value
@@ -547,7 +1705,7 @@ ErrorPtr CoreRegModel::setRegisterValue(RegIndex aRegIdx, JsonObjectPtr aNewValu
 JsonObjectPtr CoreRegModel::getRegisterInfos()
 {
   JsonObjectPtr infos = JsonObject::newArray();
-  for (RegIndex i=0; i<numModuleRegisters; i++) {
+  for (RegIndex i=0; i<numRegs(); i++) {
     infos->arrayAppend(getRegisterInfo(i));
   }
   return infos;
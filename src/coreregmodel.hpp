@@ -26,6 +26,12 @@
 #include "corespiproto.hpp"
 #include "modbus.hpp"
 #include "jsonobject.hpp"
+#include "valueunits.hpp"
+#include "corehistory.hpp"
+#include "historystore.hpp"
+
+#include <unordered_map>
+#include <deque>
 
 using namespace std;
 
@@ -40,6 +46,7 @@ namespace p44 {
       readOnly, ///< register is read-only
       outOfRange, ///< value provided is out of range
       invalidInput, ///< register (string) value provided is not valud
+      invalidMap, ///< register map definition is not valid
       numErrorCodes
     } ErrorCodes;
     static const char *domain() { return "CoreReg"; }
@@ -55,38 +62,254 @@ namespace p44 {
       "readOnly",
       "outOfRange",
       "invalidInput",
+      "invalidMap",
     };
     #endif // ENABLE_NAMED_ERRORS
   };
 
 
+  enum {
+    reg_byte = 0x1,
+    reg_word = 0x2,
+    reg_triplet = 0x3,
+    reg_long = 0x4,
+    reg_bytecount_mask = 0xF,
+    reg_signed = 0x100,
+    // combinations
+    reg_uint8 = reg_byte,
+    reg_sint8 = reg_byte|reg_signed,
+    reg_uint16 = reg_word,
+    reg_sint16 = reg_word|reg_signed,
+    reg_uint24 = reg_triplet,
+  };
+  typedef uint16_t RegisterLayout;
+
+
+  typedef enum {
+    poll_fast, ///< process values, polled at the fast interval
+    poll_slow, ///< slowly changing values, polled at the slow interval in spare bus time
+    poll_static, ///< constants, only read at startup or on explicit refresh
+    poll_onchange, ///< configuration only changed via modbus, only read at startup or on explicit refresh
+    numPollClasses
+  } PollClass;
+
+
+  /// special max age: registers are fresh for twice the interval background refresh or polling reads them at
+  /// (the shorter one, if both), and never if neither reads them. See CoreRegModel::isFresh()
+  const MLMicroSeconds maxAgeFromPolling = -2;
+
+
+  typedef struct {
+    string regname; ///< register name
+    string description; ///< description
+    long min; ///< signed minimum engineering value
+    long max; ///< signed maximum engineering value
+    double resolution; ///< resolution of one engineering value count (when expressed in ValueUnit as specified with "unit")
+    ValueUnit unit; ///< value unit
+    // SPI side
+    uint16_t addr; ///< address of the first byte
+    uint8_t rawlen; ///< number of raw bytes occupied
+    RegisterLayout layout; ///< register layout
+    // Modbus side
+    uint16_t mbreg; ///< modbus register number
+    bool mbinput; ///< modbus input register
+    // Scanning
+    PollClass pollclass; ///< how this register is polled from SPI
+    // Change detection
+    int32_t deadband; ///< min difference in engineering value to previously reported value to report a change, 0 for any change
+  } CoreModuleRegister;
+
+
+  /// one SPI read transaction of the precomputed read plan
+  typedef struct {
+    uint16_t addr; ///< SPI address of the first byte to read
+    uint8_t len; ///< number of bytes to read (including gaps read through)
+    uint16_t first; ///< index of the first register covered
+    uint16_t last; ///< index of the last register covered
+  } SPIReadBurst;
 
 
   class CoreRegModel : public P44LoggingObj
   {
     typedef P44LoggingObj inherited;
 
+  public:
+
+    typedef uint16_t RegIndex;
+
+    /// a detected change of a register value
+    typedef struct {
+      uint32_t seq; ///< sequence number of the change
+      RegIndex regIdx; ///< the register that changed
+      int32_t oldValue; ///< previously reported engineering value
+      int32_t newValue; ///< new engineering value
+      MLMicroSeconds when; ///< when the change was detected
+    } RegisterChange;
+
+    /// callback for register value changes
+    typedef boost::function<void (const RegisterChange& aChange)> RegisterChangeCB;
+
+  private:
+
     ModbusSlavePtr mModbusSlave;
+    bool mOwnModbusSlave; ///< set if modbus slave is not shared with other register models
+    std::vector<ModbusSlavePtr> mModbusMirrors; ///< additional modbus slaves that get a copy of all register values
+    int mModbusOffset; ///< offset added to all modbus register numbers of this model
     CoreSPIProtoPtr mCoreSPIProto;
 
+    // register map
+    std::vector<CoreModuleRegister> mRegDefs; ///< the register definitions
+    int mMbNumRegs; ///< number of R/W modbus registers
+    int mMbNumInputs; ///< number of input modbus registers
+
+    // read plan
+    std::vector<SPIReadBurst> mReadPlan; ///< SPI bursts covering all registers, in register index order
+    int mMaxReadGap; ///< max number of unused bytes between registers to read through rather than starting a new burst
+    std::vector<SPIReadBurst> mPollPlans[numPollClasses]; ///< SPI bursts covering the registers of each poll class
+
+    // poll scheduler
+    MLTicket mPollTicket; ///< timer for next poll cycle
+    MLMicroSeconds mPollInterval[numPollClasses]; ///< poll interval per class, Never if not polled
+    MLMicroSeconds mPollDue[numPollClasses]; ///< when the next poll cycle per class is due
+    size_t mPollNext[numPollClasses]; ///< next burst of the poll plan to read per class, beyond plan end when no cycle is running
+    bool mPollBusy; ///< set while a poll burst is in progress
+    uint16_t mPlanGeneration; ///< incremented whenever read plans change, to discard results of bursts planned before
+    uint64_t mPollOverruns; ///< number of fast poll cycles that started late because the previous one took too long
+
+    // change detection
+    std::vector<int32_t> mReportedValues; ///< per register: engineering value last reported as a change (or initially read)
+    std::vector<bool> mReportedValid; ///< per register: set when mReportedValues is valid
+    std::deque<RegisterChange> mChanges; ///< recent changes, oldest first
+    uint32_t mChangeSeq; ///< sequence number of the most recent change
+    uint32_t mChangeEpoch; ///< identifies this run of the daemon, sequence numbers of different epochs are unrelated
+    RegisterChangeCB mChangeCB; ///< called for every detected change
+    std::vector<uint32_t> mValueSeqs; ///< per register: sequence number of the last logged change (detected or written), 0 if none yet
+
+    // JSON API
+    uint32_t mMapVersion; ///< incremented whenever the register map changes
+    JsonObjectPtr mMetadata; ///< cached static register metadata, NULL when not yet built for current map
+    std::vector<uint8_t> mFracDigits; ///< per register: number of fractional digits for formatting the user value
+    std::vector<string> mUnitSymbols; ///< per register: unit symbol for formatting the user value
+    MLMicroSeconds mLastImageUpdate; ///< when the modbus register image was last updated from SPI, Never if not yet
+    std::vector<int32_t> mValueVector; ///< scratch buffer for getPackedValues()
+
+    // read statistics
+    uint64_t mReadFrames; ///< number of SPI read transactions
+    uint64_t mReadBytes; ///< number of data bytes read via SPI
+    uint64_t mReadGapBytes; ///< number of data bytes read via SPI that do not belong to any register
+    uint64_t mWriteFrames; ///< number of SPI write transactions
+
+    // lookup indices
+    std::vector<uint16_t> mRegIndexByModbusReg; ///< register index by R/W modbus register number (offset by first register)
+    std::vector<uint16_t> mRegIndexByModbusInput; ///< register index by input modbus register number (offset by first register)
+    std::unordered_map<string, uint16_t> mRegIndexByName; ///< register index by lowercase register name
+
+    // background refresh
+    MLTicket mRefreshTicket; ///< timer for periodic refresh of the modbus register image
+    MLMicroSeconds mRefreshInterval; ///< background refresh interval, Never if none
+    bool mRefreshing; ///< set while asynchronous background refresh is in progress
+    uint16_t mRefreshNext; ///< next read plan burst to execute
+    std::vector<uint8_t> mRefreshRaw; ///< raw SPI register data collected during background refresh, indexed by SPI address
+    std::vector<uint16_t> mRefreshedBursts; ///< read plan bursts successfully read into mRefreshRaw
+    uint32_t mRefreshWriteGeneration; ///< mWriteGeneration when the current background refresh cycle started
+    std::vector<MLMicroSeconds> mLastUpdates; ///< per register: time when it was last updated from SPI, Never if not yet
+
+    // modbus access coalescing
+    int mReadAhead; ///< max number of modbus registers to read ahead for a modbus read access
+    bool mAccessBurstActive; ///< set when registers have been read ahead for the modbus request currently processed
+    uint16_t mAccessBurstFirst; ///< first register index read ahead for current modbus request
+    uint16_t mAccessBurstLast; ///< last register index read ahead for current modbus request
+
+    // write batching
+    bool mWriteBatchActive; ///< set while register writes are collected instead of being sent to SPI immediately
+    std::vector<bool> mDirty; ///< per register: set when modbus register needs to be written to SPI at end of batch
+    uint32_t mWriteGeneration; ///< incremented for every register write, see mWrittenGenerations
+    std::vector<uint32_t> mWrittenGenerations; ///< per register: mWriteGeneration of the last write, to discard SPI reads queued before it
+
+    // hot path statistics
+    StatCounter mAccessHits; ///< modbus read accesses served from the register image
+    StatCounter mAccessMisses; ///< modbus read accesses that needed a SPI read
+    Log2Histogram mAccessTime; ///< time in uS for SPI reads caused by modbus read accesses
+    Log2Histogram mWriteBatchTime; ///< time in uS for writing a batch of modbus register writes to SPI
+    StatCounter mRefreshCycles; ///< number of completed background refresh cycles
+    StatCounter mRefreshErrors; ///< number of failed background refresh bursts
+    MLMicroSeconds mRefreshStarted; ///< when the current background refresh cycle started
+    Log2Histogram mRefreshTime; ///< time in uS per background refresh cycle
+    StatCounter mPollErrors; ///< number of failed poll bursts
+    MLMicroSeconds mPollStarted; ///< when the current poll burst was queued
+    Log2Histogram mPollTime; ///< time in uS per poll burst (queued until result delivered)
+
+    // history
+    string mHistoryRegNames; ///< comma separated names of the registers to record history for
+    size_t mHistorySizes[numHistoryResolutions]; ///< number of entries to keep per resolution
+    std::vector<RegisterHistoryPtr> mHistories; ///< per register: history, NULL if none recorded (empty if no history at all)
+    std::vector<uint64_t> mStoredSeconds; ///< per register: number of closed seconds already passed to mHistoryStore
+    MLTicket mHistoryTicket; ///< common one second tick closing the seconds of all history registers
+    HistoryStorePtr mHistoryStore; ///< persistent store for the per second aggregates, NULL if none
+
   public:
 
-    CoreRegModel();
+    /// create register model
+    /// @param aModbusSlave if set, the modbus slave to expose registers through, shared with other models.
+    ///   The register layout of a shared slave must be set up by the owner (see modbusRegisterSpan()).
+    ///   If not set, the model creates its own modbus slave and sets up its register layout.
+    /// @param aModbusOffset offset added to all modbus register numbers, to allow multiple models sharing a modbus slave
+    CoreRegModel(ModbusSlavePtr aModbusSlave = ModbusSlavePtr(), int aModbusOffset = 0);
     virtual ~CoreRegModel();
 
     /// access the modbus slave (mainly to set connection specs)
     ModbusSlave& modbusSlave();
 
+    /// add a modbus slave (e.g. on another transport) that mirrors the register values
+    /// @param aMirror the mirror slave, must have the same register layout as modbusSlave()
+    /// @note all values set in the register model are also set in the mirrors. Values are read
+    ///   from modbusSlave() only, so values written into a mirror by a modbus master must be copied to
+    ///   modbusSlave() (and the other mirrors, see mirrorModbusReg()) before updating SPI.
+    void addModbusMirror(ModbusSlavePtr aMirror);
+
+    /// copy a modbus register's value from one slave to the model's modbus slave and all mirrors
+    /// @param aFrom the slave that has the new value
+    /// @param aAddress the modbus register number
+    /// @param aInput set for input registers
+    void mirrorModbusReg(ModbusSlave& aFrom, int aAddress, bool aInput);
+
+    /// @return offset added to all modbus register numbers of this model
+    int modbusOffset() { return mModbusOffset; };
+
+    /// @param aInput set to get span of input registers, R/W registers otherwise
+    /// @return highest modbus register number this model uses (including its offset)
+    int modbusRegisterSpan(bool aInput);
+
     /// access the SPI core protocol handler (mainly to set actual SPI device to use)
     CoreSPIProto& coreSPIProto();
 
 
-    typedef uint16_t RegIndex;
-
     /// @return highest register index
     RegIndex maxReg();
 
-    /// @param aModbusReg the modbus register number
+    /// @param aRegIdx the register index (internal), must be valid
+    /// @return the register definition
+    const CoreModuleRegister& registerDef(RegIndex aRegIdx) { return mRegDefs[aRegIdx]; };
+
+    /// @return max number of unused bytes read through between registers (see setMaxReadGap())
+    int maxReadGap() { return mMaxReadGap; };
+
+    /// @param aRegP the register definition
+    /// @param aDataP the register's raw SPI bytes
+    /// @return engineering value
+    static int32_t extractReg(const CoreModuleRegister* aRegP, const uint8_t* aDataP);
+
+    /// load register map from file, replacing the built-in one
+    /// @param aFilePath path of a JSON file containing a "registers" array with one object per register
+    ///   (fields as returned by getRegisterMap()). SPI addresses must be ascending and non-overlapping in
+    ///   register order, modbus registers must not overlap, and both must fit into 16 bits.
+    /// @return OK or error, in which case the previous register map remains in use
+    ErrorPtr loadRegisterMap(const string aFilePath);
+
+    /// @return the current register map in the format loadRegisterMap() expects
+    JsonObjectPtr getRegisterMap();
+
+    /// @param aModbusReg the modbus register number (for registers occupying two modbus registers, both return the same regindex)
     /// @param aInput set if this is a read-only input register
     /// @return valid regindex if corresponding modbus register exists,
     ///   invalid index that will fail in all other calls otherwise
@@ -98,6 +321,13 @@ namespace p44 {
     RegIndex regindexFromRegName(const string aRegName);
 
 
+    /// determine the contiguous range of SPI registers that can be read in one transaction
+    /// @param aFromIdx first register index to read (internal)
+    /// @param aToIdx input: last register to read, output: last register that can be read in one transaction
+    /// @param aMaxBytes max number of bytes to read
+    /// @return number of bytes to read
+    size_t contiguousSPIRegRange(RegIndex aFromIdx, RegIndex &aToIdx, size_t aMaxBytes);
+
     /// read a range of SPI registers into presented buffer space
     /// @param aFromIdx first register index to read (internal)
     /// @param aToIdx input: last register to read, output: last register actually read
@@ -112,7 +342,7 @@ namespace p44 {
     /// @param aFirstRegIdx index of first register represented by data in aBuffer
     /// @param aLastRegIdx index of last register represented by data in aBuffer
     /// @return OK or error
-    ErrorPtr readRegFromBuffer(RegIndex aRegIdx, int32_t &aData, uint8_t* aBuffer, RegIndex aFirstRegIdx, RegIndex aLastRegIdx);
+    ErrorPtr readRegFromBuffer(RegIndex aRegIdx, int32_t &aData, const uint8_t* aBuffer, RegIndex aFirstRegIdx, RegIndex aLastRegIdx);
 
 
     /// read single SPI register
@@ -132,13 +362,179 @@ namespace p44 {
     /// @param aFromIdx first register index to read (internal)
     /// @param aToIdx last register to read
     /// @return OK or error
+    /// @note SPI is accessed following the precomputed read plan (clipped to the requested range)
     ErrorPtr updateModbusRegistersFromSPI(RegIndex aFromIdx, RegIndex aToIdx);
 
+    /// set how many unused bytes between registers may be read through to save starting a new SPI burst
+    /// @param aMaxGap max number of gap bytes within a burst, 0 to only combine registers with no gap in between
+    /// @note recomputes the read plan
+    void setMaxReadGap(int aMaxGap);
+
+    /// derive the max read gap (see setMaxReadGap()) from the cost of an SPI transaction
+    /// @param aFrameOverhead fixed time per transaction besides transferring bytes (driver call, chip select, fill bytes...)
+    /// @param aBusClockHz SPI bus clock, determines the time per byte
+    /// @note a gap is read through when transferring its bytes takes less time than an extra frame
+    ///   (its fixed overhead plus the protocol's framing bytes)
+    void setReadCostModel(MLMicroSeconds aFrameOverhead, uint32_t aBusClockHz);
+
+    /// set handler to be called for every register value change detected in data read from SPI
+    /// @param aChangeCB the handler, called on the mainloop after the modbus image is updated
+    /// @note a change is detected when the new engineering value differs from the last reported one
+    ///   by at least the register's deadband
+    void setChangeHandler(RegisterChangeCB aChangeCB) { mChangeCB = aChangeCB; };
+
+    /// set deadband for change detection
+    /// @param aRegIdx the register index (internal)
+    /// @param aDeadband min change in real world units to report, 0 to report every change
+    /// @return OK or error
+    ErrorPtr setDeadband(RegIndex aRegIdx, double aDeadband);
+
+    /// @return sequence number of the most recent change
+    uint32_t changeSeq() { return mChangeSeq; };
+
+    /// @return epoch of the change sequence numbers (unix time in seconds when this model was created).
+    ///   Clients must discard sequence numbers obtained in a different epoch, as those restart at 0 with every daemon restart
+    uint32_t changeEpoch() { return mChangeEpoch; };
+
+    /// get info about a change
+    /// @param aChange the change
+    /// @return json object with sequence number, register and old/new engineering and user values
+    JsonObjectPtr getChangeInfo(const RegisterChange& aChange);
+
+    /// get recent changes (detected in data read from SPI as well as values written via modbus or API)
+    /// @param aSinceSeq sequence number of the last change already known to the caller
+    /// @param aEpoch epoch aSinceSeq was obtained in (see changeEpoch()), 0 if not known
+    /// @return json object with "epoch", "seq" (most recent change), "changes" (array of change infos after aSinceSeq)
+    ///   and "complete" (false if older changes are no longer available, or aSinceSeq is from another epoch)
+    JsonObjectPtr getChangesSince(uint32_t aSinceSeq, uint32_t aEpoch);
+
+    /// set poll scheduler intervals
+    /// @param aFastInterval interval for polling all poll_fast registers (latency budget), Never to not poll them
+    /// @param aSlowInterval interval for polling all poll_slow registers, Never to not poll them
+    /// @note fast registers are polled with priority, slow register bursts are interleaved when no fast cycle is due.
+    ///   poll_static and poll_onchange registers are never polled.
+    void setPollIntervals(MLMicroSeconds aFastInterval, MLMicroSeconds aSlowInterval);
+
+    /// @return number of SPI bursts needed to read all registers
+    size_t readPlanBursts() { return mReadPlan.size(); };
+
+    /// @return SPI read statistics and read plan figures
+    JsonObjectPtr getReadStatistics();
+
+    /// record history of register values read from SPI
+    /// @param aRegNames comma separated register names, empty to stop recording history
+    /// @param aRawSize number of raw values to keep per register
+    /// @param aSecondsSize number of per second min/max/avg aggregates to keep per register
+    /// @param aMinutesSize number of per minute min/max/avg aggregates to keep per register
+    /// @return OK or error (unknown register name, history is recorded for the known ones)
+    /// @note history is fed by SPI reads (polling, background refresh or modbus access), so it is only
+    ///   continuous with polling or background refresh enabled. Loading a new register map restarts it.
+    ErrorPtr setHistory(const string aRegNames, size_t aRawSize, size_t aSecondsSize, size_t aMinutesSize);
+
+    /// get history of a register
+    /// @param aRegIdx the register index (internal)
+    /// @param aResolution raw values, per second or per minute aggregates
+    /// @param aSince only entries at or after this unix time, Never for all
+    /// @param aMaxCount max number of (most recent) entries to return, 0 for all
+    /// @return json object with register name and index and column arrays, NULL if no history recorded for the register
+    JsonObjectPtr getHistory(RegIndex aRegIdx, HistoryResolution aResolution, MLMicroSeconds aSince, size_t aMaxCount);
+
+    /// @return json object with sizes and the registers history is recorded for
+    JsonObjectPtr getHistoryInfo();
+
+    /// persist the per second aggregates of the history registers (see setHistory())
+    /// @param aHistoryStore the store, NULL to stop persisting history
+    /// @return OK or error opening the store
+    /// @note the store is (re)opened with the hash of the register map, so stored records of
+    ///   a different register map are not returned by getStoredHistory()
+    ErrorPtr setHistoryStore(HistoryStorePtr aHistoryStore);
+
+    /// @return the history store, NULL if none
+    HistoryStorePtr historyStore() { return mHistoryStore; };
+
+    /// get persisted per second aggregates of a register
+    /// @param aRegIdx the register index (internal)
+    /// @param aFrom only entries at or after this unix time, Never for no limit
+    /// @param aTo only entries before this unix time, Never for no limit
+    /// @param aMaxCount max number of (most recent) entries to return, 0 for all
+    /// @return json object with register name and index and column arrays, NULL if no store
+    JsonObjectPtr getStoredHistory(RegIndex aRegIdx, MLMicroSeconds aFrom, MLMicroSeconds aTo, size_t aMaxCount);
+
+    /// @return hash over the register map layout (names, addresses, layouts)
+    uint32_t registerMapHash();
+
+    /// @return hot path statistics (SPI protocol, modbus access, background refresh and polling) as JSON object
+    JsonObjectPtr getStatistics();
+
+    /// reset hot path statistics
+    void resetStatistics();
+
     /// update SPI register from modbus register
     /// @param aRegIdx register index to write (internal)
     /// @return OK or error
+    /// @note when a write batch is active, the register is only marked dirty and will be written by commitWriteBatch()
     ErrorPtr updateSPIRegisterFromModbus(RegIndex aRegIdx);
 
+    /// start collecting SPI register writes into a batch
+    void beginWriteBatch();
+
+    /// write all registers marked dirty since beginWriteBatch() to SPI,
+    /// merging registers that are contiguous in the SPI address space into a single transaction
+    /// @return OK or error of the first failing transaction (the rest of the batch is not written then)
+    /// @note registers that could not be written are marked stale, so the next access re-reads them from the core
+    ErrorPtr commitWriteBatch();
+
+    /// like commitWriteBatch(), but without blocking the mainloop
+    /// @param aDoneCB called when the batch is written or failed, with the error of the failing transaction
+    void commitWriteBatchAsync(StatusCB aDoneCB);
+
+    /// update modbus register from SPI only if the modbus register image is older than given age
+    /// @param aRegIdx register index (internal)
+    /// @param aMaxAge maximum age of the modbus register image, 0 to always read from SPI
+    /// @return OK or error
+    ErrorPtr updateModbusRegisterIfStale(RegIndex aRegIdx, MLMicroSeconds aMaxAge);
+
+    /// update modbus register from SPI for a modbus read access.
+    /// @param aRegIdx register index (internal)
+    /// @param aMaxAge maximum age of the modbus register image, 0 to always read from SPI
+    /// @return OK or error
+    /// @note modbus requests are processed register by register. To avoid a separate SPI transaction for each,
+    ///   this reads ahead the following registers in the same SPI burst, and does not access SPI again
+    ///   for these within the same mainloop cycle (i.e. the same modbus request)
+    ErrorPtr updateModbusRegisterForAccess(RegIndex aRegIdx, MLMicroSeconds aMaxAge);
+
+    /// asynchronously update the stale registers of a modbus register range from SPI
+    /// @param aModbusReg first modbus register number (including offset)
+    /// @param aNumRegs number of modbus registers
+    /// @param aInput set for input registers
+    /// @param aMaxAge maximum age of the modbus register image, 0 to always read from SPI
+    /// @param aDoneCB called when all stale registers of this model in the range are updated (or failed).
+    ///   Called immediately when none are stale.
+    /// @note registers not belonging to this model are ignored. SPI is read in as few bursts as possible,
+    ///   including registers between the stale ones, without blocking the mainloop
+    void updateModbusRegistersForAccessAsync(int aModbusReg, int aNumRegs, bool aInput, MLMicroSeconds aMaxAge, StatusCB aDoneCB);
+
+    /// set the modbus read ahead window
+    /// @param aNumModbusRegs max number of modbus registers (including the accessed one) to fetch from SPI on a modbus read access,
+    ///   1 to disable read ahead
+    void setReadAhead(int aNumModbusRegs) { mReadAhead = aNumModbusRegs>0 ? aNumModbusRegs : 1; };
+
+    /// check if modbus register image is recent
+    /// @param aRegIdx register index (internal)
+    /// @param aMaxAge maximum age of the modbus register image, or maxAgeFromPolling
+    /// @return true if register was updated from SPI no longer than aMaxAge ago,
+    ///   or at all for poll_static and poll_onchange registers
+    bool isFresh(RegIndex aRegIdx, MLMicroSeconds aMaxAge);
+
+    /// @param aPollClass poll class
+    /// @return max age for registers of that poll class as kept current by background refresh and polling,
+    ///   0 if neither reads them periodically
+    MLMicroSeconds polledMaxAge(PollClass aPollClass);
+
+    /// start or stop periodic background refresh of all modbus registers from SPI
+    /// @param aInterval refresh interval, Never to stop background refresh
+    void setBackgroundRefresh(MLMicroSeconds aInterval);
+
 
 
     /// get engineering register value (with correct sign) from modbus registers
@@ -186,6 +582,66 @@ namespace p44 {
     /// @return json array with all info for all registers
     JsonObjectPtr getRegisterInfos();
 
+    /// @return version tag of the register map, changes whenever getRegisterMetadata() would return different data
+    uint32_t mapVersion() { return mMapVersion; };
+
+    /// get static metadata for all registers
+    /// @return json object with "version" (see mapVersion()) and "registers" (array of metadata per register index)
+    /// @note the document is built once per register map and then returned as-is
+    JsonObjectPtr getRegisterMetadata();
+
+    /// get current values of registers
+    /// @param aSinceSeq 0 to get all values, otherwise only values of registers that have changed (from SPI reads
+    ///   or writes) after the change with the given sequence number are returned (see changeSeq())
+    /// @param aEpoch epoch aSinceSeq was obtained in (see changeEpoch()), 0 if not known. All values are returned
+    ///   when aSinceSeq is from another epoch or ahead of the current sequence number
+    /// @return json object with "version" (see mapVersion()), "epoch", "seq" (most recent change) and
+    ///   "values" (array of objects with regidx and the value fields of getRegisterInfo())
+    JsonObjectPtr getRegisterValues(uint32_t aSinceSeq, uint32_t aEpoch);
+
+    /// get engineering values of all registers without any per-register allocation
+    /// @param aValues will be resized to the number of registers and receive the engineering values indexed by RegIndex
+    /// @return when the modbus register image was last updated from SPI (mainloop time), Never if not yet
+    MLMicroSeconds getValueVector(std::vector<int32_t>& aValues);
+
+    /// get engineering values of all registers in a compact form
+    /// @return json object with "version" (see mapVersion()), "epoch" (see changeEpoch()), "seq" (see changeSeq()), "time" (unix time of
+    ///   last update from SPI, missing if none yet), "count" and "values": a string with 8 hex digits (two's complement, MSB first)
+    ///   per register, in RegIndex order
+    JsonObjectPtr getPackedValues();
+
+  private:
+
+    RegIndex numRegs() { return (RegIndex)mRegDefs.size(); };
+    void prepareRegisterMap();
+    void buildLookupIndices();
+    void buildReadPlan(std::vector<SPIReadBurst>& aPlan, int aPollClass);
+    void buildReadPlans();
+    void addRegisterMetadata(JsonObjectPtr aInfo, RegIndex aRegIdx);
+    void addRegisterValue(JsonObjectPtr aInfo, RegIndex aRegIdx);
+    void pollStep();
+    void pollBurstDone(uint16_t aGeneration, uint32_t aWriteGeneration, int aPollClass, size_t aBurstIdx, ErrorPtr aError, const uint8_t* aData, uint8_t aLen);
+    ErrorPtr readBurst(const SPIReadBurst& aBurst, uint8_t* aBuffer);
+    void countRead(RegIndex aFromIdx, RegIndex aToIdx, size_t aLen);
+    ErrorPtr updateModbusRegistersFromBuffer(RegIndex aFromIdx, RegIndex aToIdx, const uint8_t* aBuffer, uint32_t aWriteGeneration);
+    void registerWritten(RegIndex aRegIdx);
+    void recordChange(RegIndex aRegIdx, int32_t aNewValue, MLMicroSeconds aWhen);
+    void backgroundRefresh();
+    void refreshNextBurst();
+    void refreshBurstDone(uint16_t aBurstIdx, ErrorPtr aError, const uint8_t* aData, uint8_t aLen);
+    void endAccessBurst();
+    typedef std::pair<RegIndex, RegIndex> WriteRange; ///< first and last register index of a write transaction
+    typedef std::vector<WriteRange> WriteRanges;
+    void collectWriteBatch(WriteRanges& aRanges);
+    size_t layoutWriteRange(const WriteRange& aRange, uint8_t* aBuffer);
+    void writeRangeDone(const WriteRange& aRange, ErrorPtr aError);
+    void writeBatchNext(WriteRanges aRanges, size_t aNext, MLMicroSeconds aStarted, StatusCB aDoneCB);
+    void writeBatchDone(WriteRanges aRanges, size_t aNext, MLMicroSeconds aStarted, StatusCB aDoneCB, ErrorPtr aError);
+    void accessReadNext(uint16_t aGeneration, uint32_t aWriteGeneration, RegIndex aFromIdx, RegIndex aToIdx, StatusCB aDoneCB);
+    void accessReadDone(uint16_t aGeneration, uint32_t aWriteGeneration, RegIndex aFromIdx, RegIndex aLastIdx, RegIndex aToIdx, StatusCB aDoneCB, ErrorPtr aError, const uint8_t* aData, uint8_t aLen);
+    void accessReadComplete(MLMicroSeconds aStarted, StatusCB aDoneCB, ErrorPtr aError);
+    void historyTick();
+
   };
   typedef boost::intrusive_ptr<CoreRegModel> CoreRegModelPtr;
 
@@ -30,53 +30,385 @@
 
 using namespace p44;
 
-CoreSPIProto::CoreSPIProto()
+// MARK: - CoreSPIBus
+
+CoreSPIBus::CoreSPIBus() :
+  mNextProto(0),
+  mPendingCount(0),
+  mStopWorker(false)
+{
+}
+
+
+CoreSPIBus::~CoreSPIBus()
+{
+  if (mWorker) {
+    mStopWorker = true;
+    {
+      std::lock_guard<std::mutex> lock(mWakeMutex);
+    }
+    mWakeCond.notify_one();
+    mWorker->cancel();
+    mWorker.reset();
+  }
+}
+
+
+void CoreSPIBus::attach(CoreSPIProto* aProto)
+{
+  std::lock_guard<std::mutex> lock(mProtosMutex);
+  mProtos.push_back(aProto);
+}
+
+
+void CoreSPIBus::detach(CoreSPIProto* aProto)
+{
+  // Note: worker holds mProtosMutex while executing a transaction, so after this aProto is no longer accessed
+  std::lock_guard<std::mutex> lock(mProtosMutex);
+  for (std::vector<CoreSPIProto*>::iterator pos = mProtos.begin(); pos!=mProtos.end(); ++pos) {
+    if (*pos==aProto) {
+      mProtos.erase(pos);
+      break;
+    }
+  }
+}
+
+
+void CoreSPIBus::transactionQueued()
+{
+  if (!mWorker) {
+    // start the worker thread
+    mWorker = MainLoop::currentMainLoop().executeInThread(
+      boost::bind(&CoreSPIBus::workerThread, this, _1),
+      boost::bind(&CoreSPIBus::workerSignal, this, _1, _2)
+    );
+  }
+  mPendingCount++;
+  {
+    // make sure worker is either not yet waiting or gets the notification
+    std::lock_guard<std::mutex> lock(mWakeMutex);
+  }
+  mWakeCond.notify_one();
+}
+
+
+void CoreSPIBus::workerThread(ChildThreadWrapper &aThread)
+{
+  while (!mStopWorker) {
+    bool executed = false;
+    {
+      std::lock_guard<std::mutex> lock(mProtosMutex);
+      // round robin: one transaction per device in turn, so devices sharing the bus get a fair share
+      for (size_t n=0; n<mProtos.size(); n++) {
+        if (mNextProto>=mProtos.size()) mNextProto = 0;
+        CoreSPIProto* proto = mProtos[mNextProto++];
+        CoreSPITransaction* t;
+        if (!proto->mPending.pop(t)) continue;
+        mPendingCount--;
+        proto->mQueueWait.record(MainLoop::now()-t->mQueued);
+        // execute
+        if (t->mWrite) {
+          t->mError = proto->writeData(t->mAddr, t->mLen, t->mData);
+        }
+        else {
+          t->mError = proto->readData(t->mAddr, t->mLen, t->mData);
+        }
+        // queueTransaction() limits the number of transactions in flight to the queue capacity,
+        // so the completion queue cannot be full
+        proto->mCompleted.push(t);
+        executed = true;
+        break;
+      }
+    }
+    if (executed) {
+      // have the mainloop deliver the result
+      aThread.signalParentThread(threadSignalUserSignal);
+    }
+    else {
+      // nothing to do, wait for new transactions
+      std::unique_lock<std::mutex> lock(mWakeMutex);
+      while (mPendingCount<=0 && !mStopWorker) mWakeCond.wait(lock);
+    }
+  }
+}
+
+
+void CoreSPIBus::workerSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
 {
+  if (aSignalCode==threadSignalUserSignal) {
+    // deliver results of all completed transactions of all devices
+    for (size_t i=0; i<mProtos.size(); i++) {
+      mProtos[i]->deliverCompleted();
+    }
+  }
+}
+
 
+// MARK: - CoreSPIProto
+
+CoreSPIProto::CoreSPIProto() :
+  mInFlight(0),
+  mFillerPrediction(true)
+{
+  for (int i=0; i<fillerSlots; i++) {
+    mFillerAvg[i] = 0;
+    mFillerSamples[i] = 0;
+  }
 }
 
+
 CoreSPIProto::~CoreSPIProto()
 {
+  if (mBus) {
+    mBus->detach(this);
+    // discard transactions not yet executed or delivered
+    CoreSPITransaction* t;
+    while (mPending.pop(t)) {
+      mBus->mPendingCount--;
+      delete t;
+    }
+    while (mCompleted.pop(t)) delete t;
+    mBus.reset();
+  }
+}
+
+
+void CoreSPIProto::setBus(CoreSPIBusPtr aBus)
+{
+  if (mBus) mBus->detach(this);
+  mBus = aBus;
+  if (mBus) mBus->attach(this);
+}
+
 
+CoreSPIBus& CoreSPIProto::bus()
+{
+  if (!mBus) setBus(CoreSPIBusPtr(new CoreSPIBus));
+  return *mBus.get();
 }
 
 
 ErrorPtr CoreSPIProto::writeData(uint16_t aAddr, uint8_t aLen, const uint8_t* aData)
 {
-  if (!mSPI) return new CoreSPIError(CoreSPIError::noSPI);
-  uint8_t wrhdr[5];
-  wrhdr[0] = 0xAB; // lead in
-  wrhdr[1] = 0x01; // write cmd
-  wrhdr[2] = aAddr & 0xFF; // addr LSB
-  wrhdr[3] = (aAddr>>8) & 0xFF; // addr MSB
-  wrhdr[4] = aLen; // len
-  uint16_t crc = crc16(0, 5, wrhdr);
-  crc = crc16(crc, aLen, aData);
-  // send header
-  if (mSPI->SPIRawWriteRead(5, wrhdr, 0, NULL, false, true)) { // keep transaction running
-    // send data
-    if (mSPI->SPIRawWriteRead(aLen, aData, 0, NULL, false, true)) { // keep transaction running
-      // send CRC
-      wrhdr[0] = crc & 0xFF; // crc LSB
-      wrhdr[1] = (crc>>8) & 0xFF; // crc MSB
-      if (mSPI->SPIRawWriteRead(2, wrhdr, 0, NULL, false, false)) { // transaction ends here
-        // successful write
-        return ErrorPtr();
-      }
+  MLMicroSeconds t = MainLoop::now();
+  std::lock_guard<std::mutex> lock(bus().mBusMutex);
+  MLMicroSeconds started = MainLoop::now();
+  mBusWait.record(started-t);
+  ErrorPtr err = spiWriteData(aAddr, aLen, aData);
+  mWriteTime.record(MainLoop::now()-started);
+  mWrites.inc();
+  mWriteBytes.inc(aLen);
+  countError(err);
+  return err;
+}
+
+
+ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
+{
+  MLMicroSeconds t = MainLoop::now();
+  std::lock_guard<std::mutex> lock(bus().mBusMutex);
+  MLMicroSeconds started = MainLoop::now();
+  mBusWait.record(started-t);
+  int fillers = 0;
+  ErrorPtr err = spiReadData(aAddr, aLen, aData, fillers);
+  mReadTime.record(MainLoop::now()-started);
+  mReads.inc();
+  mReadBytes.inc(aLen);
+  mFillerBytes.inc(fillers);
+  mFillers.record(fillers);
+  countError(err);
+  return err;
+}
+
+
+void CoreSPIProto::countError(ErrorPtr aError)
+{
+  if (Error::notOK(aError) && aError->isDomain(CoreSPIError::domain())) {
+    ErrorCode c = aError->getErrorCode();
+    if (c>0 && c<CoreSPIError::numErrorCodes) mErrors[c].inc();
+  }
+}
+
+
+// MARK: - statistics
+
+static const char* const statErrNames[CoreSPIError::numErrorCodes] = {
+  NULL, // OK
+  "noSPI",
+  "writeErrors",
+  "readErrors",
+  "readTimeouts",
+  "crcErrors",
+  "protoErrors",
+  "queueFull"
+};
+
+JsonObjectPtr CoreSPIProto::getStatistics()
+{
+  JsonObjectPtr stats = JsonObject::newObj();
+  stats->add("reads", JsonObject::newInt64(mReads.value()));
+  stats->add("writes", JsonObject::newInt64(mWrites.value()));
+  stats->add("readBytes", JsonObject::newInt64(mReadBytes.value()));
+  stats->add("writeBytes", JsonObject::newInt64(mWriteBytes.value()));
+  stats->add("fillerBytes", JsonObject::newInt64(mFillerBytes.value()));
+  for (int i=1; i<CoreSPIError::numErrorCodes; i++) {
+    stats->add(statErrNames[i], JsonObject::newInt64(mErrors[i].value()));
+  }
+  stats->add("singleShots", JsonObject::newInt64(mSingleShots.value()));
+  stats->add("singleShotMisses", JsonObject::newInt64(mSingleShotMisses.value()));
+  stats->add("fillersPerRead", mFillers.json());
+  stats->add("readTime", mReadTime.json());
+  stats->add("writeTime", mWriteTime.json());
+  stats->add("busWait", mBusWait.json());
+  stats->add("queueWait", mQueueWait.json());
+  return stats;
+}
+
+
+void CoreSPIProto::resetStatistics()
+{
+  mReads.reset();
+  mWrites.reset();
+  mReadBytes.reset();
+  mWriteBytes.reset();
+  mFillerBytes.reset();
+  for (int i=0; i<CoreSPIError::numErrorCodes; i++) mErrors[i].reset();
+  mSingleShots.reset();
+  mSingleShotMisses.reset();
+  mFillers.reset();
+  mReadTime.reset();
+  mWriteTime.reset();
+  mBusWait.reset();
+  mQueueWait.reset();
+}
+
+
+// MARK: - asynchronous transactions
+
+void CoreSPIProto::writeDataAsync(uint16_t aAddr, uint8_t aLen, const uint8_t* aData, CoreSPIDoneCB aDoneCB)
+{
+  CoreSPITransaction* t = new CoreSPITransaction;
+  t->mWrite = true;
+  t->mAddr = aAddr;
+  t->mLen = aLen;
+  memcpy(t->mData, aData, aLen);
+  t->mDoneCB = aDoneCB;
+  queueTransaction(t);
+}
+
+
+void CoreSPIProto::readDataAsync(uint16_t aAddr, uint8_t aLen, CoreSPIDoneCB aDoneCB)
+{
+  CoreSPITransaction* t = new CoreSPITransaction;
+  t->mWrite = false;
+  t->mAddr = aAddr;
+  t->mLen = aLen;
+  t->mDoneCB = aDoneCB;
+  queueTransaction(t);
+}
+
+
+void CoreSPIProto::queueTransaction(CoreSPITransaction* aTransaction)
+{
+  CoreSPIBus& b = bus();
+  aTransaction->mQueued = MainLoop::now();
+  // Note: count executed but not yet delivered transactions too, so the completion queue cannot overflow
+  if (mInFlight>=coreSPIQueueSize || !mPending.push(aTransaction)) {
+    mErrors[CoreSPIError::queueFull].inc();
+    // queue full, report error (but not from within the caller's context)
+    MainLoop::currentMainLoop().executeNow(boost::bind(&CoreSPIProto::transactionFailed, this, aTransaction));
+    return;
+  }
+  mInFlight++;
+  b.transactionQueued();
+}
+
+
+void CoreSPIProto::transactionFailed(CoreSPITransaction* aTransaction)
+{
+  if (aTransaction->mDoneCB) {
+    aTransaction->mDoneCB(Error::err<CoreSPIError>(CoreSPIError::queueFull, "too many pending SPI transactions"), NULL, aTransaction->mLen);
+  }
+  delete aTransaction;
+}
+
+
+void CoreSPIProto::deliverCompleted()
+{
+  CoreSPITransaction* t;
+  while (mCompleted.pop(t)) {
+    mInFlight--;
+    if (t->mDoneCB) {
+      t->mDoneCB(t->mError, t->mWrite || Error::notOK(t->mError) ? NULL : t->mData, t->mLen);
     }
+    delete t;
+  }
+}
+
+
+// MARK: - delay filler prediction
+
+/// minimal number of observations before an address block's prediction is used
+static const int minFillerSamples = 4;
+
+int CoreSPIProto::predictedFillers(uint16_t aAddr)
+{
+  int slot = (aAddr/fillerSlotBytes)%fillerSlots;
+  if (!mFillerPrediction || mFillerSamples[slot]<minFillerSamples) return -1; // no prediction (yet)
+  int n = (mFillerAvg[slot]+15)/16 + 1; // rounded up, plus one spare
+  return n>maxPredictedFillers ? maxPredictedFillers : n;
+}
+
+
+void CoreSPIProto::learnFillers(uint16_t aAddr, int aFillers)
+{
+  int slot = (aAddr/fillerSlotBytes)%fillerSlots;
+  // Note: the step by step fallback can count far more fillers than could ever be predicted,
+  //   clamp before scaling so the average cannot wrap around
+  if (aFillers>maxPredictedFillers) aFillers = maxPredictedFillers;
+  uint16_t f = aFillers*16;
+  if (mFillerSamples[slot]==0 || f>mFillerAvg[slot]) {
+    // fast attack: more fillers than average must be covered by the next prediction
+    mFillerAvg[slot] = f;
+  }
+  else {
+    // slow decay
+    mFillerAvg[slot] -= (mFillerAvg[slot]-f)/8;
+  }
+  if (mFillerSamples[slot]<255) mFillerSamples[slot]++;
+}
+
+
+// MARK: - SPI protocol
+
+ErrorPtr CoreSPIProto::spiWriteData(uint16_t aAddr, uint8_t aLen, const uint8_t* aData)
+{
+  if (!mTransport) return new CoreSPIError(CoreSPIError::noSPI);
+  // assemble entire frame, so it can be sent in a single SPI transfer
+  uint8_t frame[5+255+2];
+  frame[0] = 0xAB; // lead in
+  frame[1] = 0x01; // write cmd
+  frame[2] = aAddr & 0xFF; // addr LSB
+  frame[3] = (aAddr>>8) & 0xFF; // addr MSB
+  frame[4] = aLen; // len
+  memcpy(frame+5, aData, aLen);
+  uint16_t crc = crc16(0, 5+aLen, frame);
+  frame[5+aLen] = crc & 0xFF; // crc LSB
+  frame[5+aLen+1] = (crc>>8) & 0xFF; // crc MSB
+  // send header, data and CRC in one transaction
+  if (mTransport->rawWriteRead(5+aLen+2, frame, 0, NULL, false, false)) { // transaction ends here
+    // successful write
+    return ErrorPtr();
   }
   // something went wrong
   return new CoreSPIError(CoreSPIError::writeErr);
 }
 
 
-// define this to 1 to get some duzmmy data back instead of error even if real SPI access fails
-#define DUMMYDATA 0
-
-ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
+ErrorPtr CoreSPIProto::spiReadData(uint16_t aAddr, uint8_t aLen, uint8_t* aData, int &aFillers)
 {
   ErrorPtr err;
-  if (!mSPI) return new CoreSPIError(CoreSPIError::noSPI);
+  if (!mTransport) return new CoreSPIError(CoreSPIError::noSPI);
   uint8_t rdhdr[5];
   rdhdr[0] = 0xAB; // lead in
   rdhdr[1] = 0x02; // read cmd
@@ -84,12 +416,40 @@ ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
   rdhdr[3] = (aAddr>>8) & 0xFF; // addr MSB
   rdhdr[4] = aLen; // len
   uint16_t crc = crc16(0, 5, rdhdr);
-  uint8_t buf[256];
+  int predicted = predictedFillers(aAddr);
+  if (predicted>=0) {
+    // single shot: clock in predicted fillers, lead-in, data and CRC in one transfer
+    uint8_t sbuf[maxPredictedFillers+1+255+2];
+    if (!mTransport->rawWriteRead(5, rdhdr, predicted+1+aLen+2, sbuf, false, false)) { // transaction ends here
+      return Error::err<CoreSPIError>(CoreSPIError::readErr, "failed single shot read");
+    }
+    int i = 0;
+    while (i<=predicted && sbuf[i]==0xFF) i++; // swallow delay bytes
+    if (i<=predicted) {
+      aFillers = i;
+      if (sbuf[i]!=0xAB) {
+        return Error::err<CoreSPIError>(CoreSPIError::protoErr, "invalid read delay filler byte: 0x%02X", sbuf[i]);
+      }
+      learnFillers(aAddr, i);
+      mSingleShots.inc();
+      crc = crc16(crc, 1+aLen, sbuf+i); // lead-in and data
+      memcpy(aData, sbuf+i+1, aLen);
+      uint16_t recCrc = sbuf[i+1+aLen] + (((uint16_t)sbuf[i+1+aLen+1])<<8);
+      if (recCrc!=crc) {
+        return Error::err<CoreSPIError>(CoreSPIError::crcErr, "read CRC mismatch, found=0x%02X, expected=0x%02X", recCrc, crc);
+      }
+      return ErrorPtr();
+    }
+    // more fillers than predicted: repeat the read step by step
+    mSingleShotMisses.inc();
+    aFillers = 0;
+  }
+  uint8_t buf[1+255+1]; // lead-in, max data length, spare
   // send header and start reading
   // - minimally, we'll get the expected number of bytes + lead in
   // - we'll also get 2 bytes CRC, but we read those separately to end the transaction
-  uint8_t expected = aLen+1;
-  if (!mSPI->SPIRawWriteRead(5, rdhdr, expected, buf, false, true)) { // keep transaction running
+  int expected = aLen+1; // not uint8_t: a 255 byte read plus lead-in would overflow
+  if (!mTransport->rawWriteRead(5, rdhdr, expected, buf, false, true)) { // keep transaction running
     err = Error::err<CoreSPIError>(CoreSPIError::readErr, "failed initiating read");
   }
   else {
@@ -97,7 +457,7 @@ ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
     bool datastarted = false;
     int maxreps = 100;
     while (aLen>0) {
-      uint8_t i = 0;
+      int i = 0;
       while (!datastarted && i<expected) {
         if (buf[i]==0xAB) {
           // real data starts at i+1
@@ -112,14 +472,18 @@ ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
           break;
         }
         // delay byte, just swallow
+        aFillers++;
         i++;
       }
       // transfer the real data (if any)
-      while (datastarted && i<expected && aLen>0) {
-        crc16addbyte(crc, buf[i]);
-        *aData++ = buf[i];
-        aLen--;
-        i++;
+      if (datastarted && i<expected && aLen>0) {
+        int n = expected-i;
+        if (n>aLen) n = aLen;
+        crc = crc16(crc, n, buf+i);
+        memcpy(aData, buf+i, n);
+        aData += n;
+        aLen -= n;
+        i += n;
       }
       if (err || aLen<=0) break; // all data received
       // more data to read: if data not yet started, including lead-in byte
@@ -129,12 +493,13 @@ ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
         break;
       }
       // read more
-      if (!mSPI->SPIRawWriteRead(0, NULL, expected, buf, false, true)) { // keep transaction running
+      if (!mTransport->rawWriteRead(0, NULL, expected, buf, false, true)) { // keep transaction running
         err = Error::err<CoreSPIError>(CoreSPIError::readErr, "failed reading more data");
       }
     }
+    if (datastarted) learnFillers(aAddr, aFillers);
     // now read and check CRC
-    if (!mSPI->SPIRawWriteRead(0, NULL, 2, buf, false, false)) { // end transaction here
+    if (!mTransport->rawWriteRead(0, NULL, 2, buf, false, false)) { // end transaction here
       err = Error::err<CoreSPIError>(CoreSPIError::readErr, "failed reading CRC bytes");
     }
     else {
@@ -145,26 +510,18 @@ ErrorPtr CoreSPIProto::readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData)
       }
     }
   }
-  #if DUMMYDATA
-  if (Error::notOK(err)) {
-    LOG(LOG_WARNING, "SPI access addr=%d, len=%d had error, returning dummy data: %s", aAddr, aLen, err->text());
-    // just reflect 8-bit address as data
-    for (int i=0; i<aLen; i++) {
-      *aData++ = aAddr+i;
-    }
-    err.reset(); // do not propagate
-  }
-  #endif
   return err;
 }
 
 
-static const uint16_t CRC16_polynominal = 0x8408;
+// MARK: - CRC
 
-void CoreSPIProto::crc16addbyte(uint16_t &aCrc16, uint8_t aByte)
+static constexpr uint16_t CRC16_polynominal = 0x8408;
+
+/// shift one byte through the CRC bit by bit (reference implementation, used to generate the table)
+static constexpr uint16_t crc16bitwise(uint16_t aCrc16, uint8_t aByte)
 {
-  int i;
-  for(i=8; i; i--) {
+  for (int i=8; i; i--) {
     if ((aByte ^ aCrc16) & 1) {
       aCrc16 >>= 1;
       aCrc16 ^= CRC16_polynominal;
@@ -172,15 +529,64 @@ void CoreSPIProto::crc16addbyte(uint16_t &aCrc16, uint8_t aByte)
     else {
       aCrc16 >>= 1;
     }
-    aByte>>=1;
+    aByte >>= 1;
+  }
+  return aCrc16;
+}
+
+/// CRC16 lookup table, one entry per byte value
+struct Crc16Table
+{
+  uint16_t entries[256];
+
+  constexpr Crc16Table() : entries()
+  {
+    for (int b=0; b<256; b++) entries[b] = crc16bitwise(0, (uint8_t)b);
+  }
+
+  constexpr uint16_t addbyte(uint16_t aCrc16, uint8_t aByte) const
+  {
+    return (aCrc16>>8) ^ entries[(aCrc16^aByte) & 0xFF];
+  }
+};
+
+static constexpr Crc16Table crc16table;
+
+/// check the table driven step against the bitwise routine for all byte values and a range of CRC states
+static constexpr bool crc16TableMatchesBitwise()
+{
+  uint16_t crc = 0;
+  for (int k=0; k<4096; k++) {
+    uint8_t b = (uint8_t)(k*7+(k>>8));
+    if (crc16table.addbyte(crc, b)!=crc16bitwise(crc, b)) return false;
+    crc = crc16bitwise(crc, b);
   }
+  return true;
+}
+
+/// CRC of "123456789" with initial value 0 (CRC-16/KERMIT check value)
+static constexpr uint16_t crc16CheckValue()
+{
+  const char* s = "123456789";
+  uint16_t crc = 0;
+  while (*s) crc = crc16table.addbyte(crc, (uint8_t)*s++);
+  return crc;
+}
+
+static_assert(crc16TableMatchesBitwise(), "CRC16 table does not match bitwise CRC16");
+static_assert(crc16CheckValue()==0x2189, "CRC16 table does not produce the reference check value");
+
+
+void CoreSPIProto::crc16addbyte(uint16_t &aCrc16, uint8_t aByte)
+{
+  aCrc16 = crc16table.addbyte(aCrc16, aByte);
 }
 
 
-uint16_t CoreSPIProto::crc16(uint16_t aCrc, uint8_t aLen, const uint8_t* aData)
+uint16_t CoreSPIProto::crc16(uint16_t aCrc, size_t aLen, const uint8_t* aData)
 {
   while (aLen-- > 0) {
-    crc16addbyte(aCrc, *aData++);
+    aCrc = crc16table.addbyte(aCrc, *aData++);
   }
   return aCrc;
 }
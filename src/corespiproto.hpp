@@ -24,6 +24,12 @@
 
 #include "p44utils_common.hpp"
 #include "spi.hpp"
+#include "spscqueue.hpp"
+#include "corestats.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 using namespace std;
 
@@ -40,6 +46,7 @@ namespace p44 {
       readTimeout, ///< too many fill bytes
       crcErr, ///< CRC error in received data
       protoErr, ///< Protocol error
+      queueFull, ///< too many asynchronous transactions pending
       numErrorCodes
     } ErrorCodes;
     static const char *domain() { return "CoreSPI"; }
@@ -57,16 +64,156 @@ namespace p44 {
       "readTimeout",
       "crcErr",
       "protoErr",
+      "queueFull",
     };
     #endif // ENABLE_NAMED_ERRORS
   };
 
 
+  /// raw transport for the core SPI protocol frames
+  class CoreSPITransport : public P44Obj
+  {
+  public:
+
+    /// raw SPI transfer, same semantics as SPIDevice::SPIRawWriteRead()
+    /// @param aNumTx number of bytes to send
+    /// @param aTxBuffer bytes to send
+    /// @param aNumRx number of bytes to receive
+    /// @param aRxBuffer buffer for received bytes
+    /// @param aFullDuplex if set, receiving happens while sending
+    /// @param aDoNotDeselect if set, the transaction is continued by the next call (chip select stays active)
+    /// @return true if successful
+    virtual bool rawWriteRead(unsigned int aNumTx, const uint8_t *aTxBuffer, unsigned int aNumRx, uint8_t *aRxBuffer, bool aFullDuplex, bool aDoNotDeselect) = 0;
+
+  };
+  typedef boost::intrusive_ptr<CoreSPITransport> CoreSPITransportPtr;
+
+
+  /// transport via an actual SPI device
+  class SPIDeviceTransport : public CoreSPITransport
+  {
+    SPIDevicePtr mSPI;
+
+  public:
+
+    SPIDeviceTransport(SPIDevicePtr aSPIDevice) : mSPI(aSPIDevice) {};
+
+    virtual bool rawWriteRead(unsigned int aNumTx, const uint8_t *aTxBuffer, unsigned int aNumRx, uint8_t *aRxBuffer, bool aFullDuplex, bool aDoNotDeselect) P44_OVERRIDE
+    {
+      return mSPI->SPIRawWriteRead(aNumTx, aTxBuffer, aNumRx, aRxBuffer, aFullDuplex, aDoNotDeselect);
+    }
+
+  };
+
+
+  /// callback for asynchronous SPI transactions
+  /// @param aError OK or error
+  /// @param aData for reads: the data read (only valid during the callback), NULL for writes
+  /// @param aLen number of data bytes
+  typedef boost::function<void (ErrorPtr aError, const uint8_t* aData, uint8_t aLen)> CoreSPIDoneCB;
+
+  /// a queued SPI transaction
+  /// @note passed between threads as a plain pointer, owned by whichever queue it is in
+  class CoreSPITransaction
+  {
+    friend class CoreSPIProto;
+    friend class CoreSPIBus;
+
+    bool mWrite; ///< set for write transactions
+    uint16_t mAddr; ///< data bank address
+    uint8_t mLen; ///< number of bytes
+    uint8_t mData[255]; ///< data to write or data read
+    ErrorPtr mError; ///< result
+    MLMicroSeconds mQueued; ///< when the transaction was queued
+    CoreSPIDoneCB mDoneCB; ///< called on the mainloop when transaction is complete
+  };
+
+  /// max number of asynchronous transactions that can be in flight (queued, executing or waiting for delivery) per CoreSPIProto
+  const size_t coreSPIQueueSize = 64;
+  typedef SPSCQueue<CoreSPITransaction*, coreSPIQueueSize+1> CoreSPIQueue;
+
+
+  class CoreSPIProto;
+
+  /// a SPI bus with a worker thread executing the asynchronous transactions of all CoreSPIProto on that bus
+  class CoreSPIBus : public P44Obj
+  {
+    friend class CoreSPIProto;
+
+    std::mutex mBusMutex; ///< serializes SPI transactions on this bus
+
+    ChildThreadWrapperPtr mWorker; ///< the worker thread, started on first asynchronous transaction
+    std::mutex mProtosMutex; ///< protects mProtos, held by worker while executing a transaction
+    std::vector<CoreSPIProto*> mProtos; ///< the protocol handlers using this bus
+    size_t mNextProto; ///< round robin index into mProtos
+    std::atomic<int> mPendingCount; ///< number of transactions pending in all queues
+    std::mutex mWakeMutex; ///< for sleeping when idle
+    std::condition_variable mWakeCond; ///< signals new pending transactions to worker
+    std::atomic<bool> mStopWorker; ///< set to make worker thread exit
+
+  public:
+
+    CoreSPIBus();
+    virtual ~CoreSPIBus();
+
+  private:
+
+    void attach(CoreSPIProto* aProto);
+    void detach(CoreSPIProto* aProto);
+    void transactionQueued();
+    void workerThread(ChildThreadWrapper &aThread);
+    void workerSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
+
+  };
+  typedef boost::intrusive_ptr<CoreSPIBus> CoreSPIBusPtr;
+
+
   class CoreSPIProto : public P44LoggingObj
   {
     typedef P44LoggingObj inherited;
+    friend class CoreSPIBus;
 
-    SPIDevicePtr mSPI;
+  public:
+
+    /// number of non-data bytes in every frame (lead-in, command, address, length, CRC)
+    static const int frameOverheadBytes = 7;
+
+    /// number of address blocks with separate delay filler prediction
+    static const int fillerSlots = 16;
+    /// size of an address block for delay filler prediction
+    static const int fillerSlotBytes = 32;
+    /// max number of delay filler bytes to read in a single shot read
+    static const int maxPredictedFillers = 32;
+
+  private:
+
+    CoreSPITransportPtr mTransport; ///< the transport to send frames through
+    CoreSPIBusPtr mBus; ///< the bus this device is on, executes asynchronous transactions
+
+    // asynchronous transactions
+    CoreSPIQueue mPending; ///< transactions waiting to be executed (mainloop -> bus worker)
+    CoreSPIQueue mCompleted; ///< executed transactions waiting for callback (bus worker -> mainloop)
+    size_t mInFlight; ///< transactions queued but not yet delivered (mainloop only), bounds mPending+mCompleted to coreSPIQueueSize
+
+    // statistics (updated by whichever thread executes the transaction)
+    StatCounter mReads; ///< number of read frames
+    StatCounter mWrites; ///< number of write frames
+    StatCounter mReadBytes; ///< number of data bytes read
+    StatCounter mWriteBytes; ///< number of data bytes written
+    StatCounter mFillerBytes; ///< number of delay filler bytes the core sent before read data
+    StatCounter mErrors[CoreSPIError::numErrorCodes]; ///< number of errors by error code
+    Log2Histogram mFillers; ///< delay filler bytes per read frame
+    Log2Histogram mReadTime; ///< time in uS per read frame
+    Log2Histogram mWriteTime; ///< time in uS per write frame
+    Log2Histogram mBusWait; ///< time in uS waiting for the bus (other transaction in progress)
+    Log2Histogram mQueueWait; ///< time in uS asynchronous transactions wait in the queue before being executed
+    StatCounter mSingleShots; ///< number of reads completed in a single transfer based on filler prediction
+    StatCounter mSingleShotMisses; ///< number of single shot reads that had to be repeated because fillers exceeded the prediction
+
+    // delay filler prediction (only accessed with bus mutex held)
+    bool mFillerPrediction; ///< set if single shot reads based on filler prediction are enabled
+    uint16_t mFillerAvg[fillerSlots]; ///< per address block: moving average of delay filler bytes, in 1/16
+    uint8_t mFillerSamples[fillerSlots]; ///< per address block: number of observations (saturating)
 
   public:
 
@@ -74,7 +221,22 @@ namespace p44 {
     virtual ~CoreSPIProto();
 
     /// Specify the SPI device to use for accessing the SPI bus
-    void setSpiDevice(SPIDevicePtr aSPIDevice) { mSPI = aSPIDevice; };
+    void setSpiDevice(SPIDevicePtr aSPIDevice) { mTransport = aSPIDevice ? new SPIDeviceTransport(aSPIDevice) : NULL; };
+
+    /// Specify the transport to use (instead of an SPI device, e.g. a simulation)
+    void setTransport(CoreSPITransportPtr aTransport) { mTransport = aTransport; };
+
+    /// Enable or disable delay filler prediction
+    /// @param aEnable if set (default), reads learn the typical number of delay filler bytes the core sends per
+    ///   address block and then clock in fillers, data and CRC in a single transfer. Reads with more fillers than
+    ///   predicted are repeated the step-by-step way.
+    void setFillerPrediction(bool aEnable) { mFillerPrediction = aEnable; };
+
+    /// Specify the bus the SPI device is on
+    /// @param aBus the bus, shared by all CoreSPIProto for devices on the same physical SPI bus. Its worker thread
+    ///   executes asynchronous transactions of all of them in round robin order.
+    /// @note if not set, a bus of its own is created on first use
+    void setBus(CoreSPIBusPtr aBus);
 
     /// Write Data
     /// @param aAddr the data bank address to start writing
@@ -90,12 +252,43 @@ namespace p44 {
     /// @return OK or error
     ErrorPtr readData(uint16_t aAddr, uint8_t aLen, uint8_t* aData);
 
+    /// Write data asynchronously
+    /// @param aAddr the data bank address to start writing
+    /// @param aLen the number of bytes to write
+    /// @param aData the data to write (will be copied, caller does not need to keep it)
+    /// @param aDoneCB called on the mainloop when the data is written
+    /// @note transaction is queued and executed on the SPI worker thread, so the mainloop is not blocked
+    void writeDataAsync(uint16_t aAddr, uint8_t aLen, const uint8_t* aData, CoreSPIDoneCB aDoneCB);
+
+    /// Read data asynchronously
+    /// @param aAddr the data bank address to start reading
+    /// @param aLen the number of bytes to read
+    /// @param aDoneCB called on the mainloop with the data read
+    /// @note transaction is queued and executed on the SPI worker thread, so the mainloop is not blocked
+    void readDataAsync(uint16_t aAddr, uint8_t aLen, CoreSPIDoneCB aDoneCB);
+
+    /// @return SPI statistics as JSON object
+    JsonObjectPtr getStatistics();
+
+    /// reset SPI statistics
+    void resetStatistics();
+
     /// CRC16
     static void crc16addbyte(uint16_t &aCrc16, uint8_t aByte);
-    static uint16_t crc16(uint16_t aCrc, uint8_t aLen, const uint8_t* aData);
+    static uint16_t crc16(uint16_t aCrc, size_t aLen, const uint8_t* aData);
 
+  private:
 
+    ErrorPtr spiWriteData(uint16_t aAddr, uint8_t aLen, const uint8_t* aData);
+    ErrorPtr spiReadData(uint16_t aAddr, uint8_t aLen, uint8_t* aData, int &aFillers);
+    void countError(ErrorPtr aError);
+    int predictedFillers(uint16_t aAddr);
+    void learnFillers(uint16_t aAddr, int aFillers);
 
+    CoreSPIBus& bus();
+    void queueTransaction(CoreSPITransaction* aTransaction);
+    void deliverCompleted();
+    void transactionFailed(CoreSPITransaction* aTransaction);
 
   };
   typedef boost::intrusive_ptr<CoreSPIProto> CoreSPIProtoPtr;
@@ -0,0 +1,91 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "corestats.hpp"
+
+using namespace p44;
+
+
+uint64_t Log2Histogram::count() const
+{
+  uint64_t n = 0;
+  for (int i=0; i<numBuckets; i++) n += mBuckets[i].load(std::memory_order_relaxed);
+  return n;
+}
+
+
+uint64_t Log2Histogram::percentile(double aPercent) const
+{
+  uint64_t n = count();
+  if (n==0) return 0;
+  uint64_t rank = (uint64_t)(aPercent/100*n);
+  if (rank>=n) rank = n-1;
+  uint64_t c = 0;
+  for (int i=0; i<numBuckets; i++) {
+    c += mBuckets[i].load(std::memory_order_relaxed);
+    if (c>rank) {
+      if (i==numBuckets-1) break; // open ended bucket, max is the best we have
+      uint64_t upper = ((uint64_t)1<<i)-1;
+      uint64_t m = mMax.load(std::memory_order_relaxed);
+      return upper<m ? upper : m;
+    }
+  }
+  return mMax.load(std::memory_order_relaxed);
+}
+
+
+JsonObjectPtr Log2Histogram::json() const
+{
+  JsonObjectPtr h = JsonObject::newObj();
+  uint64_t n = count();
+  h->add("count", JsonObject::newInt64((int64_t)n));
+  h->add("avg", JsonObject::newInt64(n ? (int64_t)(mSum.load(std::memory_order_relaxed)/n) : 0));
+  h->add("max", JsonObject::newInt64((int64_t)mMax.load(std::memory_order_relaxed)));
+  h->add("p50", JsonObject::newInt64((int64_t)percentile(50)));
+  h->add("p90", JsonObject::newInt64((int64_t)percentile(90)));
+  h->add("p99", JsonObject::newInt64((int64_t)percentile(99)));
+  h->add("p999", JsonObject::newInt64((int64_t)percentile(99.9)));
+  // buckets as upper bound -> count, only non-empty ones
+  JsonObjectPtr b = JsonObject::newObj();
+  for (int i=0; i<numBuckets; i++) {
+    uint32_t c = mBuckets[i].load(std::memory_order_relaxed);
+    if (c==0) continue;
+    b->add(i==numBuckets-1 ? "more" : string_format("%llu", (unsigned long long)(((uint64_t)1<<i)-1)).c_str(), JsonObject::newInt64(c));
+  }
+  h->add("buckets", b);
+  return h;
+}
+
+
+void Log2Histogram::reset()
+{
+  for (int i=0; i<numBuckets; i++) mBuckets[i].store(0, std::memory_order_relaxed);
+  mSum.store(0, std::memory_order_relaxed);
+  mMax.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,104 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__corestats__
+#define __kksdcmd__corestats__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include <atomic>
+
+using namespace std;
+
+namespace p44 {
+
+  /// lock-free event counter, can be incremented from any thread
+  class StatCounter
+  {
+    std::atomic<uint64_t> mCount;
+
+  public:
+
+    StatCounter() : mCount(0) {};
+
+    /// count
+    /// @param aBy amount to add
+    void inc(uint64_t aBy = 1) { mCount.fetch_add(aBy, std::memory_order_relaxed); };
+
+    /// @return current count
+    uint64_t value() const { return mCount.load(std::memory_order_relaxed); };
+
+    /// reset to zero
+    void reset() { mCount.store(0, std::memory_order_relaxed); };
+  };
+
+
+  /// lock-free histogram with fixed power-of-two buckets, can be recorded into from any thread
+  /// @note bucket i counts values with a bit length of i, i.e. values in 2^(i-1)..2^i-1,
+  ///   the last bucket also counts all larger values. Percentiles are reported as the
+  ///   upper bound of the bucket they fall into.
+  class Log2Histogram
+  {
+  public:
+
+    static const int numBuckets = 25; ///< 0, 1, 2..3, ... up to 2^23 (~8 seconds when counting uS) and above
+
+  private:
+
+    std::atomic<uint32_t> mBuckets[numBuckets];
+    std::atomic<uint64_t> mSum;
+    std::atomic<uint64_t> mMax;
+
+  public:
+
+    Log2Histogram() { reset(); };
+
+    /// record a value
+    /// @param aValue the value, negative values count as 0
+    void record(int64_t aValue)
+    {
+      uint64_t v = aValue>0 ? (uint64_t)aValue : 0;
+      int b = v ? 64-__builtin_clzll(v) : 0;
+      if (b>=numBuckets) b = numBuckets-1;
+      mBuckets[b].fetch_add(1, std::memory_order_relaxed);
+      mSum.fetch_add(v, std::memory_order_relaxed);
+      uint64_t m = mMax.load(std::memory_order_relaxed);
+      while (v>m && !mMax.compare_exchange_weak(m, v, std::memory_order_relaxed));
+    }
+
+    /// @return number of values recorded
+    uint64_t count() const;
+
+    /// @param aPercent percentile to get, 0..100
+    /// @return upper bound of the bucket the percentile falls into, 0 if nothing recorded yet
+    uint64_t percentile(double aPercent) const;
+
+    /// @return summary (count, avg, max, p50, p90, p99, p999) and non-empty buckets as JSON
+    JsonObjectPtr json() const;
+
+    /// reset all buckets
+    void reset();
+  };
+
+} // namespace p44
+
+#endif // __kksdcmd__corestats__
@@ -0,0 +1,480 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "historystore.hpp"
+
+#include "mainloop.hpp"
+#include "fnv.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <algorithm>
+
+using namespace p44;
+
+#define HISTORY_SEGMENT_MAGIC "KKSH"
+#define HISTORY_SEGMENT_VERSION 1
+#define HISTORY_SEGMENT_EXT ".khs"
+
+/// max number of records to collect while flushing cannot keep up
+static const size_t maxPendingRecords = 100000;
+
+// MARK: - HistorySegment
+
+HistorySegment::HistorySegment(const string aPath, uint32_t aSeq) :
+  mSeq(aSeq),
+  mPath(aPath),
+  mFd(-1),
+  mMap(NULL),
+  mMapSize(0),
+  mWritable(false),
+  mCapacity(0),
+  mMapHash(0),
+  mCount(0),
+  mFirstTime(0),
+  mLastTime(0)
+{
+}
+
+
+HistorySegment::~HistorySegment()
+{
+  if (mMap) munmap(mMap, mMapSize);
+  if (mFd>=0) ::close(mFd);
+}
+
+
+uint32_t HistorySegment::headerChecksum(const HistorySegmentHeader* aHeader)
+{
+  Fnv32 h;
+  h.addBytes(offsetof(HistorySegmentHeader, checksum), (const uint8_t*)aHeader);
+  return h.getHash();
+}
+
+
+ErrorPtr HistorySegment::create(uint32_t aCapacity, uint32_t aMapHash)
+{
+  mFd = ::open(mPath.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (mFd<0) return SysError::errNo("cannot create history segment: ");
+  mMapSize = sizeof(HistorySegmentHeader)+(size_t)aCapacity*sizeof(HistoryRecord);
+  if (ftruncate(mFd, mMapSize)<0) return SysError::errNo("cannot size history segment: ");
+  void* m = mmap(NULL, mMapSize, PROT_READ|PROT_WRITE, MAP_SHARED, mFd, 0);
+  if (m==MAP_FAILED) return SysError::errNo("cannot map history segment: ");
+  mMap = (uint8_t*)m;
+  mWritable = true;
+  mCapacity = aCapacity;
+  mMapHash = aMapHash;
+  HistorySegmentHeader* hdr = header();
+  memset(hdr, 0, sizeof(HistorySegmentHeader));
+  memcpy(hdr->magic, HISTORY_SEGMENT_MAGIC, 4);
+  hdr->version = HISTORY_SEGMENT_VERSION;
+  hdr->recordSize = sizeof(HistoryRecord);
+  hdr->capacity = aCapacity;
+  hdr->mapHash = aMapHash;
+  hdr->checksum = headerChecksum(hdr);
+  msync(mMap, sizeof(HistorySegmentHeader), MS_SYNC);
+  return ErrorPtr();
+}
+
+
+ErrorPtr HistorySegment::open(bool aWritable)
+{
+  mFd = ::open(mPath.c_str(), aWritable ? O_RDWR : O_RDONLY);
+  if (mFd<0) return SysError::errNo("cannot open history segment: ");
+  struct stat st;
+  if (fstat(mFd, &st)<0) return SysError::errNo("cannot stat history segment: ");
+  if ((size_t)st.st_size<sizeof(HistorySegmentHeader)) return TextError::err("history segment too short");
+  mMapSize = st.st_size;
+  void* m = mmap(NULL, mMapSize, aWritable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, mFd, 0);
+  if (m==MAP_FAILED) return SysError::errNo("cannot map history segment: ");
+  mMap = (uint8_t*)m;
+  mWritable = aWritable;
+  HistorySegmentHeader* hdr = header();
+  if (memcmp(hdr->magic, HISTORY_SEGMENT_MAGIC, 4)!=0 || hdr->version!=HISTORY_SEGMENT_VERSION || hdr->recordSize!=sizeof(HistoryRecord)) {
+    return TextError::err("not a history segment or incompatible version");
+  }
+  mCapacity = hdr->capacity;
+  if (sizeof(HistorySegmentHeader)+(size_t)mCapacity*sizeof(HistoryRecord)>mMapSize) {
+    return TextError::err("history segment truncated");
+  }
+  mMapHash = hdr->mapHash;
+  if (hdr->checksum==headerChecksum(hdr) && hdr->count<=mCapacity) {
+    mCount = hdr->count;
+    mFirstTime = hdr->firstTime;
+    mLastTime = hdr->lastTime;
+  }
+  else {
+    // header damaged (crash while committing): records are written before the header, and
+    // unused records are zero, so count the records with plausible times
+    const HistoryRecord* r = records();
+    uint32_t n = 0;
+    while (n<mCapacity && r[n].time!=0 && (n==0 || r[n].time>=r[n-1].time)) n++;
+    mCount = n;
+    mFirstTime = n>0 ? r[0].time : 0;
+    mLastTime = n>0 ? r[n-1].time : 0;
+    if (mWritable) {
+      hdr->count = n;
+      hdr->firstTime = mFirstTime;
+      hdr->lastTime = mLastTime;
+      hdr->checksum = headerChecksum(hdr);
+      msync(mMap, sizeof(HistorySegmentHeader), MS_SYNC);
+    }
+  }
+  return ErrorPtr();
+}
+
+
+size_t HistorySegment::append(const HistoryRecord* aRecords, size_t aNumRecords)
+{
+  if (!mWritable) return 0;
+  uint32_t c = mCount;
+  size_t n = mCapacity-c;
+  if (n>aNumRecords) n = aNumRecords;
+  if (n==0) return 0;
+  // write and sync the records first...
+  size_t start = sizeof(HistorySegmentHeader)+(size_t)c*sizeof(HistoryRecord);
+  memcpy(mMap+start, aRecords, n*sizeof(HistoryRecord));
+  size_t pageMask = (size_t)sysconf(_SC_PAGESIZE)-1;
+  size_t syncStart = start & ~pageMask;
+  msync(mMap+syncStart, start+n*sizeof(HistoryRecord)-syncStart, MS_SYNC);
+  // ...then commit them in the header
+  HistorySegmentHeader* hdr = header();
+  if (c==0) hdr->firstTime = aRecords[0].time;
+  hdr->lastTime = aRecords[n-1].time;
+  hdr->count = (uint32_t)(c+n);
+  hdr->checksum = headerChecksum(hdr);
+  msync(mMap, sizeof(HistorySegmentHeader), MS_SYNC);
+  // make visible to queries
+  if (c==0) mFirstTime = hdr->firstTime;
+  mLastTime = hdr->lastTime;
+  mCount.store(hdr->count, std::memory_order_release);
+  return n;
+}
+
+
+uint32_t HistorySegment::lowerBound(int64_t aTime)
+{
+  const HistoryRecord* r = records();
+  uint32_t lo = 0;
+  uint32_t hi = mCount.load(std::memory_order_acquire);
+  while (lo<hi) {
+    uint32_t mid = lo+(hi-lo)/2;
+    if (r[mid].time<aTime) lo = mid+1; else hi = mid;
+  }
+  return lo;
+}
+
+
+// MARK: - HistoryStore
+
+HistoryStore::HistoryStore(const string aDir, size_t aSegmentSize, int aMaxSegments, MLMicroSeconds aFlushInterval) :
+  mDir(aDir),
+  mMaxSegments(aMaxSegments<2 ? 2 : aMaxSegments),
+  mFlushInterval(aFlushInterval),
+  mMapHash(0),
+  mWriterBusy(false),
+  mWritingBase(0)
+{
+  size_t n = aSegmentSize>sizeof(HistorySegmentHeader) ? (aSegmentSize-sizeof(HistorySegmentHeader))/sizeof(HistoryRecord) : 0;
+  mSegmentRecords = n<16 ? 16 : (uint32_t)n;
+}
+
+
+HistoryStore::~HistoryStore()
+{
+  mFlushTicket.cancel();
+  if (mWriter) {
+    mWriter->cancel();
+    mWriter.reset();
+  }
+}
+
+
+HistorySegmentPtr HistoryStore::newSegment(uint32_t aSeq)
+{
+  return HistorySegmentPtr(new HistorySegment(string_format("%s/%08u" HISTORY_SEGMENT_EXT, mDir.c_str(), aSeq), aSeq));
+}
+
+
+ErrorPtr HistoryStore::open(uint32_t aMapHash)
+{
+  // records collected so far belong to the previous register map
+  flush(true);
+  mMapHash = aMapHash;
+  mSegments.clear();
+  if (mkdir(mDir.c_str(), 0755)<0 && errno!=EEXIST) {
+    return SysError::errNo("cannot create history directory: ");
+  }
+  // find existing segments
+  DIR* dir = opendir(mDir.c_str());
+  if (!dir) return SysError::errNo("cannot read history directory: ");
+  std::vector<uint32_t> seqs;
+  struct dirent* e;
+  while ((e = readdir(dir))!=NULL) {
+    unsigned int seq;
+    char ext[8];
+    if (sscanf(e->d_name, "%8u%7s", &seq, ext)==2 && strcmp(ext, HISTORY_SEGMENT_EXT)==0) {
+      seqs.push_back(seq);
+    }
+  }
+  closedir(dir);
+  std::sort(seqs.begin(), seqs.end());
+  for (size_t i=0; i<seqs.size(); i++) {
+    HistorySegmentPtr seg = newSegment(seqs[i]);
+    // last segment is continued if it was written with the same register map
+    ErrorPtr err = seg->open(false);
+    if (Error::isOK(err) && i==seqs.size()-1 && seg->mMapHash==mMapHash && !seg->full()) {
+      seg = newSegment(seqs[i]);
+      err = seg->open(true);
+    }
+    if (Error::notOK(err)) {
+      LOG(LOG_WARNING, "History segment %s ignored: %s", seg->mPath.c_str(), err->text());
+      continue;
+    }
+    mSegments.push_back(seg);
+  }
+  // make sure we have a segment to append to
+  if (mSegments.empty() || !mSegments.back()->mWritable) {
+    HistorySegmentPtr seg = newSegment(seqs.empty() ? 1 : seqs.back()+1);
+    ErrorPtr err = seg->create(mSegmentRecords, mMapHash);
+    if (Error::notOK(err)) return err;
+    mSegments.push_back(seg);
+  }
+  finishWrite(); // prunes and schedules flushing
+  LOG(LOG_INFO, "History store %s: %zu segments", mDir.c_str(), mSegments.size());
+  return ErrorPtr();
+}
+
+
+void HistoryStore::add(uint16_t aRegIdx, MLMicroSeconds aTime, int32_t aMin, int32_t aMax, float aAvg)
+{
+  if (mPending.size()>=maxPendingRecords) {
+    mDroppedRecords.inc();
+    return;
+  }
+  HistoryRecord r;
+  r.time = aTime;
+  r.regIdx = aRegIdx;
+  r.flags = 0;
+  r.min = aMin;
+  r.max = aMax;
+  r.avg = aAvg;
+  mPending.push_back(r);
+}
+
+
+void HistoryStore::scheduleFlush()
+{
+  mFlushTicket.executeOnce(boost::bind(&HistoryStore::flush, this, false), mFlushInterval);
+}
+
+
+static bool recordTimeLess(const HistoryRecord& aA, const HistoryRecord& aB)
+{
+  return aA.time<aB.time;
+}
+
+
+void HistoryStore::flush(bool aSync)
+{
+  if (mWriter) {
+    if (!aSync) return; // still writing, next flush will pick up the records
+    // must not return before the pending records are written: wait for the writer to finish its batch
+    // (writerDone() will still be called later, which is harmless)
+    while (mWriterBusy) MainLoop::sleep(10*MilliSecond);
+    finishWrite();
+  }
+  if (mPending.empty() || mSegments.empty()) {
+    if (!aSync) scheduleFlush();
+    return;
+  }
+  mWriting.swap(mPending);
+  // segments must be in time order for lowerBound() and time range checks, and so must the records.
+  // Sorted here, as query() reads mWriting while the writer thread runs
+  std::stable_sort(mWriting.begin(), mWriting.end(), recordTimeLess);
+  mWritingBase = mSegments.back()->mCount;
+  if (aSync) {
+    writeRecords();
+    finishWrite();
+  }
+  else {
+    mWriterBusy = true;
+    mWriter = MainLoop::currentMainLoop().executeInThread(
+      boost::bind(&HistoryStore::writerThread, this, _1),
+      boost::bind(&HistoryStore::writerDone, this, _1, _2)
+    );
+  }
+}
+
+
+void HistoryStore::writerThread(ChildThreadWrapper &aThread)
+{
+  writeRecords();
+  mWriterBusy = false;
+}
+
+
+void HistoryStore::writeRecords()
+{
+  // Note: runs on the writer thread, mainloop does not modify mSegments, mWriting and mNewSegments meanwhile
+  //   (but reads mWriting in query()). mWriting is appended in order, to the last segment first.
+  HistorySegmentPtr seg = mNewSegments.empty() ? mSegments.back() : mNewSegments.back();
+  size_t done = 0;
+  while (done<mWriting.size()) {
+    if (
+      seg->full() || !seg->mWritable ||
+      (seg->mCount>0 && mWriting[done].time<seg->mLastTime) // clock went backwards: start new segment
+    ) {
+      // rotate
+      HistorySegmentPtr next = newSegment(seg->mSeq+1);
+      ErrorPtr err = next->create(mSegmentRecords, mMapHash);
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "History store: %s", err->text());
+        mDroppedRecords.inc(mWriting.size()-done);
+        break;
+      }
+      mNewSegments.push_back(next);
+      seg = next;
+    }
+    done += seg->append(&mWriting[done], mWriting.size()-done);
+  }
+}
+
+
+void HistoryStore::writerDone(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+{
+  if (aSignalCode==threadSignalCompleted || aSignalCode==threadSignalFailedToStart || aSignalCode==threadSignalCancelled) {
+    mWriter.reset();
+    finishWrite();
+  }
+}
+
+
+void HistoryStore::finishWrite()
+{
+  mWriting.clear();
+  mSegments.insert(mSegments.end(), mNewSegments.begin(), mNewSegments.end());
+  mNewSegments.clear();
+  // remove oldest segments
+  while ((int)mSegments.size()>mMaxSegments) {
+    unlink(mSegments.front()->mPath.c_str());
+    mSegments.erase(mSegments.begin());
+  }
+  scheduleFlush();
+}
+
+
+static bool recordPtrTimeLess(const HistoryRecord* aA, const HistoryRecord* aB)
+{
+  return aA->time<aB->time;
+}
+
+
+JsonObjectPtr HistoryStore::query(uint16_t aRegIdx, MLMicroSeconds aFrom, MLMicroSeconds aTo, size_t aMaxCount, double aScale)
+{
+  // collect matching records directly from the mapped segments
+  std::vector<const HistoryRecord*> found;
+  // Note: while a flush is in progress, records of mWriting get committed to the last segment, in order.
+  //   Snapshot its count once, so every record is taken either from the segment or from mWriting
+  uint32_t lastCount = mSegments.empty() ? 0 : mSegments.back()->mCount.load(std::memory_order_acquire);
+  for (size_t si=0; si<mSegments.size(); si++) {
+    HistorySegmentPtr seg = mSegments[si];
+    if (seg->mMapHash!=mMapHash) continue; // register indices have a different meaning
+    uint32_t c = si+1==mSegments.size() ? lastCount : seg->mCount.load(std::memory_order_acquire);
+    if (c==0) continue;
+    if (aTo!=Never && seg->mFirstTime>=aTo) continue;
+    if (aFrom!=Never && seg->mLastTime<aFrom) continue;
+    const HistoryRecord* r = seg->records();
+    for (uint32_t i = aFrom==Never ? 0 : seg->lowerBound(aFrom); i<c; i++) {
+      if (aTo!=Never && r[i].time>=aTo) break;
+      if (r[i].regIdx==aRegIdx) found.push_back(&r[i]);
+    }
+  }
+  // plus the records not yet committed to a visible segment (those in segments created by the writer are not yet)
+  size_t written = found.size();
+  for (size_t i = mWriting.empty() ? 0 : lastCount-mWritingBase; i<mWriting.size(); i++) {
+    const HistoryRecord* r = &mWriting[i];
+    if (r->regIdx!=aRegIdx || (aFrom!=Never && r->time<aFrom) || (aTo!=Never && r->time>=aTo)) continue;
+    found.push_back(r);
+  }
+  // and those not written yet (not sorted yet)
+  for (size_t i=0; i<mPending.size(); i++) {
+    const HistoryRecord* r = &mPending[i];
+    if (r->regIdx!=aRegIdx || (aFrom!=Never && r->time<aFrom) || (aTo!=Never && r->time>=aTo)) continue;
+    found.push_back(r);
+  }
+  std::stable_sort(found.begin()+written, found.end(), recordPtrTimeLess);
+  size_t first = 0;
+  if (aMaxCount>0 && found.size()>aMaxCount) first = found.size()-aMaxCount;
+  JsonObjectPtr res = JsonObject::newObj();
+  JsonObjectPtr t = JsonObject::newArray();
+  JsonObjectPtr mn = JsonObject::newArray();
+  JsonObjectPtr mx = JsonObject::newArray();
+  JsonObjectPtr av = JsonObject::newArray();
+  for (size_t i=first; i<found.size(); i++) {
+    t->arrayAppend(JsonObject::newDouble((double)found[i]->time/Second));
+    mn->arrayAppend(JsonObject::newDouble(found[i]->min*aScale));
+    mx->arrayAppend(JsonObject::newDouble(found[i]->max*aScale));
+    av->arrayAppend(JsonObject::newDouble(found[i]->avg*aScale));
+  }
+  res->add("t", t);
+  res->add("min", mn);
+  res->add("max", mx);
+  res->add("avg", av);
+  return res;
+}
+
+
+JsonObjectPtr HistoryStore::info()
+{
+  JsonObjectPtr info = JsonObject::newObj();
+  info->add("dir", JsonObject::newString(mDir));
+  info->add("segmentRecords", JsonObject::newInt64(mSegmentRecords));
+  info->add("maxSegments", JsonObject::newInt32(mMaxSegments));
+  info->add("flushInterval", JsonObject::newDouble((double)mFlushInterval/Second));
+  info->add("pending", JsonObject::newInt64(mPending.size()));
+  info->add("dropped", JsonObject::newInt64(mDroppedRecords.value()));
+  JsonObjectPtr segs = JsonObject::newArray();
+  for (size_t i=0; i<mSegments.size(); i++) {
+    HistorySegmentPtr seg = mSegments[i];
+    JsonObjectPtr s = JsonObject::newObj();
+    s->add("seq", JsonObject::newInt64(seg->mSeq));
+    s->add("count", JsonObject::newInt64(seg->mCount.load(std::memory_order_acquire)));
+    s->add("capacity", JsonObject::newInt64(seg->mCapacity));
+    s->add("first", JsonObject::newDouble((double)seg->mFirstTime/Second));
+    s->add("last", JsonObject::newDouble((double)seg->mLastTime/Second));
+    s->add("currentMap", JsonObject::newBool(seg->mMapHash==mMapHash));
+    segs->arrayAppend(s);
+  }
+  info->add("segments", segs);
+  return info;
+}
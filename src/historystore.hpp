@@ -0,0 +1,187 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__historystore__
+#define __kksdcmd__historystore__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "corestats.hpp"
+
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+namespace p44 {
+
+  /// persistent history record: one per second aggregate of one register
+  typedef struct __attribute__((packed)) {
+    int64_t time; ///< start of the second, unix time in uS, 0 = unused record
+    uint16_t regIdx; ///< register index (internal, valid for the register map the segment was written with)
+    uint16_t flags; ///< reserved, 0
+    int32_t min; ///< min engineering value
+    int32_t max; ///< max engineering value
+    float avg; ///< average engineering value
+  } HistoryRecord;
+
+  /// segment file header
+  typedef struct __attribute__((packed)) {
+    char magic[4]; ///< "KKSH"
+    uint16_t version; ///< format version
+    uint16_t recordSize; ///< sizeof(HistoryRecord)
+    uint32_t capacity; ///< number of records the segment can hold
+    uint32_t mapHash; ///< hash of the register map the record's register indices refer to
+    uint32_t count; ///< number of committed records
+    uint32_t reserved;
+    int64_t firstTime; ///< time of first record
+    int64_t lastTime; ///< time of last record
+    uint32_t checksum; ///< FNV32 of all preceding header bytes
+    uint8_t pad[20]; ///< pad to 64 bytes
+  } HistorySegmentHeader;
+
+
+  /// one memory mapped segment file
+  class HistorySegment : public P44Obj
+  {
+    friend class HistoryStore;
+
+    uint32_t mSeq; ///< segment sequence number, also determines file name
+    string mPath; ///< file path
+    int mFd; ///< file descriptor, -1 if not open
+    uint8_t* mMap; ///< the mapped file
+    size_t mMapSize; ///< size of the mapping
+    bool mWritable; ///< set if mapped for appending
+    uint32_t mCapacity; ///< number of records the segment can hold
+    uint32_t mMapHash; ///< register map hash from header
+    std::atomic<uint32_t> mCount; ///< number of committed records (only these are visible to queries)
+    std::atomic<int64_t> mFirstTime; ///< time of first committed record
+    std::atomic<int64_t> mLastTime; ///< time of last committed record
+
+    HistorySegment(const string aPath, uint32_t aSeq);
+
+    HistorySegmentHeader* header() { return (HistorySegmentHeader*)mMap; };
+    const HistoryRecord* records() { return (const HistoryRecord*)(mMap+sizeof(HistorySegmentHeader)); };
+
+    /// create new segment file
+    ErrorPtr create(uint32_t aCapacity, uint32_t aMapHash);
+
+    /// open existing segment file, recover committed record count if header is damaged
+    ErrorPtr open(bool aWritable);
+
+    /// append records and commit them (executed by the writer thread)
+    /// @return number of records appended (less than requested when segment is full)
+    size_t append(const HistoryRecord* aRecords, size_t aNumRecords);
+
+    /// @return true if segment is full
+    bool full() { return mCount>=mCapacity; };
+
+    /// @return index of first committed record with a time at or after aTime
+    uint32_t lowerBound(int64_t aTime);
+
+    static uint32_t headerChecksum(const HistorySegmentHeader* aHeader);
+
+  public:
+
+    virtual ~HistorySegment();
+
+  };
+  typedef boost::intrusive_ptr<HistorySegment> HistorySegmentPtr;
+
+
+  /// append-only store of per second register aggregates in memory mapped segment files
+  /// @note records are collected on the mainloop and written in batches by a writer thread,
+  ///   so flash is written only every flush interval and the mainloop never blocks on file I/O
+  class HistoryStore : public P44Obj
+  {
+    string mDir; ///< directory containing the segment files
+    uint32_t mSegmentRecords; ///< number of records per segment
+    int mMaxSegments; ///< max number of segments to keep, oldest get deleted
+    MLMicroSeconds mFlushInterval; ///< how often collected records are written
+    uint32_t mMapHash; ///< hash of the current register map
+
+    std::vector<HistorySegmentPtr> mSegments; ///< all segments, oldest first, last one is appended to
+    std::vector<HistoryRecord> mPending; ///< records collected on the mainloop, not yet written
+    std::vector<HistoryRecord> mWriting; ///< records being written by the writer thread (sorted, read-only while writing)
+    uint32_t mWritingBase; ///< committed records in the last segment when writing mWriting started
+    std::vector<HistorySegmentPtr> mNewSegments; ///< segments created by the writer thread during rotation
+    ChildThreadWrapperPtr mWriter; ///< the writer thread while a flush is in progress
+    std::atomic<bool> mWriterBusy; ///< set while the writer thread is writing records
+    MLTicket mFlushTicket;
+    StatCounter mDroppedRecords; ///< records that could not be written (counted on mainloop and writer thread)
+
+  public:
+
+    /// @param aDir directory for the segment files, created if it does not exist
+    /// @param aSegmentSize size of a segment file in bytes
+    /// @param aMaxSegments max number of segments to keep
+    /// @param aFlushInterval interval for writing collected records
+    HistoryStore(const string aDir, size_t aSegmentSize, int aMaxSegments, MLMicroSeconds aFlushInterval);
+    virtual ~HistoryStore();
+
+    /// open the store
+    /// @param aMapHash hash of the register map the register indices refer to. Appending continues
+    ///   in the last segment only if it was written with the same register map.
+    /// @return OK or error
+    ErrorPtr open(uint32_t aMapHash);
+
+    /// add a record (on the mainloop, cheap)
+    /// @note records need not be added in time order, each batch is sorted before writing. However, segments
+    ///   are kept in time order, so a record older than the last one written starts a new segment.
+    /// @param aRegIdx register index
+    /// @param aTime start of the second, unix time
+    /// @param aMin min engineering value
+    /// @param aMax max engineering value
+    /// @param aAvg average engineering value
+    void add(uint16_t aRegIdx, MLMicroSeconds aTime, int32_t aMin, int32_t aMax, float aAvg);
+
+    /// write collected records now (asynchronously, unless aSync is set)
+    /// @param aSync if set, write in the calling thread (for use at termination). If the writer thread
+    ///   is still writing a previous batch, this waits for it to finish first.
+    void flush(bool aSync = false);
+
+    /// query the store
+    /// @param aRegIdx register index
+    /// @param aFrom unix time of first record to return, Never for no limit
+    /// @param aTo unix time after last record to return, Never for no limit
+    /// @param aMaxCount max number of (most recent) records to return, 0 for all
+    /// @param aScale factor to convert engineering values into user values
+    /// @return json object with column arrays "t" (unix time in seconds), "min", "max", "avg"
+    JsonObjectPtr query(uint16_t aRegIdx, MLMicroSeconds aFrom, MLMicroSeconds aTo, size_t aMaxCount, double aScale);
+
+    /// @return json object describing the segments
+    JsonObjectPtr info();
+
+  private:
+
+    HistorySegmentPtr newSegment(uint32_t aSeq);
+    void scheduleFlush();
+    void writerThread(ChildThreadWrapper &aThread);
+    void writeRecords();
+    void writerDone(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
+    void finishWrite();
+
+  };
+  typedef boost::intrusive_ptr<HistoryStore> HistoryStorePtr;
+
+} // namespace p44
+
+#endif // __kksdcmd__historystore__
@@ -0,0 +1,411 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "application.hpp"
+
+#include "modbus.hpp"
+#include "utils.hpp"
+#include "jsonobject.hpp"
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#define DEFAULT_BENCH_CONNECTION "127.0.0.1:1502"
+#define DEFAULT_DAEMON_PATH "kksdcmd"
+#define STARTED_DAEMON_STATS_INTERVAL 1 // seconds, for the statistics file of the daemon started for the benchmark
+#define MAX_STATS_WAIT 25 // seconds to wait for the daemon to update its statistics file
+
+using namespace std;
+using namespace p44;
+
+
+/// benchmark parameters shared by all client threads (read only while clients run)
+typedef struct {
+  string host;
+  int port;
+  int module; ///< core module to access
+  int mbOffset; ///< modbus register offset of that core module
+  int inputFirst, inputCount; ///< input register block read by SCADA style polling
+  int regFirst, regCount; ///< R/W register block read now and then
+  int writeReg; ///< R/W register written
+  int writeMin, writeMax; ///< range of values written
+  int writePct; ///< percentage of requests that are writes
+  int regReadPct; ///< percentage of requests that read the R/W register block
+  int rate; ///< requests per second per client, 0=as fast as possible
+  MLMicroSeconds duration;
+} BenchParams;
+
+
+/// results of one client thread
+class BenchClient
+{
+public:
+  std::vector<uint32_t> mLatencies; ///< latency of each successful request in uS
+  uint64_t mReads;
+  uint64_t mWrites;
+  uint64_t mErrors;
+  string mConnError;
+
+  BenchClient() : mReads(0), mWrites(0), mErrors(0) {};
+
+  void run(const BenchParams& aParams, std::atomic<bool>& aStart, unsigned aSeed)
+  {
+    modbus_t* mb = modbus_new_tcp(aParams.host.c_str(), aParams.port);
+    if (!mb || modbus_connect(mb)<0) {
+      mConnError = mb ? modbus_strerror(errno) : "cannot create modbus context";
+      if (mb) modbus_free(mb);
+      return;
+    }
+    modbus_set_slave(mb, 1);
+    modbus_set_response_timeout(mb, 2, 0);
+    mLatencies.reserve(aParams.rate>0 ? aParams.rate*(aParams.duration/Second+1) : 100000);
+    uint16_t vals[125];
+    while (!aStart) usleep(1000);
+    MLMicroSeconds start = MainLoop::now();
+    MLMicroSeconds next = start;
+    MLMicroSeconds end = start+aParams.duration;
+    while (true) {
+      MLMicroSeconds t = MainLoop::now();
+      if (t>=end) break;
+      if (aParams.rate>0) {
+        if (t<next) { usleep((useconds_t)(next-t)); t = MainLoop::now(); }
+        next += Second/aParams.rate;
+      }
+      int r;
+      int kind = rand_r(&aSeed)%100;
+      if (kind<aParams.writePct) {
+        uint16_t v = (uint16_t)(aParams.writeMin + rand_r(&aSeed)%(aParams.writeMax-aParams.writeMin+1));
+        r = modbus_write_register(mb, aParams.mbOffset+aParams.writeReg, v);
+        mWrites++;
+      }
+      else if (kind<aParams.writePct+aParams.regReadPct) {
+        r = modbus_read_registers(mb, aParams.mbOffset+aParams.regFirst, aParams.regCount, vals);
+        mReads++;
+      }
+      else {
+        r = modbus_read_input_registers(mb, aParams.mbOffset+aParams.inputFirst, aParams.inputCount, vals);
+        mReads++;
+      }
+      if (r<0) mErrors++;
+      else mLatencies.push_back((uint32_t)(MainLoop::now()-t));
+    }
+    modbus_close(mb);
+    modbus_free(mb);
+  }
+};
+
+
+
+class KksDcmBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  BenchParams mParams;
+  pid_t mDaemonPid;
+  string mStatsFile; ///< statistics file written by the daemon, empty if none
+
+public:
+
+  KksDcmBench() :
+    mDaemonPid(0)
+  {
+  }
+
+  virtual int main(int argc, char **argv)
+  {
+    const char *usageText =
+      "Usage: %1$s [options]\n"
+      "Starts kksdcmd with a simulated core module (or attaches to a running one), drives it\n"
+      "with concurrent modbus TCP clients and reports throughput, latency percentiles and\n"
+      "SPI frames per modbus request\n";
+    const CmdLineOptionDescriptor options[] = {
+      { 'c', "connection",    true,  "ip:port;modbus TCP address of the started daemon, or of the daemon to attach to, default=" DEFAULT_BENCH_CONNECTION },
+      { 'd', "daemon",        true,  "path;kksdcmd executable to start with a simulated core module for the benchmark, default=" DEFAULT_DAEMON_PATH },
+      { 0  , "daemonargs",    true,  "args;additional (space separated) command line arguments for the started daemon" },
+      { 'a', "attach",        false, "do not start a daemon, benchmark the one already running at the connection address" },
+      { 0  , "statsfile",     true,  "file;with --attach: statistics file written by that daemon (its --statsfile option), for SPI frames per request" },
+      { 'n', "clients",       true,  "num;number of concurrent modbus clients, default=4" },
+      { 't', "duration",      true,  "seconds;benchmark duration, default=10" },
+      { 'r', "rate",          true,  "req/s;requests per second per client, default=0=as fast as possible" },
+      { 0  , "writepct",      true,  "percent;percentage of write requests, default=5" },
+      { 0  , "regreadpct",    true,  "percent;percentage of R/W register block reads, default=20, rest are input register block reads" },
+      { 0  , "inputs",        true,  "first,count;input register block to read, default=14,18 (process values)" },
+      { 0  , "regs",          true,  "first,count;R/W register block to read, default=1,17 (general control)" },
+      { 0  , "writereg",      true,  "reg,min,max;R/W register to write and range of values, default=3,10,100 (targetPower)" },
+      { 0  , "module",        true,  "module;core module to access, default=0" },
+      { 0  , "mboffset",      true,  "offset;modbus register number offset between core modules (as set in the daemon), default=1000" },
+      CMDLINE_APPLICATION_LOGOPTIONS,
+      CMDLINE_APPLICATION_STDOPTIONS,
+      { 0, NULL } // list terminator
+    };
+
+    // parse the command line, exits when syntax errors occur
+    setCommandDescriptors(usageText, options);
+    parseCommandLine(argc, argv);
+    processStandardLogOptions(false); // command line utility defaults, not daemon
+
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    string s = DEFAULT_BENCH_CONNECTION;
+    getStringOption("connection", s);
+    uint16_t port = 502;
+    splitHost(s.c_str(), &mParams.host, &port);
+    mParams.port = port;
+    mParams.module = 0;
+    getIntOption("module", mParams.module);
+    int moduleOffset = 1000;
+    getIntOption("mboffset", moduleOffset);
+    mParams.mbOffset = mParams.module*moduleOffset;
+    mParams.inputFirst = 14; mParams.inputCount = 18;
+    if (getStringOption("inputs", s)) sscanf(s.c_str(), "%d,%d", &mParams.inputFirst, &mParams.inputCount);
+    mParams.regFirst = 1; mParams.regCount = 17;
+    if (getStringOption("regs", s)) sscanf(s.c_str(), "%d,%d", &mParams.regFirst, &mParams.regCount);
+    mParams.writeReg = 3; mParams.writeMin = 10; mParams.writeMax = 100;
+    if (getStringOption("writereg", s)) sscanf(s.c_str(), "%d,%d,%d", &mParams.writeReg, &mParams.writeMin, &mParams.writeMax);
+    if (mParams.inputCount<1 || mParams.inputCount>125 || mParams.regCount<1 || mParams.regCount>125 || mParams.writeMax<mParams.writeMin) {
+      terminateAppWith(TextError::err("invalid register block or write range"));
+      return;
+    }
+    mParams.writePct = 5;
+    getIntOption("writepct", mParams.writePct);
+    mParams.regReadPct = 20;
+    getIntOption("regreadpct", mParams.regReadPct);
+    mParams.rate = 0;
+    getIntOption("rate", mParams.rate);
+    int secs = 10;
+    getIntOption("duration", secs);
+    mParams.duration = secs*Second;
+    int numClients = 4;
+    getIntOption("clients", numClients);
+    if (numClients<1) numClients = 1;
+    if (getOption("attach")) {
+      // external daemon, frame counts only if it writes a statistics file
+      getStringOption("statsfile", mStatsFile);
+    }
+    else {
+      // start our own daemon with a simulated core
+      s = DEFAULT_DAEMON_PATH;
+      getStringOption("daemon", s);
+      mStatsFile = string_format("/tmp/kksdcmbench-%d-stats.json", (int)getpid());
+      ErrorPtr err = startDaemon(s);
+      if (Error::notOK(err)) {
+        terminateAppWith(err);
+        return;
+      }
+    }
+    // run the benchmark
+    ErrorPtr err = runBenchmark(numClients);
+    stopDaemon();
+    terminateAppWith(err);
+  }
+
+
+  ErrorPtr startDaemon(const string aPath)
+  {
+    std::vector<string> args;
+    args.push_back(aPath);
+    args.push_back("--corespi");
+    args.push_back("sim");
+    args.push_back("--modbus");
+    args.push_back(string_format("%s:%d", mParams.host.c_str(), mParams.port));
+    args.push_back("--statsfile");
+    args.push_back(mStatsFile);
+    args.push_back("--statsinterval");
+    args.push_back(string_format("%d", STARTED_DAEMON_STATS_INTERVAL));
+    string extra;
+    if (getStringOption("daemonargs", extra)) {
+      const char* p = extra.c_str();
+      string a;
+      while (nextPart(p, a, ' ')) if (!a.empty()) args.push_back(a);
+    }
+    mDaemonPid = fork();
+    if (mDaemonPid<0) {
+      mDaemonPid = 0;
+      return SysError::errNo("cannot fork daemon: ");
+    }
+    if (mDaemonPid==0) {
+      // child
+      std::vector<char*> argv;
+      for (size_t i=0; i<args.size(); i++) argv.push_back(const_cast<char*>(args[i].c_str()));
+      argv.push_back(NULL);
+      execvp(argv[0], &argv[0]);
+      _exit(127);
+    }
+    // wait until daemon accepts modbus connections
+    for (int i=0; i<100; i++) {
+      modbus_t* mb = modbus_new_tcp(mParams.host.c_str(), mParams.port);
+      bool ok = mb && modbus_connect(mb)>=0;
+      if (mb) { modbus_close(mb); modbus_free(mb); }
+      if (ok) {
+        LOG(LOG_NOTICE, "daemon '%s' started, pid=%d", aPath.c_str(), (int)mDaemonPid);
+        return ErrorPtr();
+      }
+      int status;
+      if (waitpid(mDaemonPid, &status, WNOHANG)==mDaemonPid) {
+        mDaemonPid = 0;
+        return TextError::err("daemon '%s' terminated with status %d", aPath.c_str(), WEXITSTATUS(status));
+      }
+      usleep(100000);
+    }
+    stopDaemon();
+    return TextError::err("daemon '%s' does not accept modbus connections", aPath.c_str());
+  }
+
+
+  void stopDaemon()
+  {
+    if (mDaemonPid>0) {
+      kill(mDaemonPid, SIGTERM);
+      int status;
+      waitpid(mDaemonPid, &status, 0);
+      mDaemonPid = 0;
+      unlink(mStatsFile.c_str());
+    }
+  }
+
+
+  /// get SPI frame counters of the accessed core module from the daemon's statistics file
+  /// @param aNotBefore unix time the statistics must be from, waits for the daemon to write the file if needed
+  /// @return false if no counters could be obtained
+  bool getSpiFrames(MLMicroSeconds aNotBefore, uint64_t& aReadFrames, uint64_t& aWriteFrames)
+  {
+    if (mStatsFile.empty()) return false;
+    MLMicroSeconds until = MainLoop::now()+MAX_STATS_WAIT*Second;
+    while (MainLoop::now()<until) {
+      JsonObjectPtr stats = JsonObject::objFromFile(mStatsFile.c_str());
+      JsonObjectPtr o;
+      if (stats && stats->get("time", o) && o->doubleValue()*Second>=aNotBefore && stats->get("modules", o)) {
+        for (int i=0; i<o->arrayLength(); i++) {
+          JsonObjectPtr m = o->arrayGet(i);
+          JsonObjectPtr v;
+          if (!m->get("module", v) || v->int32Value()!=mParams.module) continue;
+          JsonObjectPtr spi;
+          if (!m->get("spi", spi)) return false;
+          if (!spi->get("reads", v)) return false;
+          aReadFrames = v->int64Value();
+          if (!spi->get("writes", v)) return false;
+          aWriteFrames = v->int64Value();
+          return true;
+        }
+        return false; // module not found
+      }
+      usleep(100000);
+    }
+    LOG(LOG_WARNING, "no current statistics in '%s'", mStatsFile.c_str());
+    return false;
+  }
+
+
+  static uint32_t percentile(const std::vector<uint32_t>& aSorted, double aPercent)
+  {
+    if (aSorted.empty()) return 0;
+    size_t i = (size_t)(aPercent/100*aSorted.size());
+    if (i>=aSorted.size()) i = aSorted.size()-1;
+    return aSorted[i];
+  }
+
+
+  ErrorPtr runBenchmark(int aNumClients)
+  {
+    uint64_t rf0 = 0, wf0 = 0, rf1 = 0, wf1 = 0;
+    std::vector<BenchClient> clients(aNumClients);
+    std::vector<std::thread> threads;
+    std::atomic<bool> go(false);
+    for (int i=0; i<aNumClients; i++) {
+      threads.push_back(std::thread(&BenchClient::run, &clients[i], std::cref(mParams), std::ref(go), (unsigned)(i*7919+1)));
+    }
+    usleep(200000); // let all clients connect
+    // baseline: counters written after the clients connected (daemon idle since)
+    bool haveFrames = getSpiFrames(MainLoop::unixtime(), rf0, wf0);
+    MLMicroSeconds start = MainLoop::now();
+    go = true;
+    for (size_t i=0; i<threads.size(); i++) threads[i].join();
+    MLMicroSeconds elapsed = MainLoop::now()-start;
+    if (haveFrames) haveFrames = getSpiFrames(MainLoop::unixtime(), rf1, wf1);
+    // collect
+    std::vector<uint32_t> lat;
+    uint64_t reads = 0, writes = 0, errors = 0;
+    int connected = 0;
+    for (size_t i=0; i<clients.size(); i++) {
+      if (!clients[i].mConnError.empty()) {
+        LOG(LOG_ERR, "client %zu could not connect: %s", i, clients[i].mConnError.c_str());
+        continue;
+      }
+      connected++;
+      lat.insert(lat.end(), clients[i].mLatencies.begin(), clients[i].mLatencies.end());
+      reads += clients[i].mReads;
+      writes += clients[i].mWrites;
+      errors += clients[i].mErrors;
+    }
+    if (connected==0) return TextError::err("no client could connect to %s:%d", mParams.host.c_str(), mParams.port);
+    std::sort(lat.begin(), lat.end());
+    uint64_t requests = reads+writes;
+    double secs = (double)elapsed/Second;
+    printf("clients          : %d (%d connected)\n", aNumClients, connected);
+    printf("duration         : %.2f s\n", secs);
+    printf("requests         : %llu (%llu reads, %llu writes, %llu errors)\n", (unsigned long long)requests, (unsigned long long)reads, (unsigned long long)writes, (unsigned long long)errors);
+    printf("throughput       : %.1f req/s\n", secs>0 ? requests/secs : 0);
+    printf("latency p50      : %u uS\n", percentile(lat, 50));
+    printf("latency p99      : %u uS\n", percentile(lat, 99));
+    printf("latency p99.9    : %u uS\n", percentile(lat, 99.9));
+    printf("latency max      : %u uS\n", lat.empty() ? 0 : lat.back());
+    if (haveFrames && requests>0) {
+      printf("SPI frames/req   : %.3f (%.3f read, %.3f write)\n",
+        (double)(rf1-rf0+wf1-wf0)/requests, (double)(rf1-rf0)/requests, (double)(wf1-wf0)/requests
+      );
+    }
+    else {
+      printf("SPI frames/req   : n/a (attached daemon needs --statsfile, see --statsfile option)\n");
+    }
+    return ErrorPtr();
+  }
+
+};
+
+
+
+int main(int argc, char **argv)
+{
+  // prevent all logging until command line determines level
+  SETLOGLEVEL(LOG_EMERG);
+  SETERRLEVEL(LOG_EMERG, false); // messages, if any, go to stderr
+
+  // create app with current mainloop
+  KksDcmBench *application = new(KksDcmBench);
+  // pass control
+  int status = application->main(argc, argv);
+  // done
+  delete application;
+  return status;
+}
@@ -31,6 +31,9 @@
 #include "i2c.hpp"
 #include "spi.hpp"
 #include "coreregmodel.hpp"
+#include "simulatedcore.hpp"
+#include "burstcapture.hpp"
+#include "modbustcpserver.hpp"
 
 #if ENABLE_UBUS
   #include "ubus.hpp"
@@ -38,10 +41,27 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <map>
+#include <sys/stat.h>
 
 #define DEFAULT_MODBUS_RTU_PARAMS "115200,8,N,1" // [baud rate][,[bits][,[parity][,[stopbits][,[H]]]]]
+#define DEFAULT_MODBUS_RTU_REFRESH 1000 // background refresh interval in mS used when RTU is enabled without refresh or polling
 #define DEFAULT_MODBUS_IP_PORT 502 // standard modbus port
 #define DEFAULT_MODBUS_CONNECTION "0.0.0.0:502"
+#define DEFAULT_MODBUS_TCP_CONNECTIONS 16 // max simultaneous modbus TCP clients
+#define DEFAULT_MODBUS_TCP_QUEUE 8 // max queued requests per modbus TCP client
+#define DEFAULT_MODBUS_TCP_IDLE 300 // seconds without requests before closing a modbus TCP connection
+#define DEFAULT_MODULE_MODBUS_OFFSET 1000 // modbus register offset between core modules
+#define DEFAULT_SPI_CLOCK 1000000 // SPI bus clock assumed for read cost model
+#define DEFAULT_FRAME_OVERHEAD 50 // fixed time per SPI transaction in µS assumed for read cost model
+#define DEFAULT_HISTORY_REGISTERS "actualPower,actualFrequency,actualPhase,temperaturQ1,temperaturQ2,temperaturQ3,temperaturQ4,temperaturPcb,powerP,powerS,current"
+#define DEFAULT_HISTORY_SIZES "600,900,1440" // raw values, seconds (15min), minutes (24h)
+#define DEFAULT_HISTORY_STORE_SIZE "1024,32" // segment size in kB, number of segments
+#define DEFAULT_HISTORY_FLUSH 60 // seconds between writing stored history to flash
+#define DEFAULT_CAPTURE_REGISTERS "actualFrequency,actualPhase,current,voltagePowerStage"
+#define DEFAULT_CAPTURE_TRIGGER "error,CntShortSet*,CntOverLoadSet*"
+#define DEFAULT_CAPTURE_SIZE "5000,500" // ring size in samples, samples after trigger
+#define DEFAULT_STATS_INTERVAL 10 // seconds between writing the statistics file
 
 #define MAINSCRIPT_DEFAULT_FILE_NAME "mainscript.txt"
 
@@ -56,6 +76,12 @@ static const struct blobmsg_policy logapi_policy[] = {
   { .name = NULL, .type = BLOBMSG_TYPE_INT32 },
 };
 
+static const struct blobmsg_policy stats_policy[] = {
+  { .name = "module", .type = BLOBMSG_TYPE_INT32 },
+  { .name = "reset", .type = BLOBMSG_TYPE_BOOL },
+  { .name = NULL, .type = BLOBMSG_TYPE_INT32 },
+};
+
 static const struct blobmsg_policy kksmbcapi_policy[] = {
   { .name = "method", .type = BLOBMSG_TYPE_STRING },
   { .name = NULL, .type = BLOBMSG_TYPE_UNSPEC },
@@ -197,9 +223,98 @@ static void webrequest_func(BuiltinFunctionContextPtr f)
 #endif // ENABLE_P44SCRIPT && ENABLE_UBUS
 
 
+#if ENABLE_P44SCRIPT
+
+// MARK: - core register change events
+
+/// represents a core register change
+class CoreRegChangeObj : public JsonValue
+{
+  typedef JsonValue inherited;
+
+  EventSource* mEventSource;
+
+public:
+  CoreRegChangeObj(JsonObjectPtr aChangeInfo, EventSource* aChangeEventSource) :
+    inherited(aChangeInfo),
+    mEventSource(aChangeEventSource)
+  {
+  }
+
+  virtual string getAnnotation() const P44_OVERRIDE
+  {
+    return "register change";
+  }
+
+  virtual TypeInfo getTypeInfo() const P44_OVERRIDE
+  {
+    return inherited::getTypeInfo()|keeporiginal;
+  }
+
+  virtual EventSource *eventSource() const P44_OVERRIDE
+  {
+    return mEventSource;
+  }
+
+};
+
+// coreregchange()        return latest core register change
+static void coreregchange_func(BuiltinFunctionContextPtr f);
+
+static const BuiltinMemberDescriptor coreRegChangeGlobals[] = {
+  { "coreregchange", executable|json|null, 0, NULL, &coreregchange_func },
+  { NULL } // terminator
+};
+
+/// global event source for core register changes
+class CoreRegChangeLookup : public BuiltInMemberLookup, public EventSource
+{
+  typedef BuiltInMemberLookup inherited;
+
+  JsonObjectPtr mLastChange; ///< info about most recent change
+
+public:
+  CoreRegChangeLookup() : inherited(coreRegChangeGlobals) {};
+
+  JsonObjectPtr lastChange() { return mLastChange; }
+
+  void reportChange(JsonObjectPtr aChangeInfo)
+  {
+    mLastChange = aChangeInfo;
+    if (hasSinks()) sendEvent(new CoreRegChangeObj(mLastChange, this));
+  }
+
+};
+
+
+static void coreregchange_func(BuiltinFunctionContextPtr f)
+{
+  CoreRegChangeLookup* l = static_cast<CoreRegChangeLookup*>(f->funcObj()->getMemberLookup());
+  if (!l->lastChange()) {
+    f->finish(new AnnotatedNullValue("no register change yet"));
+    return;
+  }
+  f->finish(new CoreRegChangeObj(l->lastChange(), l));
+}
+
+#endif // ENABLE_P44SCRIPT
+
+
 
 // MARK: - KksDcmD
 
+/// the outstanding SPI write batches of a modbus TCP write request (one per core module)
+class ModbusWriteJoin : public P44Obj
+{
+public:
+  size_t mPending; ///< number of batches not yet written
+  ErrorPtr mError; ///< first error
+  ModbusTcpDoneCB mDoneCB; ///< answers the modbus request
+  ModbusWriteJoin(ModbusTcpDoneCB aDoneCB) : mPending(0), mDoneCB(aDoneCB) {};
+};
+typedef boost::intrusive_ptr<ModbusWriteJoin> ModbusWriteJoinPtr;
+
+
 class KksDcmD;
 
 /// global script function lookup for this app
@@ -227,7 +342,32 @@ class KksDcmD : public CmdLineApp
   CoreSPIProtoPtr mCoreSPI;
   */
 
-  CoreRegModelPtr mCoreRegModel;
+  ModbusSlavePtr mModbusSlave; ///< the modbus slave exposing the registers of all core modules
+  ModbusSlavePtr mModbusRtuSlave; ///< the modbus RTU slave mirroring the registers, NULL if none
+  ModbusTcpServerPtr mModbusTcpServer; ///< the modbus TCP server, NULL when libmodbus serves TCP via mModbusSlave
+  int mModbusRegsSpan; ///< highest modbus R/W register number of all core modules
+  int mModbusInputsSpan; ///< highest modbus input register number of all core modules
+  std::vector<CoreRegModelPtr> mCoreModules; ///< the register models of the core modules, each with its own SPI device
+  MLMicroSeconds mMaxRegAge; ///< max age of modbus register image before modbus reads cause SPI access
+
+  // burst capture
+  std::vector<BurstCapturePtr> mBurstCaptures; ///< per core module: burst capture, NULL if none
+  string mCaptureRegs; ///< default registers to capture
+  string mCaptureTrigger; ///< default registers to trigger on
+  int mCaptureSamples; ///< default capture ring size
+  int mCapturePost; ///< default number of samples after trigger
+  int mCaptureInterval; ///< default min time between samples in uS
+
+  // modbus access statistics
+  StatCounter mModbusReads; ///< number of modbus register read accesses
+  StatCounter mModbusWrites; ///< number of modbus register write accesses
+  StatCounter mModbusUnmapped; ///< number of modbus accesses to registers not belonging to any core module
+  Log2Histogram mModbusAccessTime; ///< time in uS the access handler takes per register
+  StatCounter mModbusRtuReads; ///< number of modbus RTU register read accesses
+  StatCounter mModbusRtuWrites; ///< number of modbus RTU register write accesses
+  string mStatsFile; ///< file to periodically write the statistics to, empty if none
+  MLMicroSeconds mStatsInterval; ///< interval for writing mStatsFile
+  MLTicket mStatsTicket; ///< timer for writing mStatsFile
 
   // app
   bool mActive;
@@ -240,6 +380,7 @@ class KksDcmD : public CmdLineApp
   #if ENABLE_UBUS
   ScriptApiLookup mScriptApiLookup; ///< lookup and event source for script API
   #endif // ENABLE_UBUS
+  CoreRegChangeLookup mCoreRegChangeLookup; ///< lookup and event source for core register changes
   #endif // ENABLE_P44SCRIPT
 
 public:
@@ -248,6 +389,10 @@ public:
     mMainScript(sourcecode+regular, "main") // only init script may have declarations
   {
     mActive = true;
+    mMaxRegAge = 0; // default to always read from SPI
+    mModbusRegsSpan = 0;
+    mModbusInputsSpan = 0;
+    mStatsInterval = DEFAULT_STATS_INTERVAL*Second;
     // let all scripts run in the same context
 
     #if ENABLE_P44SCRIPT
@@ -272,7 +417,42 @@ public:
       { 0  , "ubusapi",       false, "enable ubus API" },
       #endif
       { 0  , "modbus",        true,  "ip:port;TCP address (0.0.0.0 for server) port to listen for modbus connections, default=" DEFAULT_MODBUS_CONNECTION },
-      { 0  , "corespi",       true,  "busno*10+CSno;SPI bus and CS number to use, default=10" },
+      { 0  , "mbconnections", true,  "max;max number of simultaneous modbus TCP clients, default=16" },
+      { 0  , "mbqueue",       true,  "max;max number of queued requests per modbus TCP client, default=8" },
+      { 0  , "mbidle",        true,  "seconds;close modbus TCP connections idle for this long, 0=never, default=300" },
+      { 0  , "libmodbustcp",  false, "serve modbus TCP with libmodbus (requests processed inline, no per client queues and limits)" },
+      { 0  , "modbusrtu",     true,  "/device[:commParams];serial interface to also serve the registers via modbus RTU, default params=" DEFAULT_MODBUS_RTU_PARAMS },
+      { 0  , "rtuslave",      true,  "slave;modbus RTU slave address, default=1" },
+      { 0  , "rs485txenable", true,  "pinspec;a digital output pin specification for RTU TX driver enable, 'RTS' or 'RS232'" },
+      { 0  , "rs485txdelay",  true,  "delay;delay of RTU tx enable signal in uS" },
+      { 0  , "rs485rxenable", true,  "pinspec;a digital output pin specification for RTU RX input enable" },
+      { 0  , "bytetime",      true,  "time;custom time per RTU byte in nS" },
+      { 0  , "corespi",       true,  "busno*10+CSno[,busno*10+CSno...];SPI bus and CS number per core module, or 'sim' for a simulated core module, default=10" },
+      { 0  , "simfiller",     true,  "min,max;range of delay filler bytes the simulated core module sends before read data, default=0,3" },
+      { 0  , "simerrors",     true,  "crc,proto;per 1000 frames: number of CRC and protocol errors the simulated core module injects, default=0,0" },
+      { 0  , "simtiming",     true,  "frame,byte;time in uS the simulated core module takes per frame and per byte, default=0,0" },
+      { 0  , "regmap",        true,  "jsonfile[,jsonfile...];register map per core module to use instead of the built-in one, last one applies to all further modules" },
+      { 0  , "mboffset",      true,  "offset;modbus register number offset between core modules, default=1000" },
+      { 0  , "refresh",       true,  "interval;interval in mS for refreshing all registers from SPI in background, default=0=none (1000 with modbusrtu and no polling)" },
+      { 0  , "fastpoll",      true,  "interval;interval in mS for polling fast changing registers (process values), default=0=none" },
+      { 0  , "slowpoll",      true,  "interval;interval in mS for polling slowly changing registers (temperatures, counters), default=0=none" },
+      { 0  , "maxage",        true,  "age;max age in mS of register values before modbus reads access SPI, default=2*refresh or poll interval of the register (the shorter one)" },
+      { 0  , "readahead",     true,  "numregs;max number of modbus registers to fetch from SPI in one burst on modbus reads, default=125" },
+      { 0  , "readgap",       true,  "bytes;max number of unused bytes to read through between registers rather than starting a new SPI burst, overrides cost model" },
+      { 0  , "spiclock",      true,  "hz;SPI bus clock for the read cost model, default=1000000" },
+      { 0  , "frameoverhead", true,  "us;fixed time per SPI transaction for the read cost model, default=50" },
+      { 0  , "nofillerprediction", false, "disable single shot SPI reads based on the learned number of delay filler bytes" },
+      { 0  , "history",       true,  "regname[,regname...];record history of these registers (or 'default' for the process values), needs polling or refresh" },
+      { 0  , "historysize",   true,  "raw,seconds,minutes;number of raw values, per second and per minute aggregates to keep, default=" DEFAULT_HISTORY_SIZES },
+      { 0  , "historystore",  true,  "dir;persist per second aggregates of the history registers in this directory (relative to datapath), one subdirectory per core module" },
+      { 0  , "historystoresize", true, "kb,segments;size and max number of history store segment files per core module, default=" DEFAULT_HISTORY_STORE_SIZE },
+      { 0  , "historyflush",  true,  "seconds;interval for writing stored history to flash, default=60" },
+      { 0  , "capture",       true,  "regname[,regname...];capture these registers at max SPI rate until a trigger (or 'default' for the trip analysis set)" },
+      { 0  , "capturetrigger", true, "regname[,prefix*...];trigger capture on any change of these registers, default=" DEFAULT_CAPTURE_TRIGGER },
+      { 0  , "capturesize",   true,  "samples,post;capture ring size and number of samples to capture after the trigger, default=" DEFAULT_CAPTURE_SIZE },
+      { 0  , "captureinterval", true, "us;min time between capture samples, default=0 (back-to-back)" },
+      { 0  , "statsfile",     true,  "file;periodically write the statistics (as returned by the ubus 'stats' method) as JSON to this file" },
+      { 0  , "statsinterval", true,  "seconds;interval for writing the statistics file, default=10" },
       CMDLINE_APPLICATION_PATHOPTIONS,
       DAEMON_APPLICATION_LOGOPTIONS,
       CMDLINE_APPLICATION_STDOPTIONS,
@@ -319,6 +499,7 @@ public:
     UbusObjectPtr u = new UbusObject("kksdcmd", boost::bind(&KksDcmD::ubusApiRequestHandler, this, _1));
     u->addMethod("log", logapi_policy);
     u->addMethod("api", kksmbcapi_policy);
+    u->addMethod("stats", stats_policy);
     u->addMethod("quit");
     mUbusApiServer->registerObject(u);
   }
@@ -369,6 +550,26 @@ public:
       }
       aUbusRequest->sendResponse(JsonObjectPtr());
     }
+    else if (aUbusRequest->method()=="stats") {
+      // hot path statistics, optionally for a single core module, optionally reset after reading
+      ErrorPtr err;
+      JsonObjectPtr result;
+      JsonObjectPtr o;
+      int module = -1;
+      bool reset = false;
+      if (aUbusRequest->msg()) {
+        if (aUbusRequest->msg()->get("module", o)) module = o->int32Value();
+        if (aUbusRequest->msg()->get("reset", o)) reset = o->boolValue();
+      }
+      if (module>=(int)mCoreModules.size()) {
+        err = TextError::err("invalid 'module'=%d, have %zu core modules", module, mCoreModules.size());
+      }
+      else {
+        result = getStatistics(module);
+        if (reset) resetStatistics(module);
+      }
+      aUbusRequest->sendResponse(makeResponse(result, err));
+    }
     else if (aUbusRequest->method()=="quit") {
       LOG(LOG_WARNING, "terminated via UBUS quit method");
       terminateApp(1);
@@ -382,19 +583,160 @@ public:
         JsonObjectPtr subsys;
         // API for KKS-DCM core register web interface
         if (aUbusRequest->msg()->get("coreregs", subsys)) {
-          if (!subsys->get("cmd", o)) {
+          CoreRegModelPtr model;
+          int module = 0;
+          if (subsys->get("module", o)) module = o->int32Value();
+          if (module<0 || module>=(int)mCoreModules.size()) {
+            err = TextError::err("invalid 'module'=%d, have %zu core modules", module, mCoreModules.size());
+          }
+          else if (!subsys->get("cmd", o)) {
             err = TextError::err("missing 'cmd' in 'coreregs'");
           }
           else {
+            model = mCoreModules[module];
             string cmd = o->stringValue();
-            if (cmd=="list") {
+            if (cmd=="modules") {
+              // number of core modules and their modbus register offsets
+              result = JsonObject::newArray();
+              for (size_t i=0; i<mCoreModules.size(); i++) {
+                JsonObjectPtr m = JsonObject::newObj();
+                m->add("module", JsonObject::newInt32((int32_t)i));
+                m->add("modbusoffset", JsonObject::newInt32(mCoreModules[i]->modbusOffset()));
+                result->arrayAppend(m);
+              }
+            }
+            else if (cmd=="list") {
               // list current register model
               if (subsys->get("refresh", o)) {
                 if (o->boolValue()) {
-                  err = mCoreRegModel->updateModbusRegistersFromSPI(0, mCoreRegModel->maxReg());
+                  err = model->updateModbusRegistersFromSPI(0, model->maxReg());
+                }
+              }
+              if (subsys->get("since", o)) {
+                // only values (changed since given seq, 0=all), metadata is available separately via 'meta'
+                uint32_t since = (uint32_t)o->int64Value();
+                uint32_t epoch = 0;
+                if (subsys->get("epoch", o)) epoch = (uint32_t)o->int64Value();
+                result = model->getRegisterValues(since, epoch);
+              }
+              else {
+                result = model->getRegisterInfos();
+              }
+            }
+            else if (cmd=="packed") {
+              // all engineering values as one hex string, to be interpreted with 'meta'
+              result = model->getPackedValues();
+            }
+            else if (cmd=="meta") {
+              // static register metadata (cacheable, changes only when 'version' changes)
+              result = model->getRegisterMetadata();
+            }
+            else if (cmd=="changes") {
+              // changes since given sequence number (0 or none for all recent changes) of given epoch (if known)
+              uint32_t since = 0;
+              uint32_t epoch = 0;
+              if (subsys->get("since", o)) since = (uint32_t)o->int64Value();
+              if (subsys->get("epoch", o)) epoch = (uint32_t)o->int64Value();
+              result = model->getChangesSince(since, epoch);
+            }
+            else if (cmd=="readstats") {
+              // SPI read statistics
+              result = model->getReadStatistics();
+            }
+            else if (cmd=="history") {
+              // history of a register, or info about recorded history
+              if (!subsys->get("name", o) && !subsys->get("index", o)) {
+                result = model->getHistoryInfo();
+              }
+              else {
+                CoreRegModel::RegIndex regIndex = o->isType(json_type_string) ? model->regindexFromRegName(o->stringValue()) : o->int32Value();
+                HistoryResolution res = history_raw;
+                if (subsys->get("resolution", o)) {
+                  string r = o->stringValue();
+                  if (r=="seconds") res = history_seconds;
+                  else if (r=="minutes") res = history_minutes;
+                  else if (r!="raw") err = TextError::err("invalid 'resolution', must be 'raw', 'seconds' or 'minutes'");
+                }
+                MLMicroSeconds since = Never;
+                if (subsys->get("since", o)) since = o->doubleValue()*Second;
+                size_t count = 0;
+                if (subsys->get("count", o)) count = o->int32Value();
+                if (Error::isOK(err)) {
+                  result = model->getHistory(regIndex, res, since, count);
+                  if (!result) err = TextError::err("no history recorded for this register");
+                }
+              }
+            }
+            else if (cmd=="storedhistory") {
+              // persisted per second aggregates of a register
+              if (!subsys->get("name", o) && !subsys->get("index", o)) {
+                err = TextError::err("missing 'name' or 'index'");
+              }
+              else {
+                CoreRegModel::RegIndex regIndex = o->isType(json_type_string) ? model->regindexFromRegName(o->stringValue()) : o->int32Value();
+                MLMicroSeconds from = Never;
+                if (subsys->get("from", o)) from = o->doubleValue()*Second;
+                MLMicroSeconds to = Never;
+                if (subsys->get("to", o)) to = o->doubleValue()*Second;
+                size_t count = 0;
+                if (subsys->get("count", o)) count = o->int32Value();
+                result = model->getStoredHistory(regIndex, from, to, count);
+                if (!result) err = TextError::err("no history store or unknown register");
+              }
+            }
+            else if (cmd=="capture") {
+              // high rate burst capture around trigger events
+              string action = "status";
+              if (subsys->get("action", o)) action = o->stringValue();
+              BurstCapturePtr capture = mBurstCaptures[module];
+              if (action=="arm") {
+                // (re)configure if not yet configured or configuration is passed
+                bool reconfigure = !capture;
+                string regs = mCaptureRegs.empty() ? DEFAULT_CAPTURE_REGISTERS : mCaptureRegs;
+                string trigger = mCaptureTrigger;
+                int samples = mCaptureSamples;
+                int post = mCapturePost;
+                int interval = mCaptureInterval;
+                if (subsys->get("registers", o)) { regs = o->stringValue(); reconfigure = true; }
+                if (subsys->get("trigger", o)) { trigger = o->stringValue(); reconfigure = true; }
+                if (subsys->get("samples", o)) { samples = o->int32Value(); reconfigure = true; }
+                if (subsys->get("post", o)) { post = o->int32Value(); reconfigure = true; }
+                if (subsys->get("interval", o)) { interval = o->int32Value(); reconfigure = true; }
+                if (!capture) {
+                  capture = BurstCapturePtr(new BurstCapture(model));
+                  mBurstCaptures[module] = capture;
                 }
+                if (reconfigure) err = capture->configure(regs, trigger, samples, post, interval*MicroSecond);
+                if (Error::isOK(err)) err = capture->arm();
+                if (Error::isOK(err)) result = capture->status();
+              }
+              else if (!capture) {
+                err = TextError::err("no capture on this module, use action 'arm'");
+              }
+              else if (action=="status") {
+                result = capture->status();
+              }
+              else if (action=="trigger") {
+                capture->trigger();
+                result = capture->status();
+              }
+              else if (action=="stop") {
+                capture->stop();
+                result = capture->status();
+              }
+              else if (action=="download") {
+                size_t count = 0;
+                if (subsys->get("count", o)) count = o->int32Value();
+                result = capture->download(count);
+                if (!result) err = TextError::err("capture in progress, wait for the trigger or stop it");
+              }
+              else {
+                err = TextError::err("invalid 'action', must be 'status', 'arm', 'trigger', 'stop' or 'download'");
               }
-              result = mCoreRegModel->getRegisterInfos();
+            }
+            else if (cmd=="regmap") {
+              // export current register map (same format as --regmap file)
+              result = model->getRegisterMap();
             }
             else if (cmd=="read") {
               if (!subsys->get("index", o)) {
@@ -404,11 +746,11 @@ public:
                 CoreRegModel::RegIndex regIndex = o->int32Value();
                 if (subsys->get("refresh", o)) {
                   if (o->boolValue()) {
-                    err = mCoreRegModel->updateModbusRegistersFromSPI(regIndex, regIndex);
+                    err = model->updateModbusRegistersFromSPI(regIndex, regIndex);
                   }
                 }
                 if (Error::isOK(err)) {
-                  result = mCoreRegModel->getRegisterInfo(regIndex);
+                  result = model->getRegisterInfo(regIndex);
                 }
               }
             }
@@ -422,9 +764,9 @@ public:
                   err = TextError::err("missing 'value' for 'write' command");
                 }
                 else {
-                  err = mCoreRegModel->setRegisterValue(regIndex, o);
+                  err = model->setRegisterValue(regIndex, o);
                   if (Error::isOK(err)) {
-                    err = mCoreRegModel->updateSPIRegisterFromModbus(regIndex);
+                    err = model->updateSPIRegisterFromModbus(regIndex);
                   }
                 }
               }
@@ -530,20 +872,177 @@ public:
   {
     ErrorPtr err;
     if (!aBit) {
-      CoreRegModel::RegIndex regIndex = mCoreRegModel->regindexFromModbusReg(aAddress, aInput);
-      if (aWrite) {
-        // new data written, forward to core via SPI
-        mCoreRegModel->updateSPIRegisterFromModbus(regIndex);
+      MLMicroSeconds started = MainLoop::now();
+      if (aWrite) mModbusWrites.inc(); else mModbusReads.inc();
+      // find the core module the register belongs to
+      size_t i;
+      for (i=0; i<mCoreModules.size(); i++) {
+        CoreRegModelPtr model = mCoreModules[i];
+        CoreRegModel::RegIndex regIndex = model->regindexFromModbusReg(aAddress, aInput);
+        if (regIndex>model->maxReg()) continue; // not in this module
+        if (aWrite) {
+          // new data written, forward to core via SPI (only collected when the modbus TCP server batches the request's writes)
+          if (mModbusRtuSlave) model->mirrorModbusReg(*mModbusSlave, aAddress, aInput);
+          err = model->updateSPIRegisterFromModbus(regIndex);
+        }
+        else {
+          // get current data from core via SPI, unless register image is recent enough
+          model->updateModbusRegisterForAccess(regIndex, mMaxRegAge);
+        }
+        break;
       }
-      else {
-        // get current data from code via SPI
-        mCoreRegModel->updateModbusRegistersFromSPI(regIndex, regIndex);
+      if (i>=mCoreModules.size()) mModbusUnmapped.inc();
+      mModbusAccessTime.record(MainLoop::now()-started);
+    }
+    return err;
+  }
+
+
+  ErrorPtr modbusRtuAccessHandler(int aAddress, bool aBit, bool aInput, bool aWrite)
+  {
+    ErrorPtr err;
+    // Note: RTU reads are always answered from the register image (kept up to date by background
+    //   refresh/polling, which is enforced when RTU is enabled, and TCP accesses), so SPI latency
+    //   never breaks RTU response timing
+    if (!aBit) {
+      if (aWrite) mModbusRtuWrites.inc(); else mModbusRtuReads.inc();
+      if (aWrite) {
+        for (size_t i=0; i<mCoreModules.size(); i++) {
+          CoreRegModelPtr model = mCoreModules[i];
+          CoreRegModel::RegIndex regIndex = model->regindexFromModbusReg(aAddress, aInput);
+          if (regIndex>model->maxReg()) continue; // not in this module
+          // make the model's image (and the TCP slave) see the new value, then forward to core
+          model->mirrorModbusReg(*mModbusRtuSlave, aAddress, aInput);
+          err = model->updateSPIRegisterFromModbus(regIndex);
+          break;
+        }
       }
     }
     return err;
   }
 
 
+  /// process requests from the modbus TCP server
+  void modbusTcpRequestHandler(ModbusTcpRequestPtr aRequest, ModbusTcpDoneCB aDoneCB)
+  {
+    int span = aRequest->input() ? mModbusInputsSpan : mModbusRegsSpan;
+    if (aRequest->addr()<1 || aRequest->addr()+aRequest->count()-1>span) {
+      aDoneCB(ModbusTcpRequest::illegalDataAddress);
+      return;
+    }
+    if (aRequest->write()) {
+      // update the image, then process like libmodbus writes (mirroring), but collect the SPI writes
+      // in a batch per core module and answer only when all of them are written to the core
+      for (size_t m=0; m<mCoreModules.size(); m++) mCoreModules[m]->beginWriteBatch();
+      for (int i=0; i<aRequest->count(); i++) {
+        mModbusSlave->setReg(aRequest->addr()+i, false, aRequest->value(i));
+        modbusAccessHandler(aRequest->addr()+i, false, false, true);
+      }
+      // Note: all batches are closed here, so writes from elsewhere are not collected into them
+      ModbusWriteJoinPtr join = ModbusWriteJoinPtr(new ModbusWriteJoin(aDoneCB));
+      join->mPending = mCoreModules.size();
+      if (join->mPending==0) {
+        aDoneCB(0);
+        return;
+      }
+      for (size_t m=0; m<mCoreModules.size(); m++) {
+        mCoreModules[m]->commitWriteBatchAsync(boost::bind(&KksDcmD::modbusTcpWriteDone, this, join, _1));
+      }
+      return;
+    }
+    // read: update stale registers from SPI without blocking the mainloop, module by module
+    mModbusReads.inc(aRequest->count());
+    modbusTcpReadNext(aRequest, aDoneCB, 0, ErrorPtr());
+  }
+
+
+  void modbusTcpWriteDone(ModbusWriteJoinPtr aJoin, ErrorPtr aError)
+  {
+    if (Error::notOK(aError) && Error::isOK(aJoin->mError)) aJoin->mError = aError;
+    if (--aJoin->mPending>0) return;
+    if (Error::notOK(aJoin->mError)) {
+      LOG(LOG_WARNING, "Modbus TCP write failed: %s", aJoin->mError->text());
+      aJoin->mDoneCB(ModbusTcpRequest::slaveDeviceFailure);
+      return;
+    }
+    aJoin->mDoneCB(0);
+  }
+
+
+  void modbusTcpReadNext(ModbusTcpRequestPtr aRequest, ModbusTcpDoneCB aDoneCB, size_t aModule, ErrorPtr aError)
+  {
+    if (Error::isOK(aError) && aModule<mCoreModules.size()) {
+      mCoreModules[aModule]->updateModbusRegistersForAccessAsync(
+        aRequest->addr(), aRequest->count(), aRequest->input(), mMaxRegAge,
+        boost::bind(&KksDcmD::modbusTcpReadNext, this, aRequest, aDoneCB, aModule+1, _1)
+      );
+      return;
+    }
+    if (Error::notOK(aError)) {
+      LOG(LOG_WARNING, "Modbus TCP read of register %d failed: %s", aRequest->addr(), aError->text());
+      aDoneCB(ModbusTcpRequest::slaveDeviceFailure);
+      return;
+    }
+    for (int i=0; i<aRequest->count(); i++) {
+      aRequest->setValue(i, mModbusSlave->getReg(aRequest->addr()+i, aRequest->input()));
+    }
+    aDoneCB(0);
+  }
+
+
+  // MARK: - statistics
+
+  /// @param aModule core module to get statistics for, -1 for all
+  /// @return modbus access statistics plus hot path statistics of the core module(s)
+  JsonObjectPtr getStatistics(int aModule)
+  {
+    JsonObjectPtr stats = JsonObject::newObj();
+    JsonObjectPtr s = JsonObject::newObj();
+    s->add("reads", JsonObject::newInt64(mModbusReads.value()));
+    s->add("writes", JsonObject::newInt64(mModbusWrites.value()));
+    s->add("unmapped", JsonObject::newInt64(mModbusUnmapped.value()));
+    s->add("accessTime", mModbusAccessTime.json());
+    stats->add("modbus", s);
+    if (mModbusRtuSlave) {
+      s = JsonObject::newObj();
+      s->add("reads", JsonObject::newInt64(mModbusRtuReads.value()));
+      s->add("writes", JsonObject::newInt64(mModbusRtuWrites.value()));
+      stats->add("modbusrtu", s);
+    }
+    if (mModbusTcpServer) {
+      stats->add("modbustcp", mModbusTcpServer->getStatistics());
+    }
+    s = JsonObject::newArray();
+    for (size_t i=0; i<mCoreModules.size(); i++) {
+      if (aModule>=0 && (int)i!=aModule) continue;
+      JsonObjectPtr m = mCoreModules[i]->getStatistics();
+      m->add("module", JsonObject::newInt32((int32_t)i));
+      s->arrayAppend(m);
+    }
+    stats->add("modules", s);
+    return stats;
+  }
+
+
+  /// @param aModule core module to reset statistics for, -1 for all (including modbus access statistics)
+  void resetStatistics(int aModule)
+  {
+    if (aModule<0) {
+      mModbusReads.reset();
+      mModbusWrites.reset();
+      mModbusUnmapped.reset();
+      mModbusAccessTime.reset();
+      mModbusRtuReads.reset();
+      mModbusRtuWrites.reset();
+      if (mModbusTcpServer) mModbusTcpServer->resetStatistics();
+    }
+    for (size_t i=0; i<mCoreModules.size(); i++) {
+      if (aModule>=0 && (int)i!=aModule) continue;
+      mCoreModules[i]->resetStatistics();
+    }
+  }
+
+
   // MARK: - initialisation
 
   virtual void initialize()
@@ -564,6 +1063,8 @@ public:
     // - web api implemented in p44script (webrequest() global event source)
     StandardScriptingDomain::sharedDomain().registerMemberLookup(gScriptApiLookupP);
     #endif
+    // - core register changes (coreregchange() global event source)
+    StandardScriptingDomain::sharedDomain().registerMemberLookup(&mCoreRegChangeLookup);
     // - generic function
     #if ENABLE_HTTP_SCRIPT_FUNCS
     StandardScriptingDomain::sharedDomain().registerMemberLookup(new P44Script::HttpLookup);
@@ -594,30 +1095,263 @@ public:
     #endif // ENABLE_HTTP_SCRIPT_FUNCS
     #endif // ENABLE_P44SCRIPT
 
-    // Create the register model
-    mCoreRegModel = CoreRegModelPtr(new CoreRegModel);
-    // Add the SPI
-    int spino = 10; // default to bus 1, CS0 (as in KKS-DCM revA hardware)
-    getIntOption("corespi", spino);
-    SPIDevicePtr dev = SPIManager::sharedManager().getDevice(spino, "generic");
-    mCoreRegModel->coreSPIProto().setSpiDevice(dev);
-    // Prepare the modbus slave for TCP connections
+    // Create the modbus slave shared by all core modules
+    mModbusSlave = ModbusSlavePtr(new ModbusSlave);
+    // Create the register models, one per core module SPI device
+    string corespi = "10"; // default to bus 1, CS0 (as in KKS-DCM revA hardware)
+    getStringOption("corespi", corespi);
+    string regmaps;
+    getStringOption("regmap", regmaps);
+    int mbOffset = DEFAULT_MODULE_MODBUS_OFFSET;
+    getIntOption("mboffset", mbOffset);
+    const char* sp = corespi.c_str();
+    const char* rp = regmaps.c_str();
+    string spispec, regmapFn;
+    std::map<int, CoreSPIBusPtr> buses; // modules on the same SPI bus share a bus worker thread
+    int regsSpan = 0;
+    int inputsSpan = 0;
+    while (nextPart(sp, spispec, ',')) {
+      int module = (int)mCoreModules.size();
+      CoreRegModelPtr model = CoreRegModelPtr(new CoreRegModel(mModbusSlave, module*mbOffset));
+      // Load register map, if specified (last one specified applies to all further modules)
+      string fn;
+      if (nextPart(rp, fn, ',')) regmapFn = fn;
+      if (!regmapFn.empty()) {
+        // use resource only if there is no such file in the data path, so errors in the data path file are reported as such
+        string mapPath = dataPath(regmapFn);
+        struct stat st;
+        if (stat(mapPath.c_str(), &st)!=0) mapPath = resourcePath(regmapFn);
+        err = model->loadRegisterMap(mapPath);
+        if (Error::notOK(err)) {
+          LOG(LOG_ERR, "Cannot load register map '%s' for core module %d: %s", mapPath.c_str(), module, err->text());
+          terminateApp(EXIT_FAILURE);
+          return;
+        }
+      }
+      if (
+        module>0 && (
+          mCoreModules[module-1]->modbusRegisterSpan(false)>=model->modbusOffset() ||
+          mCoreModules[module-1]->modbusRegisterSpan(true)>=model->modbusOffset()
+        )
+      ) {
+        LOG(LOG_ERR, "Modbus register offset %d is too small for the register map of core module %d", mbOffset, module-1);
+        terminateApp(EXIT_FAILURE);
+        return;
+      }
+      if (model->modbusRegisterSpan(false)>0xFFFF || model->modbusRegisterSpan(true)>0xFFFF) {
+        // would wrap around and overlap the registers of the first modules
+        LOG(LOG_ERR, "Modbus registers of core module %d exceed the modbus address range with register offset %d", module, mbOffset);
+        terminateApp(EXIT_FAILURE);
+        return;
+      }
+      // Add the SPI
+      int spino;
+      if (spispec=="sim") {
+        // simulated core module, each one on its own simulated bus
+        SimulatedCorePtr sim = SimulatedCorePtr(new SimulatedCore);
+        int a, b;
+        string s;
+        if (getStringOption("simfiller", s) && sscanf(s.c_str(), "%d,%d", &a, &b)==2) sim->setFiller(a, b);
+        if (getStringOption("simerrors", s) && sscanf(s.c_str(), "%d,%d", &a, &b)==2) sim->setErrorRates(a, b);
+        if (getStringOption("simtiming", s) && sscanf(s.c_str(), "%d,%d", &a, &b)==2) sim->setTiming(a*MicroSecond, b*MicroSecond);
+        model->coreSPIProto().setTransport(sim);
+        spino = -10*(module+1);
+        LOG(LOG_NOTICE, "core module %d is simulated", module);
+      }
+      else {
+        spino = atoi(spispec.c_str());
+        SPIDevicePtr dev = SPIManager::sharedManager().getDevice(spino, "generic");
+        model->coreSPIProto().setSpiDevice(dev);
+      }
+      CoreSPIBusPtr& bus = buses[spino/10];
+      if (!bus) bus = CoreSPIBusPtr(new CoreSPIBus);
+      model->coreSPIProto().setBus(bus);
+      model->coreSPIProto().setFillerPrediction(!getOption("nofillerprediction"));
+      if (model->modbusRegisterSpan(false)>regsSpan) regsSpan = model->modbusRegisterSpan(false);
+      if (model->modbusRegisterSpan(true)>inputsSpan) inputsSpan = model->modbusRegisterSpan(true);
+      mCoreModules.push_back(model);
+    }
+    LOG(LOG_NOTICE, "%zu core module(s), modbus register offset %d per module", mCoreModules.size(), mbOffset);
+    // modbus registers for all modules
+    mModbusSlave->setRegisterModel(
+      0, 0,
+      0, 0,
+      1, regsSpan,
+      1, inputsSpan
+    );
+    mModbusRegsSpan = regsSpan;
+    mModbusInputsSpan = inputsSpan;
+    // Prepare modbus TCP
     string mbconn = DEFAULT_MODBUS_CONNECTION;
     getStringOption("modbus", mbconn);
-    mCoreRegModel->modbusSlave().setConnectionSpecification(mbconn.c_str(), DEFAULT_MODBUS_IP_PORT, NULL);
-    mCoreRegModel->modbusSlave().setSlaveId(string_format("KKS-DCM version %s", Application::version().c_str()));
-    // start TCP server for modbus slave
-    err = mCoreRegModel->modbusSlave().connect();
+    mModbusSlave->setSlaveId(string_format("KKS-DCM version %s", Application::version().c_str()));
+    if (getOption("libmodbustcp")) {
+      // start TCP server for modbus slave
+      mModbusSlave->setConnectionSpecification(mbconn.c_str(), DEFAULT_MODBUS_IP_PORT, NULL);
+      err = mModbusSlave->connect();
+    }
+    else {
+      // own TCP server with per client request queues, using mModbusSlave's registers as the image
+      mModbusTcpServer = ModbusTcpServerPtr(new ModbusTcpServer(boost::bind(&KksDcmD::modbusTcpRequestHandler, this, _1, _2)));
+      int maxConnections = DEFAULT_MODBUS_TCP_CONNECTIONS;
+      getIntOption("mbconnections", maxConnections);
+      int maxQueue = DEFAULT_MODBUS_TCP_QUEUE;
+      getIntOption("mbqueue", maxQueue);
+      int idle = DEFAULT_MODBUS_TCP_IDLE;
+      getIntOption("mbidle", idle);
+      mModbusTcpServer->setLimits(maxConnections, maxQueue, idle>0 ? idle*Second : Never);
+      mModbusTcpServer->setSlaveId(string_format("KKS-DCM version %s", Application::version().c_str()));
+      err = mModbusTcpServer->start(mbconn, DEFAULT_MODBUS_IP_PORT);
+    }
     if (Error::notOK(err)) {
       LOG(LOG_ERR, "Error starting modbus TCP server/slave: %s", err->text());
     }
-    // read initial values into all modbus registers from actual hardware
-    err = mCoreRegModel->updateModbusRegistersFromSPI(0, mCoreRegModel->maxReg());
-    if (Error::notOK(err)) {
-      LOG(LOG_ERR, "Error updating registers: %s", err->text());
+    // optionally serve the same registers via modbus RTU
+    string rtuconn;
+    if (getStringOption("modbusrtu", rtuconn)) {
+      mModbusRtuSlave = ModbusSlavePtr(new ModbusSlave);
+      mModbusRtuSlave->setRegisterModel(
+        0, 0,
+        0, 0,
+        1, regsSpan,
+        1, inputsSpan
+      );
+      string txen;
+      getStringOption("rs485txenable", txen);
+      int txDelayUs = Never;
+      getIntOption("rs485txdelay", txDelayUs);
+      int byteTimeNs = 0;
+      getIntOption("bytetime", byteTimeNs);
+      err = mModbusRtuSlave->setConnectionSpecification(
+        rtuconn.c_str(),
+        DEFAULT_MODBUS_IP_PORT, DEFAULT_MODBUS_RTU_PARAMS,
+        txen.c_str(), txDelayUs,
+        getOption("rs485rxenable"), // can be NULL if there is no separate rx enable
+        byteTimeNs
+      );
+      if (Error::isOK(err)) {
+        int rtuSlave = 1;
+        getIntOption("rtuslave", rtuSlave);
+        mModbusRtuSlave->setSlaveAddress(rtuSlave);
+        mModbusRtuSlave->setSlaveId(string_format("KKS-DCM version %s", Application::version().c_str()));
+        for (size_t i=0; i<mCoreModules.size(); i++) {
+          mCoreModules[i]->addModbusMirror(mModbusRtuSlave);
+        }
+        mModbusRtuSlave->setValueAccessHandler(boost::bind(&KksDcmD::modbusRtuAccessHandler, this, _1, _2, _3, _4));
+        err = mModbusRtuSlave->connect();
+      }
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Error starting modbus RTU slave on '%s': %s", rtuconn.c_str(), err->text());
+      }
+      else {
+        LOG(LOG_NOTICE, "modbus RTU slave on '%s' mirrors the registers", rtuconn.c_str());
+      }
     }
+    // common settings
+    int readGap = -1;
+    getIntOption("readgap", readGap);
+    int spiClock = DEFAULT_SPI_CLOCK;
+    getIntOption("spiclock", spiClock);
+    int frameOverhead = DEFAULT_FRAME_OVERHEAD;
+    getIntOption("frameoverhead", frameOverhead);
+    int refreshMs = 0;
+    getIntOption("refresh", refreshMs);
+    int fastPollMs = 0;
+    getIntOption("fastpoll", fastPollMs);
+    int slowPollMs = 0;
+    getIntOption("slowpoll", slowPollMs);
+    if (mModbusRtuSlave && refreshMs<=0 && fastPollMs<=0 && slowPollMs<=0) {
+      // RTU reads are answered from the register image only, which would never update otherwise
+      refreshMs = DEFAULT_MODBUS_RTU_REFRESH;
+      LOG(LOG_WARNING, "modbus RTU enabled without refresh or polling -> refreshing registers every %d mS", refreshMs);
+    }
+    // by default, registers are fresh as long as refresh or polling keeps them current
+    int maxAgeMs;
+    mMaxRegAge = getIntOption("maxage", maxAgeMs) ? maxAgeMs*MilliSecond : maxAgeFromPolling;
+    int readAhead = 0;
+    getIntOption("readahead", readAhead);
+    string historyRegs;
+    getStringOption("history", historyRegs);
+    if (historyRegs=="default") historyRegs = DEFAULT_HISTORY_REGISTERS;
+    string s = DEFAULT_HISTORY_SIZES;
+    getStringOption("historysize", s);
+    int histRaw = 0, histSecs = 0, histMins = 0;
+    sscanf(s.c_str(), "%d,%d,%d", &histRaw, &histSecs, &histMins);
+    string historyStoreDir;
+    getStringOption("historystore", historyStoreDir);
+    s = DEFAULT_HISTORY_STORE_SIZE;
+    getStringOption("historystoresize", s);
+    int storeSegKb = 0, storeSegs = 0;
+    sscanf(s.c_str(), "%d,%d", &storeSegKb, &storeSegs);
+    int historyFlush = DEFAULT_HISTORY_FLUSH;
+    getIntOption("historyflush", historyFlush);
+    getStringOption("capture", mCaptureRegs);
+    if (mCaptureRegs=="default") mCaptureRegs = DEFAULT_CAPTURE_REGISTERS;
+    mCaptureTrigger = DEFAULT_CAPTURE_TRIGGER;
+    getStringOption("capturetrigger", mCaptureTrigger);
+    s = DEFAULT_CAPTURE_SIZE;
+    getStringOption("capturesize", s);
+    mCaptureSamples = 0; mCapturePost = 0;
+    sscanf(s.c_str(), "%d,%d", &mCaptureSamples, &mCapturePost);
+    mCaptureInterval = 0;
+    getIntOption("captureinterval", mCaptureInterval);
+    mBurstCaptures.resize(mCoreModules.size());
+    for (size_t i=0; i<mCoreModules.size(); i++) {
+      CoreRegModelPtr model = mCoreModules[i];
+      // plan SPI bursts for reading all registers
+      if (readGap>=0) {
+        model->setMaxReadGap(readGap);
+      }
+      else {
+        model->setReadCostModel(frameOverhead*MicroSecond, spiClock);
+      }
+      // read initial values into all modbus registers from actual hardware
+      err = model->updateModbusRegistersFromSPI(0, model->maxReg());
+      if (Error::notOK(err)) {
+        LOG(LOG_ERR, "Error updating registers of core module %zu: %s", i, err->text());
+      }
+      // start background refresh and polling, if any
+      model->setBackgroundRefresh(refreshMs*MilliSecond);
+      if (fastPollMs>0 || slowPollMs>0) {
+        model->setPollIntervals(fastPollMs>0 ? fastPollMs*MilliSecond : Never, slowPollMs>0 ? slowPollMs*MilliSecond : Never);
+      }
+      if (readAhead>0) {
+        model->setReadAhead(readAhead);
+      }
+      if (!historyRegs.empty()) {
+        err = model->setHistory(historyRegs, histRaw, histSecs, histMins);
+        if (Error::notOK(err)) {
+          LOG(LOG_ERR, "History for core module %zu: %s", i, err->text());
+        }
+        if (!historyStoreDir.empty()) {
+          if (i==0) mkdir(dataPath(historyStoreDir).c_str(), 0755);
+          err = model->setHistoryStore(HistoryStorePtr(new HistoryStore(
+            dataPath(string_format("%s/module%zu", historyStoreDir.c_str(), i)),
+            (size_t)storeSegKb*1024, storeSegs, historyFlush*Second
+          )));
+          if (Error::notOK(err)) {
+            LOG(LOG_ERR, "History store for core module %zu: %s", i, err->text());
+          }
+        }
+      }
+      if (!mCaptureRegs.empty()) {
+        // capture continuously until a trigger occurs
+        BurstCapturePtr capture = BurstCapturePtr(new BurstCapture(model));
+        err = capture->configure(mCaptureRegs, mCaptureTrigger, mCaptureSamples, mCapturePost, mCaptureInterval*MicroSecond);
+        if (Error::isOK(err)) err = capture->arm();
+        if (Error::notOK(err)) {
+          LOG(LOG_ERR, "Burst capture for core module %zu: %s", i, err->text());
+        }
+        mBurstCaptures[i] = capture;
+      }
+      #if ENABLE_P44SCRIPT
+      // report register changes to scripts
+      model->setChangeHandler(boost::bind(&KksDcmD::coreRegChanged, this, (int)i, _1));
+      #endif
+    }
+    err.reset();
     // install modbus access handler
-    mCoreRegModel->modbusSlave().setValueAccessHandler(boost::bind(&KksDcmD::modbusAccessHandler, this, _1, _2, _3, _4));
+    mModbusSlave->setValueAccessHandler(boost::bind(&KksDcmD::modbusAccessHandler, this, _1, _2, _3, _4));
     #if ENABLE_P44SCRIPT
     // load and start main script
     if (getStringOption("mainscript", mMainScriptFn)) {
@@ -643,6 +1377,13 @@ public:
       }
     }
     #endif // ENABLE_P44SCRIPT
+    // periodically write statistics to a file, if requested
+    if (getStringOption("statsfile", mStatsFile)) {
+      int statsSecs = DEFAULT_STATS_INTERVAL;
+      getIntOption("statsinterval", statsSecs);
+      mStatsInterval = (statsSecs>0 ? statsSecs : 1)*Second;
+      writeStatsFile();
+    }
     // display error
     if (Error::notOK(err)) {
       LOG(LOG_ERR, "Startup error: %s", Error::text(err));
@@ -650,6 +1391,32 @@ public:
   }
 
 
+  void writeStatsFile()
+  {
+    JsonObjectPtr stats = getStatistics(-1);
+    // readers use the time to see if the file was written after a given point in time
+    stats->add("time", JsonObject::newDouble((double)MainLoop::unixtime()/Second));
+    // write to a temp file first, so readers never see a partially written file
+    string tmp = mStatsFile+".tmp";
+    ErrorPtr err = string_tofile(tmp, stats->json_str());
+    if (Error::isOK(err) && rename(tmp.c_str(), mStatsFile.c_str())<0) err = SysError::errNo("cannot rename statistics file: ");
+    if (Error::notOK(err)) {
+      LOG(LOG_WARNING, "Cannot write statistics to '%s': %s", mStatsFile.c_str(), err->text());
+    }
+    mStatsTicket.executeOnce(boost::bind(&KksDcmD::writeStatsFile, this), mStatsInterval);
+  }
+
+
+  #if ENABLE_P44SCRIPT
+  void coreRegChanged(int aModule, const CoreRegModel::RegisterChange& aChange)
+  {
+    JsonObjectPtr info = mCoreModules[aModule]->getChangeInfo(aChange);
+    info->add("module", JsonObject::newInt32(aModule));
+    mCoreRegChangeLookup.reportChange(info);
+  }
+  #endif // ENABLE_P44SCRIPT
+
+
   void mainScriptDone(ScriptObjPtr aResult)
   {
     if (aResult && aResult->isErr()) {
@@ -666,6 +1433,28 @@ public:
     terminateApp(aExitCode);
   }
 
+
+  virtual void cleanup(int aExitCode)
+  {
+    // final statistics
+    if (!mStatsFile.empty()) {
+      writeStatsFile();
+      mStatsTicket.cancel();
+    }
+    // write out the history collected since the last flush
+    for (size_t i=0; i<mCoreModules.size(); i++) {
+      HistoryStorePtr store = mCoreModules[i]->historyStore();
+      if (store) store->flush(true);
+    }
+  }
+
+
+  CoreRegModelPtr coreModule(int aModule)
+  {
+    if (aModule<0 || aModule>=(int)mCoreModules.size()) return CoreRegModelPtr();
+    return mCoreModules[aModule];
+  }
+
 };
 
 
@@ -685,8 +1474,98 @@ static void exit_func(BuiltinFunctionContextPtr f)
 
 
 
+// coreregvalues([module])
+static const BuiltInArgDesc coreregvalues_args[] = { { numeric|optionalarg } };
+static const size_t coreregvalues_numargs = sizeof(coreregvalues_args)/sizeof(BuiltInArgDesc);
+static void coreregvalues_func(BuiltinFunctionContextPtr f)
+{
+  KksDcmD& kksdcmd = static_cast<KksDcmDLookup*>(f->funcObj()->getMemberLookup())->mKksdcmd;
+  CoreRegModelPtr model = kksdcmd.coreModule(f->numArgs()>0 ? f->arg(0)->intValue() : 0);
+  if (!model) {
+    f->finish(new AnnotatedNullValue("no such core module"));
+    return;
+  }
+  f->finish(new JsonValue(model->getPackedValues()));
+}
+
+
+// corereghistory(regname [, resolution [, count [, module]]])
+static const BuiltInArgDesc corereghistory_args[] = { { text }, { text|optionalarg }, { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t corereghistory_numargs = sizeof(corereghistory_args)/sizeof(BuiltInArgDesc);
+static void corereghistory_func(BuiltinFunctionContextPtr f)
+{
+  KksDcmD& kksdcmd = static_cast<KksDcmDLookup*>(f->funcObj()->getMemberLookup())->mKksdcmd;
+  CoreRegModelPtr model = kksdcmd.coreModule(f->numArgs()>3 ? f->arg(3)->intValue() : 0);
+  if (!model) {
+    f->finish(new AnnotatedNullValue("no such core module"));
+    return;
+  }
+  HistoryResolution res = history_raw;
+  if (f->numArgs()>1) {
+    string r = f->arg(1)->stringValue();
+    if (r=="seconds") res = history_seconds;
+    else if (r=="minutes") res = history_minutes;
+    else if (r!="raw") {
+      f->finish(new ErrorValue(TextError::err("resolution must be 'raw', 'seconds' or 'minutes'")));
+      return;
+    }
+  }
+  size_t count = f->numArgs()>2 ? f->arg(2)->intValue() : 0;
+  JsonObjectPtr h = model->getHistory(model->regindexFromRegName(f->arg(0)->stringValue()), res, Never, count);
+  if (!h) {
+    f->finish(new AnnotatedNullValue("no history recorded for this register"));
+    return;
+  }
+  f->finish(new JsonValue(h));
+}
+
+
+// storedhistory(regname [, from [, to [, count [, module]]]])
+static const BuiltInArgDesc storedhistory_args[] = { { text }, { numeric|null|optionalarg }, { numeric|null|optionalarg }, { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t storedhistory_numargs = sizeof(storedhistory_args)/sizeof(BuiltInArgDesc);
+static void storedhistory_func(BuiltinFunctionContextPtr f)
+{
+  KksDcmD& kksdcmd = static_cast<KksDcmDLookup*>(f->funcObj()->getMemberLookup())->mKksdcmd;
+  CoreRegModelPtr model = kksdcmd.coreModule(f->numArgs()>4 ? f->arg(4)->intValue() : 0);
+  if (!model) {
+    f->finish(new AnnotatedNullValue("no such core module"));
+    return;
+  }
+  MLMicroSeconds from = f->numArgs()>1 && f->arg(1)->defined() ? f->arg(1)->doubleValue()*Second : Never;
+  MLMicroSeconds to = f->numArgs()>2 && f->arg(2)->defined() ? f->arg(2)->doubleValue()*Second : Never;
+  size_t count = f->numArgs()>3 ? f->arg(3)->intValue() : 0;
+  JsonObjectPtr h = model->getStoredHistory(model->regindexFromRegName(f->arg(0)->stringValue()), from, to, count);
+  if (!h) {
+    f->finish(new AnnotatedNullValue("no history store or unknown register"));
+    return;
+  }
+  f->finish(new JsonValue(h));
+}
+
+
+// corestats([module [, reset]])
+static const BuiltInArgDesc corestats_args[] = { { numeric|optionalarg }, { numeric|optionalarg } };
+static const size_t corestats_numargs = sizeof(corestats_args)/sizeof(BuiltInArgDesc);
+static void corestats_func(BuiltinFunctionContextPtr f)
+{
+  KksDcmD& kksdcmd = static_cast<KksDcmDLookup*>(f->funcObj()->getMemberLookup())->mKksdcmd;
+  int module = f->numArgs()>0 && f->arg(0)->defined() ? f->arg(0)->intValue() : -1;
+  if (module>=0 && !kksdcmd.coreModule(module)) {
+    f->finish(new AnnotatedNullValue("no such core module"));
+    return;
+  }
+  JsonObjectPtr stats = kksdcmd.getStatistics(module);
+  if (f->numArgs()>1 && f->arg(1)->boolValue()) kksdcmd.resetStatistics(module);
+  f->finish(new JsonValue(stats));
+}
+
+
 static const BuiltinMemberDescriptor kksdcmdGlobals[] = {
   { "exit", executable|null, exit_numargs, exit_args, &exit_func },
+  { "coreregvalues", executable|json|null, coreregvalues_numargs, coreregvalues_args, &coreregvalues_func },
+  { "corereghistory", executable|json|null, corereghistory_numargs, corereghistory_args, &corereghistory_func },
+  { "storedhistory", executable|json|null, storedhistory_numargs, storedhistory_args, &storedhistory_func },
+  { "corestats", executable|json|null, corestats_numargs, corestats_args, &corestats_func },
   { NULL } // terminator
 };
 
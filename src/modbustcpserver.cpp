@@ -0,0 +1,507 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "modbustcpserver.hpp"
+
+#include "mainloop.hpp"
+#include "utils.hpp"
+
+#include <arpa/inet.h>
+
+using namespace p44;
+
+/// max number of bytes in the MBAP length field (unit identifier plus max PDU size)
+static const size_t maxMbapLength = 254;
+
+// MARK: - ModbusTcpRequest
+
+ModbusTcpRequest::ModbusTcpRequest() :
+  mTransactionId(0),
+  mUnitId(0),
+  mFunction(0),
+  mException(0),
+  mAddr(0),
+  mCount(0),
+  mQueued(Never)
+{
+}
+
+
+// MARK: - ModbusTcpConnection
+
+ModbusTcpConnection::ModbusTcpConnection(SocketCommPtr aComm) :
+  mComm(aComm),
+  mOpen(true),
+  mSince(MainLoop::now()),
+  mTxWaiting(false),
+  mInProcess(false)
+{
+}
+
+
+// MARK: - ModbusTcpServer
+
+ModbusTcpServer::ModbusTcpServer(ModbusTcpRequestCB aRequestHandler) :
+  mRequestHandler(aRequestHandler),
+  mMaxConnections(16),
+  mMaxQueue(8),
+  mIdleTimeout(Never),
+  mNextConn(0)
+{
+}
+
+
+ModbusTcpServer::~ModbusTcpServer()
+{
+  for (size_t i=0; i<mConnections.size(); i++) {
+    ModbusTcpConnectionPtr conn = mConnections[i];
+    conn->mComm->setReceiveHandler(StatusCB());
+    conn->mComm->setTransmitHandler(StatusCB());
+    conn->mComm->setConnectionStatusHandler(SocketCommCB());
+    conn->mComm->closeConnection();
+  }
+  mConnections.clear();
+  if (mServer) mServer->closeConnection();
+}
+
+
+void ModbusTcpServer::setLimits(int aMaxConnections, size_t aMaxQueue, MLMicroSeconds aIdleTimeout)
+{
+  mMaxConnections = aMaxConnections>0 ? aMaxConnections : 1;
+  mMaxQueue = aMaxQueue>0 ? aMaxQueue : 1;
+  mIdleTimeout = aIdleTimeout;
+}
+
+
+ErrorPtr ModbusTcpServer::start(const string aConnectionSpec, uint16_t aDefaultPort)
+{
+  string host;
+  uint16_t port = aDefaultPort;
+  splitHost(aConnectionSpec.c_str(), &host, &port);
+  mServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  mServer->setConnectionParams(NULL, string_format("%d", port).c_str(), SOCK_STREAM, AF_INET);
+  mServer->setAllowNonlocalConnections(host!="127.0.0.1" && host!="localhost");
+  // Note: allow one more than the limit at the socket level, so refused connections get counted here
+  return mServer->startServer(boost::bind(&ModbusTcpServer::serverConnectionHandler, this, _1), mMaxConnections+1);
+}
+
+
+SocketCommPtr ModbusTcpServer::serverConnectionHandler(SocketCommPtr aServerSocketComm)
+{
+  if ((int)mConnections.size()>=mMaxConnections) {
+    mRejected.inc();
+    LOG(LOG_WARNING, "Modbus TCP: connection refused, already %zu clients connected", mConnections.size());
+    return SocketCommPtr();
+  }
+  SocketCommPtr comm = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  ModbusTcpConnectionPtr conn = ModbusTcpConnectionPtr(new ModbusTcpConnection(comm));
+  // Note: handlers get a plain pointer to avoid a reference cycle, they are removed before conn is released
+  comm->setReceiveHandler(boost::bind(&ModbusTcpServer::dataReceived, this, conn.get(), _1));
+  comm->setConnectionStatusHandler(boost::bind(&ModbusTcpServer::connectionStatus, this, conn.get(), _1, _2));
+  mConnections.push_back(conn);
+  mAccepted.inc();
+  restartIdleTimer(conn.get());
+  return comm;
+}
+
+
+void ModbusTcpServer::connectionStatus(ModbusTcpConnection* aConn, SocketCommPtr aSocketComm, ErrorPtr aError)
+{
+  if (Error::notOK(aError) || !aSocketComm->connected()) {
+    LOG(LOG_INFO, "Modbus TCP: client %s disconnected", aConn->mPeer.c_str());
+    closeConnection(aConn);
+  }
+}
+
+
+void ModbusTcpServer::closeConnection(ModbusTcpConnection* aConn)
+{
+  if (!aConn->mOpen) return;
+  aConn->mOpen = false;
+  aConn->mIdleTicket.cancel();
+  aConn->mQueue.clear();
+  aConn->mComm->closeConnection();
+  // remove later, we might be called from one of the connection's handlers
+  MainLoop::currentMainLoop().executeNow(boost::bind(&ModbusTcpServer::removeConnection, this, ModbusTcpConnectionPtr(aConn)));
+}
+
+
+void ModbusTcpServer::removeConnection(ModbusTcpConnectionPtr aConn)
+{
+  aConn->mComm->setReceiveHandler(StatusCB());
+  aConn->mComm->setTransmitHandler(StatusCB());
+  aConn->mComm->setConnectionStatusHandler(SocketCommCB());
+  for (size_t i=0; i<mConnections.size(); i++) {
+    if (mConnections[i]==aConn) {
+      mConnections.erase(mConnections.begin()+i);
+      if (mNextConn>i) mNextConn--;
+      break;
+    }
+  }
+}
+
+
+static string peerAddress(int aFd)
+{
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof(sa);
+  if (aFd<0 || getpeername(aFd, (struct sockaddr*)&sa, &salen)<0) return "unknown";
+  char buf[INET6_ADDRSTRLEN];
+  if (sa.ss_family==AF_INET) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&sa;
+    inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+    return string_format("%s:%d", buf, ntohs(sin->sin_port));
+  }
+  else if (sa.ss_family==AF_INET6) {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&sa;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf));
+    return string_format("[%s]:%d", buf, ntohs(sin6->sin6_port));
+  }
+  return "unknown";
+}
+
+
+void ModbusTcpServer::dataReceived(ModbusTcpConnection* aConn, ErrorPtr aError)
+{
+  if (!aConn->mOpen) return;
+  if (Error::notOK(aError)) {
+    closeConnection(aConn);
+    return;
+  }
+  if (aConn->mPeer.empty()) {
+    aConn->mPeer = peerAddress(aConn->mComm->getFd());
+    LOG(LOG_INFO, "Modbus TCP: client %s connected", aConn->mPeer.c_str());
+  }
+  uint8_t buf[512];
+  size_t n;
+  while ((n = aConn->mComm->numBytesReady())>0) {
+    if (n>sizeof(buf)) n = sizeof(buf);
+    size_t got = aConn->mComm->receiveBytes(n, buf, aError);
+    if (Error::notOK(aError)) {
+      closeConnection(aConn);
+      return;
+    }
+    if (got==0) break;
+    aConn->mBytesIn.inc(got);
+    aConn->mRxBuf.append((const char*)buf, got);
+  }
+  restartIdleTimer(aConn);
+  // extract complete frames
+  while (aConn->mRxBuf.size()>=7) {
+    const uint8_t* f = (const uint8_t*)aConn->mRxBuf.data();
+    uint16_t protocolId = (f[2]<<8)+f[3];
+    size_t len = (f[4]<<8)+f[5];
+    if (protocolId!=0 || len<2 || len>maxMbapLength) {
+      mProtocolErrors.inc();
+      LOG(LOG_WARNING, "Modbus TCP: invalid frame from %s, closing connection", aConn->mPeer.c_str());
+      closeConnection(aConn);
+      return;
+    }
+    if (aConn->mRxBuf.size()<6+len) break; // incomplete
+    ModbusTcpRequestPtr req = parseRequest(f, len);
+    aConn->mRxBuf.erase(0, 6+len);
+    req->mQueued = MainLoop::now();
+    if (aConn->mQueue.size()>=mMaxQueue) {
+      // client does not wait for responses, do not let it hog the server
+      aConn->mBusyRejects.inc();
+      req->mException = ModbusTcpRequest::slaveDeviceBusy;
+      sendResponse(aConn, req);
+      if (!aConn->mOpen) return;
+      continue;
+    }
+    aConn->mQueue.push_back(req);
+  }
+  scheduleNext();
+}
+
+
+ModbusTcpRequestPtr ModbusTcpServer::parseRequest(const uint8_t* aFrame, size_t aLen)
+{
+  ModbusTcpRequestPtr req = ModbusTcpRequestPtr(new ModbusTcpRequest);
+  req->mTransactionId = (aFrame[0]<<8)+aFrame[1];
+  req->mUnitId = aFrame[6];
+  const uint8_t* pdu = aFrame+7;
+  size_t pduLen = aLen-1;
+  req->mFunction = pdu[0];
+  switch (req->mFunction) {
+    case 0x03: // read holding registers
+    case 0x04: // read input registers
+      if (pduLen!=5) {
+        req->mException = ModbusTcpRequest::illegalDataValue;
+        break;
+      }
+      req->mAddr = (pdu[1]<<8)+pdu[2];
+      req->mCount = (pdu[3]<<8)+pdu[4];
+      if (req->mCount<1 || req->mCount>125) {
+        req->mException = ModbusTcpRequest::illegalDataValue;
+        break;
+      }
+      req->mValues.resize(req->mCount);
+      break;
+    case 0x06: // write single register
+      if (pduLen!=5) {
+        req->mException = ModbusTcpRequest::illegalDataValue;
+        break;
+      }
+      req->mAddr = (pdu[1]<<8)+pdu[2];
+      req->mCount = 1;
+      req->mValues.push_back((pdu[3]<<8)+pdu[4]);
+      break;
+    case 0x10: // write multiple registers
+      if (pduLen<6) {
+        req->mException = ModbusTcpRequest::illegalDataValue;
+        break;
+      }
+      req->mAddr = (pdu[1]<<8)+pdu[2];
+      req->mCount = (pdu[3]<<8)+pdu[4];
+      if (req->mCount<1 || req->mCount>123 || pdu[5]!=2*req->mCount || pduLen!=6+(size_t)pdu[5]) {
+        req->mException = ModbusTcpRequest::illegalDataValue;
+        break;
+      }
+      for (int i=0; i<req->mCount; i++) {
+        req->mValues.push_back((pdu[6+2*i]<<8)+pdu[7+2*i]);
+      }
+      break;
+    case 0x11: // report slave ID
+      break;
+    default:
+      req->mException = ModbusTcpRequest::illegalFunction;
+      break;
+  }
+  return req;
+}
+
+
+void ModbusTcpServer::restartIdleTimer(ModbusTcpConnection* aConn)
+{
+  if (mIdleTimeout>0) {
+    aConn->mIdleTicket.executeOnce(boost::bind(&ModbusTcpServer::idleTimeout, this, aConn), mIdleTimeout);
+  }
+}
+
+
+void ModbusTcpServer::idleTimeout(ModbusTcpConnection* aConn)
+{
+  if (!aConn->mQueue.empty() || aConn->mInProcess) {
+    // not idle, just waiting for its turn
+    restartIdleTimer(aConn);
+    return;
+  }
+  mTimedOut.inc();
+  LOG(LOG_INFO, "Modbus TCP: closing idle connection from %s", aConn->mPeer.c_str());
+  closeConnection(aConn);
+}
+
+
+void ModbusTcpServer::scheduleNext()
+{
+  // round robin: start the next queued request of every connection not already processing one
+  size_t numConns = mConnections.size();
+  if (numConns==0) return;
+  if (mNextConn>=numConns) mNextConn = 0;
+  size_t start = mNextConn;
+  for (size_t n=0; n<numConns && n<mConnections.size(); n++) {
+    ModbusTcpConnectionPtr conn = mConnections[(start+n)%numConns];
+    if (!conn->mOpen || conn->mInProcess || conn->mQueue.empty()) continue;
+    ModbusTcpRequestPtr req = conn->mQueue.front();
+    conn->mQueue.pop_front();
+    conn->mQueueWait.record(MainLoop::now()-req->mQueued);
+    conn->mInProcess = true;
+    if (req->mException || req->mFunction==0x11) {
+      // answered without accessing registers
+      requestDone(conn, req, 0);
+    }
+    else if (!mRequestHandler) {
+      requestDone(conn, req, ModbusTcpRequest::slaveDeviceFailure);
+    }
+    else {
+      mRequestHandler(req, boost::bind(&ModbusTcpServer::requestDone, this, conn, req, _1));
+    }
+  }
+  // next round starts with the following connection
+  mNextConn = start+1;
+}
+
+
+void ModbusTcpServer::requestDone(ModbusTcpConnectionPtr aConn, ModbusTcpRequestPtr aRequest, uint8_t aException)
+{
+  if (aRequest->mException==0) aRequest->mException = aException;
+  aConn->mInProcess = false;
+  aConn->mRequests.inc();
+  if (aRequest->mException) aConn->mExceptions.inc();
+  if (aConn->mOpen) {
+    sendResponse(aConn.get(), aRequest);
+    aConn->mLatency.record(MainLoop::now()-aRequest->mQueued);
+  }
+  // next request of this connection from mainloop, handler might have called us synchronously
+  MainLoop::currentMainLoop().executeNow(boost::bind(&ModbusTcpServer::scheduleNext, this));
+}
+
+
+static void appendWord(string& aStr, uint16_t aWord)
+{
+  aStr += (char)(aWord>>8);
+  aStr += (char)(aWord&0xFF);
+}
+
+
+void ModbusTcpServer::sendResponse(ModbusTcpConnection* aConn, ModbusTcpRequestPtr aRequest)
+{
+  string pdu;
+  if (aRequest->mException) {
+    pdu += (char)(aRequest->mFunction|0x80);
+    pdu += (char)aRequest->mException;
+  }
+  else {
+    pdu += (char)aRequest->mFunction;
+    switch (aRequest->mFunction) {
+      case 0x03:
+      case 0x04:
+        pdu += (char)(2*aRequest->mCount);
+        for (size_t i=0; i<aRequest->mValues.size(); i++) appendWord(pdu, aRequest->mValues[i]);
+        break;
+      case 0x06:
+        appendWord(pdu, aRequest->mAddr);
+        appendWord(pdu, aRequest->mValues[0]);
+        break;
+      case 0x10:
+        appendWord(pdu, aRequest->mAddr);
+        appendWord(pdu, aRequest->mCount);
+        break;
+      case 0x11: {
+        // like libmodbus: byte count, slave id, run indicator, additional data
+        string id = mSlaveId.substr(0, maxMbapLength-5);
+        pdu += (char)(id.size()+2);
+        pdu += (char)aRequest->mUnitId;
+        pdu += (char)0xFF;
+        pdu += id;
+        break;
+      }
+    }
+  }
+  appendWord(aConn->mTxBuf, aRequest->mTransactionId);
+  appendWord(aConn->mTxBuf, 0); // protocol identifier
+  appendWord(aConn->mTxBuf, (uint16_t)(pdu.size()+1));
+  aConn->mTxBuf += (char)aRequest->mUnitId;
+  aConn->mTxBuf += pdu;
+  sendPending(aConn);
+}
+
+
+void ModbusTcpServer::sendPending(ModbusTcpConnection* aConn)
+{
+  ErrorPtr err;
+  while (!aConn->mTxBuf.empty()) {
+    size_t n = aConn->mComm->transmitBytes(aConn->mTxBuf.size(), (const uint8_t*)aConn->mTxBuf.data(), err);
+    if (Error::notOK(err)) {
+      closeConnection(aConn);
+      return;
+    }
+    if (n==0) break;
+    aConn->mBytesOut.inc(n);
+    aConn->mTxBuf.erase(0, n);
+  }
+  if (!aConn->mTxBuf.empty() && !aConn->mTxWaiting) {
+    // socket buffer full, continue when it can take more
+    aConn->mTxWaiting = true;
+    aConn->mComm->setTransmitHandler(boost::bind(&ModbusTcpServer::readyForTransmit, this, aConn, _1));
+  }
+}
+
+
+void ModbusTcpServer::readyForTransmit(ModbusTcpConnection* aConn, ErrorPtr aError)
+{
+  if (!aConn->mOpen) return;
+  if (Error::notOK(aError)) {
+    closeConnection(aConn);
+    return;
+  }
+  sendPending(aConn);
+  if (aConn->mTxBuf.empty() && aConn->mTxWaiting) {
+    aConn->mTxWaiting = false;
+    // do not replace the handler while it is executing
+    MainLoop::currentMainLoop().executeNow(boost::bind(&ModbusTcpServer::stopTransmitHandler, this, ModbusTcpConnectionPtr(aConn)));
+  }
+}
+
+
+void ModbusTcpServer::stopTransmitHandler(ModbusTcpConnectionPtr aConn)
+{
+  if (aConn->mOpen && !aConn->mTxWaiting) aConn->mComm->setTransmitHandler(StatusCB());
+}
+
+
+JsonObjectPtr ModbusTcpServer::getStatistics()
+{
+  JsonObjectPtr stats = JsonObject::newObj();
+  stats->add("connections", JsonObject::newInt64(mConnections.size()));
+  stats->add("maxConnections", JsonObject::newInt32(mMaxConnections));
+  stats->add("accepted", JsonObject::newInt64(mAccepted.value()));
+  stats->add("rejected", JsonObject::newInt64(mRejected.value()));
+  stats->add("timedOut", JsonObject::newInt64(mTimedOut.value()));
+  stats->add("protocolErrors", JsonObject::newInt64(mProtocolErrors.value()));
+  JsonObjectPtr clients = JsonObject::newArray();
+  MLMicroSeconds now = MainLoop::now();
+  for (size_t i=0; i<mConnections.size(); i++) {
+    ModbusTcpConnectionPtr conn = mConnections[i];
+    JsonObjectPtr c = JsonObject::newObj();
+    c->add("peer", JsonObject::newString(conn->mPeer));
+    c->add("connectedFor", JsonObject::newDouble((double)(now-conn->mSince)/Second));
+    c->add("requests", JsonObject::newInt64(conn->mRequests.value()));
+    c->add("exceptions", JsonObject::newInt64(conn->mExceptions.value()));
+    c->add("busyRejects", JsonObject::newInt64(conn->mBusyRejects.value()));
+    c->add("queued", JsonObject::newInt64(conn->mQueue.size()));
+    c->add("bytesIn", JsonObject::newInt64(conn->mBytesIn.value()));
+    c->add("bytesOut", JsonObject::newInt64(conn->mBytesOut.value()));
+    c->add("queueWait", conn->mQueueWait.json());
+    c->add("latency", conn->mLatency.json());
+    clients->arrayAppend(c);
+  }
+  stats->add("clients", clients);
+  return stats;
+}
+
+
+void ModbusTcpServer::resetStatistics()
+{
+  mAccepted.reset();
+  mRejected.reset();
+  mTimedOut.reset();
+  mProtocolErrors.reset();
+  for (size_t i=0; i<mConnections.size(); i++) {
+    ModbusTcpConnectionPtr conn = mConnections[i];
+    conn->mRequests.reset();
+    conn->mExceptions.reset();
+    conn->mBusyRejects.reset();
+    conn->mBytesIn.reset();
+    conn->mBytesOut.reset();
+    conn->mQueueWait.reset();
+    conn->mLatency.reset();
+  }
+}
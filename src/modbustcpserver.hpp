@@ -0,0 +1,185 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__modbustcpserver__
+#define __kksdcmd__modbustcpserver__
+
+#include "p44utils_common.hpp"
+#include "socketcomm.hpp"
+#include "jsonobject.hpp"
+#include "corestats.hpp"
+
+#include <deque>
+
+using namespace std;
+
+namespace p44 {
+
+  /// called when a request is processed
+  /// @param aException 0 for success, modbus exception code otherwise
+  typedef boost::function<void (uint8_t aException)> ModbusTcpDoneCB;
+
+  /// a modbus register access request received via TCP
+  class ModbusTcpRequest : public P44Obj
+  {
+    friend class ModbusTcpServer;
+
+    uint16_t mTransactionId; ///< MBAP transaction identifier, returned unchanged
+    uint8_t mUnitId; ///< MBAP unit identifier, returned unchanged
+    uint8_t mFunction; ///< modbus function code
+    uint8_t mException; ///< exception detected while parsing, 0 if none
+    uint16_t mAddr; ///< first register
+    uint16_t mCount; ///< number of registers
+    std::vector<uint16_t> mValues; ///< values written, or values read to return
+    MLMicroSeconds mQueued; ///< when the request was queued
+
+  public:
+
+    // modbus exception codes
+    static const uint8_t illegalFunction = 0x01;
+    static const uint8_t illegalDataAddress = 0x02;
+    static const uint8_t illegalDataValue = 0x03;
+    static const uint8_t slaveDeviceFailure = 0x04;
+    static const uint8_t slaveDeviceBusy = 0x06;
+
+    ModbusTcpRequest();
+
+    /// @return first register number
+    uint16_t addr() const { return mAddr; };
+    /// @return number of registers
+    uint16_t count() const { return mCount; };
+    /// @return true for accessing input registers
+    bool input() const { return mFunction==0x04; };
+    /// @return true for writing registers
+    bool write() const { return mFunction==0x06 || mFunction==0x10; };
+    /// @return value written to the aIdx-th register (write requests only)
+    uint16_t value(size_t aIdx) const { return mValues[aIdx]; };
+    /// set the value to return for the aIdx-th register (read requests only)
+    void setValue(size_t aIdx, uint16_t aValue) { mValues[aIdx] = aValue; };
+  };
+  typedef boost::intrusive_ptr<ModbusTcpRequest> ModbusTcpRequestPtr;
+
+  /// process a register access request
+  /// @param aRequest the request. For reads, the handler must set all values (see ModbusTcpRequest::setValue())
+  /// @param aDoneCB must be called when done, can be later (e.g. after asynchronous SPI access)
+  typedef boost::function<void (ModbusTcpRequestPtr aRequest, ModbusTcpDoneCB aDoneCB)> ModbusTcpRequestCB;
+
+
+  /// one client connection
+  class ModbusTcpConnection : public P44Obj
+  {
+    friend class ModbusTcpServer;
+
+    SocketCommPtr mComm; ///< the connection
+    bool mOpen; ///< set while connection is open
+    string mPeer; ///< peer address, determined on first data received
+    MLMicroSeconds mSince; ///< when the connection was accepted
+    string mRxBuf; ///< received bytes not yet forming a complete frame
+    string mTxBuf; ///< response bytes not yet sent
+    bool mTxWaiting; ///< set when waiting for the connection to accept more data
+    std::deque<ModbusTcpRequestPtr> mQueue; ///< requests waiting to be processed
+    bool mInProcess; ///< set while a request of this connection is being processed
+    MLTicket mIdleTicket; ///< idle timeout
+    // statistics
+    StatCounter mRequests; ///< number of requests answered
+    StatCounter mExceptions; ///< number of requests answered with an exception
+    StatCounter mBusyRejects; ///< number of requests rejected because the queue was full
+    StatCounter mBytesIn; ///< number of bytes received
+    StatCounter mBytesOut; ///< number of bytes sent
+    Log2Histogram mQueueWait; ///< time in uS requests wait in the queue
+    Log2Histogram mLatency; ///< time in uS from receiving a request to sending the response
+
+    ModbusTcpConnection(SocketCommPtr aComm);
+  };
+  typedef boost::intrusive_ptr<ModbusTcpConnection> ModbusTcpConnectionPtr;
+
+
+  /// modbus TCP server handling many clients concurrently: every connection has its own request queue,
+  /// queues are served round robin, one request per connection at a time, and requests may be processed
+  /// asynchronously, so a client causing slow (SPI) accesses does not delay the others (e.g. cache hits)
+  class ModbusTcpServer : public P44Obj
+  {
+    SocketCommPtr mServer; ///< listening socket
+    ModbusTcpRequestCB mRequestHandler; ///< processes register accesses
+    string mSlaveId; ///< returned for "report slave ID" requests
+    int mMaxConnections; ///< max number of simultaneous connections
+    size_t mMaxQueue; ///< max number of queued requests per connection
+    MLMicroSeconds mIdleTimeout; ///< connections without requests for this long are closed, Never for no timeout
+
+    std::vector<ModbusTcpConnectionPtr> mConnections; ///< open connections
+    size_t mNextConn; ///< round robin index into mConnections
+
+    // statistics
+    StatCounter mAccepted; ///< number of connections accepted
+    StatCounter mRejected; ///< number of connections rejected because of the connection limit
+    StatCounter mTimedOut; ///< number of connections closed for being idle
+    StatCounter mProtocolErrors; ///< number of connections closed because of invalid frames
+
+  public:
+
+    /// @param aRequestHandler processes register read and write requests
+    ModbusTcpServer(ModbusTcpRequestCB aRequestHandler);
+    virtual ~ModbusTcpServer();
+
+    /// set limits
+    /// @param aMaxConnections max number of simultaneous client connections, further connections are refused
+    /// @param aMaxQueue max number of queued requests per connection, further requests are answered with "slave device busy"
+    /// @param aIdleTimeout close connections without requests for this long, Never for no timeout
+    void setLimits(int aMaxConnections, size_t aMaxQueue, MLMicroSeconds aIdleTimeout);
+
+    /// @param aSlaveId text returned for "report slave ID" requests
+    void setSlaveId(const string aSlaveId) { mSlaveId = aSlaveId; };
+
+    /// start listening
+    /// @param aConnectionSpec ip:port, 0.0.0.0 (or no ip) to accept connections from other hosts
+    /// @param aDefaultPort port to use if aConnectionSpec has none
+    /// @return OK or error
+    ErrorPtr start(const string aConnectionSpec, uint16_t aDefaultPort);
+
+    /// @return json object with connection counters and per client statistics
+    JsonObjectPtr getStatistics();
+
+    /// reset the statistics (including those of the open connections)
+    void resetStatistics();
+
+  private:
+
+    SocketCommPtr serverConnectionHandler(SocketCommPtr aServerSocketComm);
+    void connectionStatus(ModbusTcpConnection* aConn, SocketCommPtr aSocketComm, ErrorPtr aError);
+    void closeConnection(ModbusTcpConnection* aConn);
+    void removeConnection(ModbusTcpConnectionPtr aConn);
+    void dataReceived(ModbusTcpConnection* aConn, ErrorPtr aError);
+    ModbusTcpRequestPtr parseRequest(const uint8_t* aFrame, size_t aLen);
+    void restartIdleTimer(ModbusTcpConnection* aConn);
+    void idleTimeout(ModbusTcpConnection* aConn);
+    void scheduleNext();
+    void requestDone(ModbusTcpConnectionPtr aConn, ModbusTcpRequestPtr aRequest, uint8_t aException);
+    void sendResponse(ModbusTcpConnection* aConn, ModbusTcpRequestPtr aRequest);
+    void sendPending(ModbusTcpConnection* aConn);
+    void readyForTransmit(ModbusTcpConnection* aConn, ErrorPtr aError);
+    void stopTransmitHandler(ModbusTcpConnectionPtr aConn);
+
+  };
+  typedef boost::intrusive_ptr<ModbusTcpServer> ModbusTcpServerPtr;
+
+} // namespace p44
+
+#endif // __kksdcmd__modbustcpserver__
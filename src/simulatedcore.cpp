@@ -0,0 +1,146 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+
+#include "simulatedcore.hpp"
+
+using namespace p44;
+
+
+SimulatedCore::SimulatedCore() :
+  mMinFiller(0),
+  mMaxFiller(3),
+  mCrcErrorRate(0),
+  mProtoErrorRate(0),
+  mFrameTime(0),
+  mByteTime(0),
+  mSelected(false),
+  mRxLen(0),
+  mTxLen(0),
+  mTxPos(0),
+  mFrames(0),
+  mBadFrames(0)
+{
+  // like real core memory, but recognizable: each byte reflects its address
+  for (size_t i=0; i<memSize; i++) mMem[i] = (uint8_t)i;
+}
+
+
+SimulatedCore::~SimulatedCore()
+{
+}
+
+
+bool SimulatedCore::inject(int aRate)
+{
+  return aRate>0 && rand()%1000<aRate;
+}
+
+
+bool SimulatedCore::rawWriteRead(unsigned int aNumTx, const uint8_t *aTxBuffer, unsigned int aNumRx, uint8_t *aRxBuffer, bool aFullDuplex, bool aDoNotDeselect)
+{
+  if (!mSelected) {
+    // start of new transaction
+    mSelected = true;
+    mRxLen = 0;
+    mTxLen = 0;
+    mTxPos = 0;
+    if (mFrameTime>0) MainLoop::sleep(mFrameTime);
+  }
+  if (mByteTime>0) MainLoop::sleep(mByteTime*(aFullDuplex ? max(aNumTx, aNumRx) : aNumTx+aNumRx));
+  // receive
+  for (unsigned int i=0; i<aNumTx; i++) {
+    if (mRxLen<sizeof(mRx)) mRx[mRxLen++] = aTxBuffer[i];
+    if (mRxLen==5 && mRx[1]==0x02) {
+      // read header complete, prepare response
+      if (!processHeader()) mBadFrames++;
+    }
+  }
+  // send
+  for (unsigned int i=0; i<aNumRx; i++) {
+    aRxBuffer[i] = mTxPos<mTxLen ? mTx[mTxPos++] : 0xFF; // idle MISO
+  }
+  if (!aDoNotDeselect) endTransaction();
+  return true;
+}
+
+
+bool SimulatedCore::processHeader()
+{
+  if (mRx[0]!=0xAB) return false;
+  uint16_t addr = mRx[2] + ((uint16_t)mRx[3]<<8);
+  uint8_t len = mRx[4];
+  // delay fillers
+  int n = mMinFiller;
+  if (mMaxFiller>mMinFiller) n += rand()%(mMaxFiller-mMinFiller+1);
+  if (n>255) n = 255;
+  mTxLen = 0;
+  while (n-- > 0) mTx[mTxLen++] = 0xFF;
+  if (mTxLen>0 && inject(mProtoErrorRate)) mTx[mTxLen-1] = 0x55; // not a valid filler
+  // lead-in, data
+  uint16_t crc = CoreSPIProto::crc16(0, 5, mRx);
+  size_t start = mTxLen;
+  mTx[mTxLen++] = 0xAB;
+  for (int i=0; i<len; i++) mTx[mTxLen++] = mem(addr+i);
+  crc = CoreSPIProto::crc16(crc, mTxLen-start, mTx+start);
+  if (inject(mCrcErrorRate)) crc ^= 0x0001;
+  mTx[mTxLen++] = crc & 0xFF;
+  mTx[mTxLen++] = (crc>>8) & 0xFF;
+  return true;
+}
+
+
+void SimulatedCore::processWrite()
+{
+  uint16_t addr = mRx[2] + ((uint16_t)mRx[3]<<8);
+  uint8_t len = mRx[4];
+  if (mRxLen<(size_t)5+len+2) {
+    mBadFrames++; // incomplete
+    return;
+  }
+  uint16_t crc = CoreSPIProto::crc16(0, 5+len, mRx);
+  uint16_t recCrc = mRx[5+len] + ((uint16_t)mRx[5+len+1]<<8);
+  if (recCrc!=crc || inject(mCrcErrorRate)) {
+    mBadFrames++; // core ignores frames with bad CRC
+    return;
+  }
+  for (int i=0; i<len; i++) mem(addr+i) = mRx[5+i];
+}
+
+
+void SimulatedCore::endTransaction()
+{
+  if (mRxLen>=5 && mRx[0]==0xAB && mRx[1]==0x01) {
+    processWrite();
+  }
+  else if (mRxLen<5 || mRx[0]!=0xAB || mRx[1]!=0x02) {
+    mBadFrames++;
+  }
+  mFrames++;
+  mSelected = false;
+}
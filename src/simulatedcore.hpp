@@ -0,0 +1,107 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__simulatedcore__
+#define __kksdcmd__simulatedcore__
+
+#include "p44utils_common.hpp"
+#include "corespiproto.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  /// Simulated core module, implementing the core side of the SPI protocol on a register memory
+  /// @note not thread safe by itself, but CoreSPIProto serializes all accesses via the bus mutex
+  class SimulatedCore : public CoreSPITransport
+  {
+    typedef CoreSPITransport inherited;
+
+    // register memory
+    static const size_t memSize = 256;
+    uint8_t mMem[memSize];
+
+    // simulation parameters
+    int mMinFiller; ///< min number of 0xFF delay bytes before the read data lead-in
+    int mMaxFiller; ///< max number of 0xFF delay bytes before the read data lead-in
+    int mCrcErrorRate; ///< per 1000 frames: number of frames with wrong CRC
+    int mProtoErrorRate; ///< per 1000 frames: number of read frames with invalid filler byte
+    MLMicroSeconds mFrameTime; ///< simulated fixed time per frame
+    MLMicroSeconds mByteTime; ///< simulated time per byte transferred
+
+    // transaction state
+    bool mSelected; ///< set while a transaction is in progress (chip select active)
+    uint8_t mRx[5+255+2]; ///< received frame bytes
+    size_t mRxLen; ///< number of frame bytes received so far
+    uint8_t mTx[255+255+3]; ///< response bytes for a read (fillers, lead-in, data, CRC)
+    size_t mTxLen; ///< number of response bytes
+    size_t mTxPos; ///< next response byte to send
+
+    // statistics
+    uint64_t mFrames; ///< number of frames processed
+    uint64_t mBadFrames; ///< number of frames received with errors
+
+  public:
+
+    SimulatedCore();
+    virtual ~SimulatedCore();
+
+    /// set filler byte range
+    /// @param aMin min number of 0xFF delay bytes before read data
+    /// @param aMax max number of 0xFF delay bytes before read data, actual number is random between aMin and aMax
+    void setFiller(int aMin, int aMax) { mMinFiller = aMin; mMaxFiller = aMax>aMin ? aMax : aMin; };
+
+    /// set error injection rates
+    /// @param aCrcErrorRate per 1000 frames: frames answered with wrong CRC
+    /// @param aProtoErrorRate per 1000 read frames: frames answered with an invalid delay filler byte
+    void setErrorRates(int aCrcErrorRate, int aProtoErrorRate) { mCrcErrorRate = aCrcErrorRate; mProtoErrorRate = aProtoErrorRate; };
+
+    /// set simulated timing (the calling thread is blocked accordingly)
+    /// @param aFrameTime fixed time per frame
+    /// @param aByteTime time per byte transferred
+    void setTiming(MLMicroSeconds aFrameTime, MLMicroSeconds aByteTime) { mFrameTime = aFrameTime; mByteTime = aByteTime; };
+
+    /// direct access to the simulated register memory
+    /// @param aAddr address
+    /// @return reference to the memory byte (address wraps around at memory size)
+    uint8_t& mem(uint16_t aAddr) { return mMem[aAddr%memSize]; };
+
+    /// @return number of frames processed so far
+    uint64_t frames() { return mFrames; };
+
+    /// @return number of frames received with errors so far
+    uint64_t badFrames() { return mBadFrames; };
+
+    virtual bool rawWriteRead(unsigned int aNumTx, const uint8_t *aTxBuffer, unsigned int aNumRx, uint8_t *aRxBuffer, bool aFullDuplex, bool aDoNotDeselect) P44_OVERRIDE;
+
+  private:
+
+    void endTransaction();
+    bool processHeader();
+    void processWrite();
+    bool inject(int aRate);
+
+  };
+  typedef boost::intrusive_ptr<SimulatedCore> SimulatedCorePtr;
+
+} // namespace p44
+
+#endif // __kksdcmd__simulatedcore__
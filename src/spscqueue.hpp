@@ -0,0 +1,78 @@
+//
+//  Copyright (c) 2022 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of kksdcmd.
+//
+//  kksdcmd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  kksdcmd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with kksdcmd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __kksdcmd__spscqueue__
+#define __kksdcmd__spscqueue__
+
+#include <atomic>
+#include <cstddef>
+
+namespace p44 {
+
+  /// lock-free bounded queue for exactly one producer thread and one consumer thread
+  /// @tparam T item type, must be copyable (usually a plain pointer)
+  /// @tparam N number of slots, queue can hold N-1 items
+  template<typename T, size_t N> class SPSCQueue
+  {
+    T mItems[N];
+    std::atomic<size_t> mHead; ///< next slot to read, only written by consumer
+    std::atomic<size_t> mTail; ///< next slot to write, only written by producer
+
+  public:
+
+    SPSCQueue() : mHead(0), mTail(0) {};
+
+    /// append item (producer thread only)
+    /// @param aItem the item
+    /// @return false if queue is full
+    bool push(const T& aItem)
+    {
+      size_t t = mTail.load(std::memory_order_relaxed);
+      size_t n = (t+1)%N;
+      if (n==mHead.load(std::memory_order_acquire)) return false; // full
+      mItems[t] = aItem;
+      mTail.store(n, std::memory_order_release);
+      return true;
+    }
+
+    /// remove oldest item (consumer thread only)
+    /// @param aItem receives the item
+    /// @return false if queue is empty
+    bool pop(T& aItem)
+    {
+      size_t h = mHead.load(std::memory_order_relaxed);
+      if (h==mTail.load(std::memory_order_acquire)) return false; // empty
+      aItem = mItems[h];
+      mHead.store((h+1)%N, std::memory_order_release);
+      return true;
+    }
+
+    /// @return true if queue is empty (exact only when called from consumer thread)
+    bool empty() const
+    {
+      return mHead.load(std::memory_order_acquire)==mTail.load(std::memory_order_acquire);
+    }
+
+  };
+
+} // namespace p44
+
+#endif // __kksdcmd__spscqueue__